@@ -1,22 +1,62 @@
+#ifdef __linux__
+#define _GNU_SOURCE // fallocate
+#endif
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
 #include "headers.h"
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12, 119) // from <linux/fs.h>, which also defines its own BLOCK_SIZE
+#endif
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC32C 1
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define COMMAND_LENGTH 100
+#define PREFETCH_BATCH_BLOCKS 16 // data blocks read ahead between commands after a lazy mount
+#define BATCH_OUTPUT_BUFFER 65536 // stdout buffer in batch mode
 
 // ---------------------------------------------------------------------------
 // MAIN FUNCTION
 // ---------------------------------------------------------------------------
-#ifndef TEST
-int main()
+#if !defined(TEST) && !defined(FS_NO_MAIN)
+/**
+ * @brief Interactive shell over particion.bin, or batch mode for scripts.
+ *
+ * Usage: filesystem [-l] [-f script] [-n ops]
+ *   -l  lazy mount: only the metadata blocks are read before the first command
+ *   -f  run the commands in script (batch mode)
+ *   -n  in batch mode, save every ops modifying commands (default: once at the end)
+ *
+ * Batch mode is also used when standard input is not a terminal. It prints no prompt
+ * and no confirmations, buffers the output, and exits with 1 if any command failed.
+ */
+int main(int argc, char *argv[])
 {
-   // Buffers for user input
+   // Input line; the order and its arguments are parsed in place and point into it
    char command[COMMAND_LENGTH];
-   char order[COMMAND_LENGTH];
-   char argument1[COMMAND_LENGTH];
-   char argument2[COMMAND_LENGTH];
+   char *order;
+   char *argument1;
+   char *argument2;
 
    // Structures holding filesystem metadata and data
    EXT_SIMPLE_SUPERBLOCK superBlock;
@@ -24,47 +64,92 @@ int main()
    EXT_INODE_BLOCK inodeBlock;
    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
    EXT_DATA data[MAX_DATA_BLOCKS];
-   EXT_DATA fileData[MAX_PARTITION_BLOCKS];
+
+   int lazy = 0;
+   const char *scriptPath = NULL;
+   int commitInterval = -1;
+   for (int i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "-l") == 0)
+      {
+         lazy = 1;
+      }
+      else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+      {
+         scriptPath = argv[++i];
+      }
+      else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+      {
+         commitInterval = atoi(argv[++i]);
+      }
+      else
+      {
+         FsErrorf("Usage: %s [-l] [-f script] [-n ops]\n", argv[0]);
+         return 1;
+      }
+   }
+
+   FILE *input = stdin;
+   if (scriptPath != NULL && (input = fopen(scriptPath, "r")) == NULL)
+   {
+      FsPerror(scriptPath);
+      return 1;
+   }
+   int batch = scriptPath != NULL || !isatty(fileno(stdin));
+   if (batch)
+   {
+      static char outputBuffer[BATCH_OUTPUT_BUFFER];
+      setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+      fsRuntime->terse = 1;
+      fsRuntime->commitInterval = commitInterval;
+   }
+   fsRuntime->commandInput = input;
 
    // 1) Open the "particion.bin" file (simulating a disk partition)
    FILE *file = fopen("particion.bin", "r+b");
    if (file == NULL)
    {
-      perror("Error opening file particion.bin");
+      FsPerror("Error opening file particion.bin");
       return 1;
    }
 
-   // 2) Read the entire partition into memory for quick operations
-   fread(&fileData, BLOCK_SIZE, MAX_PARTITION_BLOCKS, file);
+   // 2) Read the entire partition into memory for quick operations, or just its metadata
+   if ((lazy ? LoadFilesystemLazy(file, &superBlock, &byteMaps, &inodeBlock, directory)
+             : LoadFilesystem(file, &superBlock, &byteMaps, &inodeBlock, directory, data)) != 0)
+   {
+      FsErrorf("Error reading partition particion.bin\n");
+      fclose(file);
+      return 1;
+   }
 
-   // 3) Extract each structure from the loaded blocks in memory
-   memcpy(&superBlock, (EXT_SIMPLE_SUPERBLOCK *)&fileData[0], BLOCK_SIZE);
-   memcpy(&byteMaps, (EXT_BYTE_MAPS *)&fileData[1], BLOCK_SIZE);
-   memcpy(&inodeBlock, (EXT_INODE_BLOCK *)&fileData[2], BLOCK_SIZE);
-   memcpy(directory, (EXT_DIRECTORY_ENTRY *)&fileData[3], sizeof(EXT_DIRECTORY_ENTRY) * MAX_FILES);
-   memcpy(&data, (EXT_DATA *)&fileData[4], MAX_DATA_BLOCKS * BLOCK_SIZE);
+   // 3) Validate what the last session may have left inconsistent and mark the partition in use
+   MountFilesystem(directory, &inodeBlock, &byteMaps, &superBlock, data, file);
 
    // 4) Main loop: read commands until user exits or EOF
+   int commandNumber = 0;
+   int executed = 0;
+   int failed = 0;
    for (;;)
    {
-      do
+      if (!batch)
       {
-         printf("\n>> ");
-         if (!fgets(command, COMMAND_LENGTH, stdin))
-         {
-            // If stdin closes or an error occurs, exit gracefully
-            break;
-         }
-         // Remove trailing newline, if any
-         char *newLine = strchr(command, '\n');
-         if (newLine)
-         {
-            *newLine = '\0';
-         }
-      } while (CheckCommand(command, order, argument1, argument2) != 0);
+         FsPrintf("\n>> ");
+      }
+      if (!fgets(command, COMMAND_LENGTH, input))
+      {
+         // End of input (or a read error) leaves as 'exit' does
+         break;
+      }
+      // Skip blank lines, and comment lines in scripts
+      if (CheckCommand(command, &order, &argument1, &argument2) != 0 || (batch && order[0] == '#'))
+      {
+         continue;
+      }
+      commandNumber++;
 
       // Process the user command in a dedicated function
-      ProcessCommand(
+      double commandStart = NowSeconds();
+      int result = ProcessCommand(
           order,
           argument1,
           argument2,
@@ -74,818 +159,5425 @@ int main()
           directory,
           data,
           file);
+      fsRuntime->stats.commandSeconds += NowSeconds() - commandStart;
+      fsRuntime->stats.commands++;
+      if (result == COMMAND_EXIT)
+      {
+         break;
+      }
+      executed++;
+      if (result != 0)
+      {
+         failed++;
+         if (batch)
+         {
+            FsErrorf("%s: command %d '%s' failed\n", scriptPath != NULL ? scriptPath : "stdin", commandNumber, order);
+         }
+      }
+      TrimBlockCache(&superBlock, &byteMaps, data);
+      if (lazy)
+      {
+         // Warm the cache a little between commands
+         PrefetchBlocks(&byteMaps, data, PREFETCH_BATCH_BLOCKS);
+      }
    }
 
-   fclose(file);
-   return 0;
+   // 5) Save everything (the only save in batch mode without -n) and mark the partition clean
+   UnmountFilesystem(directory, &inodeBlock, &byteMaps, &superBlock, data, file);
+   int saveFailed = ferror(file) || fclose(file) != 0;
+   if (input != stdin)
+   {
+      fclose(input);
+   }
+   if (batch)
+   {
+      fflush(stdout);
+      FsErrorf("%d commands, %d failed%s\n", executed, failed, saveFailed ? ", partition not saved" : "");
+   }
+   return failed > 0 || saveFailed ? 1 : 0;
 }
-#endif // TEST
+#endif // !TEST && !FS_NO_MAIN
 
 // ---------------------------------------------------------------------------
 // COMMAND PARSING AND PROCESSING
 // ---------------------------------------------------------------------------
 
+/* Cuts the next space-delimited token out of the line in place and advances past it */
+static char *SplitToken(char **cursor)
+{
+   char *start = *cursor + strspn(*cursor, " ");
+   char *end = start + strcspn(start, " ");
+   if (*end != '\0')
+   {
+      *end++ = '\0';
+   }
+   *cursor = end;
+   return start;
+}
+
 /**
- * @brief Splits the user input into 'order', 'arg1', and 'arg2'.
- * @return 0 if successfully parses something, or -1 if it fails to parse tokens.
+ * @brief Splits the user input in place into 'order', 'arg1' and 'arg2', which point
+ *        into commandStr: the line ends at a newline, and arg2 is the rest of the line
+ *        after arg1 (e.g. file content with spaces). Nothing is copied.
+ * @return 0 if successfully parses something, or -1 if the line is blank.
  */
-int CheckCommand(char *commandStr, char *command, char *arg1, char *arg2)
+int CheckCommand(char *commandStr, char **command, char **arg1, char **arg2)
+{
+   char *cursor = commandStr;
+   cursor[strcspn(cursor, "\r\n")] = '\0';
+
+   *command = SplitToken(&cursor);
+   if (**command == '\0')
+   {
+      return -1;
+   }
+   *arg1 = SplitToken(&cursor);
+   *arg2 = cursor;
+   return 0;
+}
+
+/* The mounted filesystem and the arguments a command handler works on */
+typedef struct
 {
-    char commandCopy[COMMAND_LENGTH];
-    strncpy(commandCopy, commandStr, COMMAND_LENGTH);
-    commandCopy[COMMAND_LENGTH - 1] = '\0';
+   EXT_SIMPLE_SUPERBLOCK *superBlock;
+   EXT_BYTE_MAPS *byteMaps;
+   EXT_INODE_BLOCK *inodeBlock;
+   EXT_DIRECTORY_ENTRY *directory;
+   EXT_DATA *data;
+   FILE *file;
+   const char *arg1;
+   const char *arg2;
+} COMMAND_CONTEXT;
 
-    // Remove newline if present
-    char *newline = strchr(commandCopy, '\n');
-    if (newline)
-        *newline = '\0';
+/* Handlers return what ProcessCommand returns */
+typedef int (*COMMAND_HANDLER)(COMMAND_CONTEXT *context);
 
-    // Tokenize the main command
-    char *token = strtok(commandCopy, " ");
-    if (token == NULL)
-        return -1;
-    strcpy(command, token);
+typedef struct
+{
+   const char *name;
+   int requiredArgs;      // arguments that must be present; fewer prints the usage
+   const char *usage;
+   COMMAND_HANDLER handler;
+} COMMAND_SPEC;
 
-    // Tokenize arg1 (e.g., file name)
-    token = strtok(NULL, " ");
-    if (token)
-        strcpy(arg1, token);
-    else
-        arg1[0] = '\0';
+/* Saves a successful change the way the current mode asks for */
+static int SaveIfChanged(COMMAND_CONTEXT *context, int result)
+{
+   if (result == 0)
+   {
+      SaveAfterChange(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                      context->data, context->file);
+   }
+   return result == 0 ? 0 : -1;
+}
 
-    // Capture the rest as arg2 (e.g., content, copy file name...)
-    char *remaining = strtok(NULL, "");
-    if (remaining)
-        strcpy(arg2, remaining);
-    else
-        arg2[0] = '\0';
+static int CommandDir(COMMAND_CONTEXT *context)
+{
+   ListDirectory(context->directory, context->inodeBlock);
+   return 0;
+}
 
-    return 0;
+static int CommandInfo(COMMAND_CONTEXT *context)
+{
+   PrintSuperBlock(context->superBlock);
+   return 0;
 }
 
+static int CommandBytemaps(COMMAND_CONTEXT *context)
+{
+   PrintByteMaps(context->byteMaps);
+   return 0;
+}
 
-/**
- * @brief Dispatches the user command to the appropriate function. This approach
- *        simplifies main() and centralizes command-handling logic.
- */
-void ProcessCommand(
-    const char *order,
-    const char *arg1,
-    const char *arg2,
-    EXT_SIMPLE_SUPERBLOCK *superBlock,
-    EXT_BYTE_MAPS *byteMaps,
-    EXT_INODE_BLOCK *inodeBlock,
-    EXT_DIRECTORY_ENTRY *directory,
-    EXT_DATA *data,
-    FILE *file)
+static int CommandRename(COMMAND_CONTEXT *context)
 {
-   if (strcmp(order, "dir") == 0)
-   {
-      ListDirectory(directory, inodeBlock);
-   }
-   else if (strcmp(order, "info") == 0)
-   {
-      PrintSuperBlock(superBlock);
-   }
-   else if (strcmp(order, "bytemaps") == 0)
-   {
-      PrintByteMaps(byteMaps);
-   }
-   else if (strcmp(order, "rename") == 0)
+   return SaveIfChanged(context, RenameFile(context->directory, context->inodeBlock,
+                                            (char *)context->arg1, (char *)context->arg2));
+}
+
+/* print <file> [offset] [length]: a negative offset counts back from the end */
+static int CommandPrint(COMMAND_CONTEXT *context)
+{
+   long offset = 0;
+   size_t length = PRINT_TO_END;
+   const char *range = context->arg2;
+   if (*range != '\0')
    {
-      if (strlen(arg1) == 0 || strlen(arg2) == 0)
+      char *end;
+      offset = strtol(range, &end, 10);
+      int valid = end != range;
+      if (valid && *end == ' ')
       {
-         fprintf(stderr, "Usage: rename <old_name> <new_name>\n");
+         const char *lengthText = end + 1;
+         long value = strtol(lengthText, &end, 10);
+         valid = end != lengthText && value >= 0;
+         length = value;
       }
-      else
+      if (!valid || *end != '\0')
       {
-         if (RenameFile(directory, inodeBlock, (char *)arg1, (char *)arg2) == 0)
-         {
-            SaveAllChanges(directory, inodeBlock, byteMaps, superBlock, data, file);
-         }
+         FsErrorf("Usage: print <file_name> [offset] [length]\n");
+         return -1;
       }
    }
-   else if (strcmp(order, "print") == 0)
+   return PrintFile(context->directory, context->inodeBlock, context->superBlock, context->data,
+                    (char *)context->arg1, offset, length);
+}
+
+static int CommandRemove(COMMAND_CONTEXT *context)
+{
+   return SaveIfChanged(context, DeleteFile(context->directory, context->inodeBlock, context->byteMaps,
+                                            context->superBlock, (char *)context->arg1));
+}
+
+static int CommandCopy(COMMAND_CONTEXT *context)
+{
+   return SaveIfChanged(context, CopyFile(context->directory, context->inodeBlock, context->byteMaps,
+                                          context->superBlock, context->data, (char *)context->arg1,
+                                          (char *)context->arg2, context->file));
+}
+
+static int CommandCreate(COMMAND_CONTEXT *context)
+{
+   return SaveIfChanged(context, CreateFile(context->directory, context->inodeBlock, context->byteMaps,
+                                            context->superBlock, context->data, (char *)context->arg1,
+                                            (char *)context->arg2));
+}
+
+/* Payload of exactly `remaining` bytes */
+typedef struct
+{
+   FILE *input;
+   long remaining;
+} LENGTH_SOURCE;
+
+static long ReadLengthPrefixed(void *source, unsigned char *buffer, size_t capacity)
+{
+   LENGTH_SOURCE *payload = source;
+   size_t want = capacity < (size_t)payload->remaining ? capacity : (size_t)payload->remaining;
+   if (want == 0)
    {
-      if (strlen(arg1) == 0)
-      {
-         fprintf(stderr, "Usage: print <file_name>\n");
-      }
-      else
-      {
-         PrintFile(directory, inodeBlock, data, (char *)arg1);
-      }
+      return 0;
    }
-   else if (strcmp(order, "remove") == 0)
+   size_t got = fread(buffer, 1, want, payload->input);
+   if (got == 0)
    {
-      if (strlen(arg1) == 0)
-      {
-         fprintf(stderr, "Usage: remove <file_name>\n");
-      }
-      else
-      {
-         if (DeleteFile(directory, inodeBlock, byteMaps, superBlock, (char *)arg1) == 0)
-         {
-            SaveAllChanges(directory, inodeBlock, byteMaps, superBlock, data, file);
-         }
-      }
+      return -1; // input ended before the announced length
    }
-   else if (strcmp(order, "copy") == 0)
+   payload->remaining -= got;
+   return got;
+}
+
+/* Payload made of the lines up to one that holds just the terminator */
+typedef struct
+{
+   FILE *input;
+   const char *terminator;
+   char line[BLOCK_SIZE];
+   size_t lineLength;
+   size_t lineOffset;
+   int atLineStart; // the next fgets starts a new line
+   int state;       // 0 = reading, 1 = terminator seen, -1 = input ended first
+} HEREDOC_SOURCE;
+
+static long ReadHeredoc(void *source, unsigned char *buffer, size_t capacity)
+{
+   HEREDOC_SOURCE *payload = source;
+   size_t copied = 0;
+
+   while (copied < capacity && payload->state == 0)
    {
-      if (strlen(arg1) == 0 || strlen(arg2) == 0)
+      if (payload->lineOffset == payload->lineLength)
       {
-         fprintf(stderr, "Usage: copy <source_file> <destination_file>\n");
-      }
-      else
-      {
-         if (CopyFile(directory, inodeBlock, byteMaps, superBlock, data, (char *)arg1, (char *)arg2, file) == 0)
+         int lineStart = payload->atLineStart;
+         if (!fgets(payload->line, sizeof(payload->line), payload->input))
+         {
+            payload->state = -1;
+            break;
+         }
+         payload->lineLength = strlen(payload->line);
+         payload->lineOffset = 0;
+         payload->atLineStart = payload->line[payload->lineLength - 1] == '\n';
+
+         size_t contentLength = payload->lineLength - (payload->atLineStart ? 1 : 0);
+         if (lineStart && contentLength == strlen(payload->terminator) &&
+             strncmp(payload->line, payload->terminator, contentLength) == 0)
          {
-            SaveAllChanges(directory, inodeBlock, byteMaps, superBlock, data, file);
+            payload->state = 1;
+            break;
          }
       }
+      size_t count = payload->lineLength - payload->lineOffset;
+      if (count > capacity - copied)
+      {
+         count = capacity - copied;
+      }
+      memcpy(buffer + copied, payload->line + payload->lineOffset, count);
+      payload->lineOffset += count;
+      copied += count;
    }
-  else if (strcmp(order, "create") == 0)
-{
-    if (strlen(arg1) == 0 || strlen(arg2) == 0)
-    {
-        fprintf(stderr, "Usage: create <file_name> <content>\n");
-    }
-    else
-    {
-        if (CreateFile(directory, inodeBlock, byteMaps, superBlock, data, (char *)arg1, (char *)arg2) == 0)
-        {
-            SaveAllChanges(directory, inodeBlock, byteMaps, superBlock, data, file);
-        }
-    }
+   return copied == 0 && payload->state < 0 ? -1 : (long)copied;
 }
-   else if (strcmp(order, "debug") == 0)
-   {
-      DebugListAllDirectoryEntries(directory);
-   }
-   else if (strcmp(order, "help") == 0)
+
+/* Content that follows a command line: `<bytes>` raw bytes, or lines up to `<<TERM` */
+typedef struct
+{
+   LENGTH_SOURCE length;
+   HEREDOC_SOURCE heredoc;
+   CONTENT_READER read;
+   void *source;
+} PAYLOAD;
+
+/* Parses the payload form in spec; prints usage and returns -1 if it is not one */
+static int OpenPayload(PAYLOAD *payload, const char *spec, const char *usage)
+{
+   char *end;
+
+   payload->length = (LENGTH_SOURCE){fsRuntime->commandInput, 0};
+   payload->heredoc = (HEREDOC_SOURCE){.input = fsRuntime->commandInput, .atLineStart = 1};
+   payload->read = ReadLengthPrefixed;
+   payload->source = &payload->length;
+   if (strncmp(spec, "<<", 2) == 0 && spec[2] != '\0')
    {
-      printf("\nAvailable Commands:\n");
-      printf("  dir                  - List all files in the directory.\n");
-      printf("  info                 - Display superblock information.\n");
-      printf("  bytemaps             - Display byte maps information.\n");
-      printf("  rename <old> <new>   - Rename a file.\n");
-      printf("  print <file>         - Display the content of a file.\n");
-      printf("  remove <file>        - Delete a file.\n");
-      printf("  copy <src> <dst>     - Copy a file.\n");
-      printf("  create <file> <cont> - Create a new file with given content.\n");
-      printf("  clear                - Clear the terminal screen.\n");
-      printf("  debug                - List directory entries (debug mode).\n");
-      printf("  exit                 - Save changes and exit the program.\n\n");
+      payload->heredoc.terminator = spec + 2;
+      payload->read = ReadHeredoc;
+      payload->source = &payload->heredoc;
    }
-   else if (strcmp(order, "clear") == 0)
+   else if ((payload->length.remaining = strtol(spec, &end, 10)) < 0 || *end != '\0' || end == spec)
    {
-      ClearScreen();
+      FsErrorf("Usage: %s\n", usage);
+      return -1;
    }
-   else if (strcmp(order, "exit") == 0)
+   if (fsRuntime->commandInput == NULL)
    {
-      // Ensure all changes are saved before exiting
-      SaveAllChanges(directory, inodeBlock, byteMaps, superBlock, data, file);
-      fclose(file);
-      exit(0);
+      FsErrorf("Error: No input to read the content from.\n");
+      return -1;
    }
-   else
+   return 0;
+}
+
+/* Skips what is left of the payload, so the next command starts after it */
+static void DrainPayload(PAYLOAD *payload)
+{
+   unsigned char discard[BLOCK_SIZE];
+   while (payload->read(payload->source, discard, sizeof(discard)) > 0)
    {
-      fprintf(stderr, "Error: Invalid command '%s'. Please try again.\n", order);
-      fprintf(stderr, "Type 'help' to see the list of available commands.\n");
    }
 }
 
-// ---------------------------------------------------------------------------
-// SAVE/LOAD OPERATIONS
-// ---------------------------------------------------------------------------
-
-/**
- * @brief Saves all major filesystem structures (inodes, directory, bytemaps,
- *        superblock, data blocks) in a single call.
- */
-void SaveAllChanges(
-    EXT_DIRECTORY_ENTRY *directory,
-    EXT_INODE_BLOCK *inodeBlock,
-    EXT_BYTE_MAPS *byteMaps,
-    EXT_SIMPLE_SUPERBLOCK *superBlock,
-    EXT_DATA *data,
-    FILE *file)
+/* Reads the whole payload into buffer; -1 if it ends early or is larger than the file limit */
+static long ReadPayload(PAYLOAD *payload, unsigned char *buffer)
 {
-   // 1. Save inodes and directory
-   SaveInodesAndDirectory(directory, inodeBlock, file);
-   // 2. Save byte maps
-   SaveByteMaps(byteMaps, file);
-   // 3. Save superblock
-   SaveSuperBlock(superBlock, file);
-   // 4. Save data blocks
-   SaveData(data, file);
+   long total = 0;
+   long got;
+   while (total <= MAX_FILE_SIZE &&
+          (got = payload->read(payload->source, buffer + total, MAX_FILE_SIZE + 1 - total)) != 0)
+   {
+      if (got < 0)
+      {
+         FsErrorf("Error: Input ended before the end of the content.\n");
+         return -1;
+      }
+      total += got;
+   }
+   if (total > MAX_FILE_SIZE)
+   {
+      FsErrorf("Error: Content exceeds the maximum file size of %d bytes.\n", MAX_FILE_SIZE);
+      return -1;
+   }
+   return total;
 }
 
-/**
- * @brief Writes the superblock to disk (block 0).
- */
-void SaveSuperBlock(EXT_SIMPLE_SUPERBLOCK *superBlock, FILE *file)
+/* put <file> <bytes> | put <file> <<TERM: the content follows the command line */
+static int CommandPut(COMMAND_CONTEXT *context)
 {
-   fseek(file, BLOCK_SIZE * 0, SEEK_SET);
-   if (fwrite(superBlock, sizeof(EXT_SIMPLE_SUPERBLOCK), 1, file) != 1)
+   PAYLOAD payload;
+   if (OpenPayload(&payload, context->arg2, "put <file_name> <bytes> | put <file_name> <<TERMINATOR") != 0)
    {
-      perror("Error saving SuperBlock");
+      return -1;
    }
-   fflush(file);
+
+   int result = CreateFileFromStream(context->directory, context->inodeBlock, context->byteMaps,
+                                     context->superBlock, context->data, context->arg1, payload.read,
+                                     payload.source);
+
+   // Whatever happened, the next command starts after the payload
+   DrainPayload(&payload);
+   return SaveIfChanged(context, result);
 }
 
-/**
- * @brief Writes the byte maps (block 1) to disk: block-bytemap and inode-bytemap.
- */
-void SaveByteMaps(EXT_BYTE_MAPS *byteMaps, FILE *file)
+/* write <file> <offset> <bytes>|<<TERM: the content follows the command line, as for put */
+static int CommandWrite(COMMAND_CONTEXT *context)
 {
-   fseek(file, BLOCK_SIZE * 1, SEEK_SET);
-   if (fwrite(byteMaps, sizeof(EXT_BYTE_MAPS), 1, file) != 1)
+   unsigned char content[MAX_FILE_SIZE + 1];
+   PAYLOAD payload;
+   char *spec;
+
+   long offset = strtol(context->arg2, &spec, 10);
+   if (spec == context->arg2 || offset < 0 || *spec != ' ')
+   {
+      FsErrorf("Usage: write <file_name> <offset> <bytes> | write <file_name> <offset> <<TERMINATOR\n");
+      return -1;
+   }
+   while (*spec == ' ')
    {
-      perror("Error saving ByteMaps");
+      spec++;
    }
-   fflush(file);
+   if (OpenPayload(&payload, spec,
+                   "write <file_name> <offset> <bytes> | write <file_name> <offset> <<TERMINATOR") != 0)
+   {
+      return -1;
+   }
+
+   long size = ReadPayload(&payload, content);
+   DrainPayload(&payload);
+   if (size < 0)
+   {
+      return -1;
+   }
+   int result = WriteFileRange(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                               context->data, context->arg1, offset, content, size);
+   if (result == 0)
+   {
+      FsStatusf("Wrote %ld bytes to '%s' at offset %ld.\n", size, context->arg1, offset);
+   }
+   return SaveIfChanged(context, result);
 }
 
-/**
- * @brief Writes the inode block (block 2) and directory (block 3) to disk.
- */
-void SaveInodesAndDirectory(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, FILE *file)
+/* append <file> <bytes>|<<TERM */
+static int CommandAppend(COMMAND_CONTEXT *context)
 {
-   // Inode block is at block 2
-   fseek(file, BLOCK_SIZE * 2, SEEK_SET);
-   if (fwrite(inodeBlock, sizeof(EXT_INODE_BLOCK), 1, file) != 1)
+   unsigned char content[MAX_FILE_SIZE + 1];
+   PAYLOAD payload;
+   if (OpenPayload(&payload, context->arg2, "append <file_name> <bytes> | append <file_name> <<TERMINATOR") != 0)
    {
-      perror("Error saving InodeBlock");
+      return -1;
    }
 
-   // Directory is at block 3
-   fseek(file, BLOCK_SIZE * 3, SEEK_SET);
-   if (fwrite(directory, sizeof(EXT_DIRECTORY_ENTRY) * MAX_FILES, 1, file) != 1)
+   long size = ReadPayload(&payload, content);
+   DrainPayload(&payload);
+   if (size < 0)
+   {
+      return -1;
+   }
+   int result = AppendFile(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                           context->data, context->arg1, content, size);
+   if (result == 0)
    {
-      perror("Error saving Directory");
+      FsStatusf("Appended %ld bytes to '%s'.\n", size, context->arg1);
    }
-   fflush(file);
+   return SaveIfChanged(context, result);
 }
 
-/**
- * @brief Writes all data blocks (starting from block 4) to disk.
- */
-void SaveData(EXT_DATA *data, FILE *file)
+static int CommandTruncate(COMMAND_CONTEXT *context)
 {
-   fseek(file, BLOCK_SIZE * FIRST_DATA_BLOCK, SEEK_SET);
-   if (fwrite(data, sizeof(EXT_DATA), MAX_DATA_BLOCKS, file) != MAX_DATA_BLOCKS)
+   char *end;
+   long size = strtol(context->arg2, &end, 10);
+   if (end == context->arg2 || *end != '\0' || size < 0)
    {
-      perror("Error saving Data blocks");
+      FsErrorf("Usage: truncate <file_name> <size>\n");
+      return -1;
    }
-   fflush(file);
+   int result = TruncateFile(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                             context->data, context->arg1, size);
+   if (result == 0)
+   {
+      FsStatusf("File '%s' truncated to %ld bytes.\n", context->arg1, size);
+   }
+   return SaveIfChanged(context, result);
 }
 
+static int CommandImport(COMMAND_CONTEXT *context)
+{
+   return SaveIfChanged(context, ImportFile(context->directory, context->inodeBlock, context->byteMaps,
+                                            context->superBlock, context->data, context->arg1, context->arg2,
+                                            context->file));
+}
 
-// ---------------------------------------------------------------------------
-// FILESYSTEM AND COMMAND-RELATED FUNCTIONS
-// ---------------------------------------------------------------------------
-
-/**
- * @brief Lists all files in the directory along with their sizes, inodes, and allocated blocks.
- * 
- * Iterates through the directory entries, skipping empty ones and the special entry ".", 
- * retrieves corresponding inodes, and displays file information.
- * 
- * @param directory Pointer to the directory entries array.
- * @param inodes Pointer to the inode block structure.
- */
-void ListDirectory(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes)
+static int CommandImportTree(COMMAND_CONTEXT *context)
 {
-   int i, j;
-   int fileCount = 0; // Counter for found files
+   int imported;
+   int result = ImportTree(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                           context->data, context->arg1, context->file, &imported);
+   if (imported > 0)
+   {
+      // Everything that made it in is saved as one change, even if other files failed
+      SaveAfterChange(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                      context->data, context->file);
+   }
+   return result == 0 ? 0 : -1;
+}
 
-   printf("List of files in the directory:\n");
-   printf("-------------------------------------------------------\n");
-   for (i = 0; i < MAX_FILES; i++)
+/* export-tar [host_path]: the archive goes to standard output unless a path is given */
+static int CommandExportTar(COMMAND_CONTEXT *context)
+{
+   FILE *out = stdout;
+   if (context->arg1[0] != '\0' && strcmp(context->arg1, "-") != 0)
    {
-      // Skip empty entries and the special entry "."
-      if (directory[i].inode == NULL_INODE || strcmp(directory[i].file_name, ".") == 0)
+      out = fopen(context->arg1, "wb");
+      if (out == NULL)
       {
-         continue;
+         FsPerror(context->arg1);
+         return -1;
       }
+   }
+   else if (isatty(fileno(stdout)))
+   {
+      FsErrorf("Error: Refusing to write an archive to a terminal; redirect the output or give a path.\n");
+      return -1;
+   }
 
-      // Get the corresponding inode
-      EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[i].inode];
-
-      // Print file name, size, and inode
-      printf("\n%-20s size:%-6u inode:%-2d blocks:",
-             directory[i].file_name, // File name
-             inode->file_size,       // File size
-             directory[i].inode);    // Inode number
+   int exported;
+   int result = ExportTar(context->directory, context->inodeBlock, context->superBlock, context->data, out,
+                          &exported);
+   if (out != stdout)
+   {
+      result = fclose(out) == 0 ? result : -1;
+      FsStatusf("%d file(s) archived to '%s'.\n", exported, context->arg1);
+   }
+   return result == 0 ? 0 : -1;
+}
 
-      // Print occupied blocks
-      for (j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+/* import-tar [host_path]: without a path the archive follows the command line */
+static int CommandImportTar(COMMAND_CONTEXT *context)
+{
+   FILE *in = fsRuntime->commandInput;
+   if (context->arg1[0] != '\0' && strcmp(context->arg1, "-") != 0)
+   {
+      in = fopen(context->arg1, "rb");
+      if (in == NULL)
       {
-         if (inode->block_numbers[j] != NULL_BLOCK) // Skip unassigned blocks
-         {
-            printf(" %u", inode->block_numbers[j]);
-         }
+         FsPerror(context->arg1);
+         return -1;
       }
-
-      fileCount++; // Increment the file counter
    }
-   printf("\n");
+   else if (in == NULL)
+   {
+      FsErrorf("Error: No input to read the archive from.\n");
+      return -1;
+   }
 
-   // Check if no files were found
-   if (fileCount == 0)
+   int imported;
+   int result = ImportTar(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                          context->data, in, &imported);
+   if (in != fsRuntime->commandInput)
+   {
+      fclose(in);
+   }
+   if (imported > 0)
+   {
+      SaveAfterChange(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                      context->data, context->file);
+   }
+   if (result != 0)
    {
-      printf("No files in the directory.\n");
+      return -1;
    }
+   FsStatusf("%d file(s) imported from the archive.\n", imported);
+   return 0;
 }
 
-/**
- * @brief Prints the metadata stored in the superblock.
- * 
- * Displays details such as the total number of inodes, total blocks, free blocks, 
- * free inodes, the starting data block, and the block size.
- * 
- * @param superBlock Pointer to the superblock structure.
- */
-void PrintSuperBlock(EXT_SIMPLE_SUPERBLOCK *superBlock)
+static int CommandExport(COMMAND_CONTEXT *context)
 {
-   printf("\nSuperblock Information:\n");
-   printf("Total inodes: %u\n", superBlock->total_inodes);
-   printf("Total blocks: %u\n", superBlock->total_blocks);
-   printf("Free blocks: %u\n", superBlock->free_blocks);
-   printf("Free inodes: %u\n", superBlock->free_inodes);
-   printf("First data block: %u\n", superBlock->first_data_block);
-   printf("Block size: %u bytes\n", superBlock->block_size);
+   return ExportFile(context->directory, context->inodeBlock, context->superBlock, context->data,
+                     context->arg1, context->arg2, context->file) == 0 ? 0 : -1;
 }
 
-/**
- * @brief Displays the allocation status of inodes and data blocks.
- * 
- * Prints the inode bitmap and the first 25 entries of the block bitmap, 
- * showing which resources are currently allocated or free.
- * 
- * @param byteMaps Pointer to the structure containing the byte maps.
- */
-void PrintByteMaps(EXT_BYTE_MAPS *byteMaps)
+static int CommandSet(COMMAND_CONTEXT *context)
 {
-   int i;
+   return SaveIfChanged(context, SetOption(context->superBlock, context->byteMaps, context->data,
+                                           context->arg1, context->arg2));
+}
 
-   printf("\nByte maps information:");
+/* Parses a whole decimal argument in [0, INT_MAX]; -1 for anything else */
+static int ParseCount(const char *text, int *value)
+{
+   char *end;
+   long parsed = strtol(text, &end, 10);
+   if (end == text || *end != '\0' || parsed < 0 || parsed > INT_MAX)
+   {
+      return -1;
+   }
+   *value = (int)parsed;
+   return 0;
+}
 
-   // Display the contents of the inode bytemap
-   printf("\nInodes: ");
-   for (i = 0; i < MAX_INODES; i++)
+static int CommandDedupe(COMMAND_CONTEXT *context)
+{
+   // Optional merge budget so a pass can be kept short
+   int maxMerges = 0;
+   unsigned int bytesReclaimed = 0;
+   if (context->arg1[0] != '\0' && ParseCount(context->arg1, &maxMerges) != 0)
    {
-      printf("%u ", byteMaps->inode_bytemap[i]);
+      FsErrorf("Usage: dedupe [max_merges]\n");
+      return -1;
    }
-   printf("\n");
-   // Display the contents of the block bytemap (first 25 elements)
-   printf("Blocks [0-25]: ");
-   for (i = 0; i < 25; i++)
+   if (DeduplicateBlocks(context->superBlock, context->byteMaps, context->inodeBlock, context->data,
+                         maxMerges, &bytesReclaimed) > 0)
    {
-      printf("%u ", byteMaps->block_bytemap[i]);
+      SaveIfChanged(context, 0);
    }
-   printf("\n");
+   return 0;
 }
 
-/**
- * @brief Displays the content of a specified file.
- * 
- * Finds the file in the directory, retrieves its associated inode, and reads
- * its data blocks to display the content of the file.
- * 
- * @param directory Pointer to the directory entries array.
- * @param inodes Pointer to the inode block structure.
- * @param data Pointer to the data blocks array.
- * @param name Name of the file to be printed.
- * @return 0 on success, -1 if the file is not found or an error occurs.
- */
-int PrintFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_DATA *data, char *name)
+static int CommandDefrag(COMMAND_CONTEXT *context)
 {
-   // Find the file using FindFile
-   int fileIndex = FindFile(directory, inodes, name);
-
-   if (fileIndex == -1)
+   // Optional move budget so a pass can be kept short
+   int maxMoves = 0;
+   if (context->arg1[0] != '\0' && ParseCount(context->arg1, &maxMoves) != 0)
    {
-      printf("File '%s' not found.\n", name);
+      FsErrorf("Usage: defrag [max_moves]\n");
       return -1;
    }
-
-   // Get the inode of the file
-   EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[fileIndex].inode];
-
-   // Check if the file size is valid
-   if (inode->file_size == 0)
+   if (DefragmentFilesystem(context->superBlock, context->byteMaps, context->inodeBlock, context->directory,
+                            context->data, maxMoves) > 0)
    {
-      printf("File '%s' is empty.\n", name);
-      return 0;
+      // Saved at once whatever the commit interval: the moved blocks only match the new inodes
+      SaveAllChanges(context->directory, context->inodeBlock, context->byteMaps, context->superBlock,
+                     context->data, context->file);
    }
+   return 0;
+}
 
-   // Allocate buffer to hold file content
-   unsigned char *buffer = malloc(inode->file_size + 1); // +1 for null terminator
-   if (!buffer)
+static int CommandResize(COMMAND_CONTEXT *context)
+{
+   int blocks;
+   if (ParseCount(context->arg1, &blocks) != 0)
+   {
+      FsErrorf("Usage: resize <blocks>\n");
+      return -1;
+   }
+   if (ResizeFilesystem(context->superBlock, context->byteMaps, context->inodeBlock, context->directory,
+                        context->data, blocks, context->file) != 0)
    {
-      perror("Memory allocation failed");
       return -1;
    }
+   // Saved at once whatever the commit interval: the image file already has its new size
+   SaveAllChanges(context->directory, context->inodeBlock, context->byteMaps, context->superBlock, context->data,
+                  context->file);
+   return 0;
+}
 
-   size_t bytesCopied = 0;
-   memset(buffer, 0, inode->file_size + 1); // Initialize buffer
+static int CommandFragstats(COMMAND_CONTEXT *context)
+{
+   PrintFragStats(context->superBlock, context->byteMaps, context->inodeBlock, context->directory);
+   return 0;
+}
 
-   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+static int CommandCache(COMMAND_CONTEXT *context)
+{
+   // Optional new budget in blocks (0 = no limit)
+   if (context->arg1[0] != '\0')
    {
-      if (inode->block_numbers[i] == NULL_BLOCK)
+      int budget;
+      if (ParseCount(context->arg1, &budget) != 0)
       {
-         continue;
+         FsErrorf("Usage: cache [blocks]\n");
+         return -1;
       }
+      SetBlockCacheBudget(budget);
+      TrimBlockCache(context->superBlock, context->byteMaps, context->data);
+   }
+   PrintBlockCacheStats();
+   return 0;
+}
 
-      int blockNumber = inode->block_numbers[i];
+static int CommandStats(COMMAND_CONTEXT *context)
+{
+   (void)context;
+   PrintStats();
+   return 0;
+}
 
-      // Ensure blockNumber is within valid range
-      if (blockNumber < FIRST_DATA_BLOCK || blockNumber >= (FIRST_DATA_BLOCK + MAX_DATA_BLOCKS))
-      {
-         printf("Error: Invalid block number %d for file '%s'.\n", blockNumber, name);
-         continue;
-      }
+static int CommandFsck(COMMAND_CONTEXT *context)
+{
+   int repair = strcmp(context->arg1, "repair") == 0;
+   if (context->arg1[0] != '\0' && !repair)
+   {
+      FsErrorf("Usage: fsck [repair]\n");
+      return -1;
+   }
+   int problems = CheckFilesystem(context->superBlock, context->byteMaps, context->inodeBlock,
+                                  context->directory, ALL_REGIONS, repair);
+   if (problems > 0 && repair)
+   {
+      SaveIfChanged(context, 0);
+   }
+   return problems > 0 && !repair ? -1 : 0;
+}
 
-      // Map block number to data array index
-      int dataIndex = blockNumber - FIRST_DATA_BLOCK;
+static int CommandDebug(COMMAND_CONTEXT *context)
+{
+   DebugListAllDirectoryEntries(context->directory);
+   return 0;
+}
 
-      // Boundary check
-      if (dataIndex >= MAX_DATA_BLOCKS)
-      {
-         printf("Error: Data index %d out of bounds for block %d.\n", dataIndex, blockNumber);
-         continue;
-      }
+static int CommandHelp(COMMAND_CONTEXT *context)
+{
+   (void)context;
+   FsPrintf("\nAvailable Commands:\n");
+   FsPrintf("  dir                  - List all files in the directory.\n");
+   FsPrintf("  info                 - Display superblock information.\n");
+   FsPrintf("  bytemaps             - Display byte maps information.\n");
+   FsPrintf("  rename <old> <new>   - Rename a file.\n");
+   FsPrintf("  print <file> [o] [n] - Display a file, or n bytes from offset o (<0: from end).\n");
+   FsPrintf("  remove <file>        - Delete a file.\n");
+   FsPrintf("  copy <src> <dst>     - Copy a file.\n");
+   FsPrintf("  create <file> <cont> - Create a new file with given content.\n");
+   FsPrintf("  put <file> <bytes>   - Create a file from the next <bytes> bytes of input.\n");
+   FsPrintf("  put <file> <<TERM    - Create a file from the input lines up to a line TERM.\n");
+   FsPrintf("  write <file> <o> <n> - Overwrite from offset o with the next n bytes (or <<TERM).\n");
+   FsPrintf("  append <file> <n>    - Add the next n bytes of input (or <<TERM) to a file.\n");
+   FsPrintf("  truncate <file> <n>  - Cut a file to n bytes, or extend it with zeros.\n");
+   FsPrintf("  import <host> <file> - Copy a host file into the partition.\n");
+   FsPrintf("  import-tree <dir>    - Import every file under a host directory in parallel.\n");
+   FsPrintf("  export <file> <host> - Copy a file out to a host file.\n");
+   FsPrintf("  export-tar [host]    - Write all files as a tar archive (default: stdout).\n");
+   FsPrintf("  import-tar [host]    - Create files from a tar archive (default: the input).\n");
+   FsPrintf("  set dedup <on|off>   - Share identical data blocks on create/copy.\n");
+   FsPrintf("  set compress <on|off>- Compress new files on create/copy.\n");
+   FsPrintf("  dedupe [max_merges]  - Merge duplicate blocks already on disk.\n");
+   FsPrintf("  defrag [max_moves]   - Make files contiguous and move free space to the end.\n");
+   FsPrintf("  fragstats            - Report free extents, file fragments and occupancy.\n");
+   FsPrintf("  resize <blocks>      - Grow or shrink the partition.\n");
+   FsPrintf("  set checksums <on|off> - Keep and verify a CRC32C per block.\n");
+   FsPrintf("  set discard <on|off> - Release freed blocks to the host.\n");
+   FsPrintf("  stats                - Show command and checksum statistics.\n");
+   FsPrintf("  cache [blocks]       - Show the block cache, or set its budget (0 = no limit).\n");
+   FsPrintf("  fsck [repair]        - Check (and optionally repair) metadata consistency.\n");
+   FsPrintf("  clear                - Clear the terminal screen.\n");
+   FsPrintf("  debug                - List directory entries (debug mode).\n");
+   FsPrintf("  exit                 - Save changes, mark the partition clean and exit.\n\n");
+   return 0;
+}
 
-      EXT_DATA *block = &data[dataIndex];
+static int CommandClear(COMMAND_CONTEXT *context)
+{
+   (void)context;
+   ClearScreen();
+   return 0;
+}
 
-      // Determine how many bytes to copy from this block
-      size_t bytesToCopy = (inode->file_size - bytesCopied) < BLOCK_SIZE ? (inode->file_size - bytesCopied) : BLOCK_SIZE;
-      memcpy(buffer + bytesCopied, block->data, bytesToCopy);
-      bytesCopied += bytesToCopy;
+static int CommandExit(COMMAND_CONTEXT *context)
+{
+   // The caller saves everything and marks the partition clean before exiting
+   (void)context;
+   return COMMAND_EXIT;
+}
 
-      if (bytesCopied >= inode->file_size)
-      {
-         break;
-      }
-   }
+#define COMMAND_TABLE_SIZE 128
 
-   buffer[inode->file_size] = '\0'; // Ensure null termination
+/* Slot of a verb from its first and middle characters and its length. The table below
+   is built with it at compile time; it is collision-free for these verbs (a new verb
+   that collides needs other multipliers), so a lookup is one hash and one strcmp. */
+#define VERB_HASH(first, middle, length) ((4 * (first) + (middle) + (length)) & (COMMAND_TABLE_SIZE - 1))
 
-   printf("Content of file '%s':\n%s\n", name, buffer);
+static const COMMAND_SPEC commandTable[COMMAND_TABLE_SIZE] = {
+    [VERB_HASH('d', 'i', 3)] = {"dir", 0, NULL, CommandDir},
+    [VERB_HASH('i', 'f', 4)] = {"info", 0, NULL, CommandInfo},
+    [VERB_HASH('b', 'm', 8)] = {"bytemaps", 0, NULL, CommandBytemaps},
+    [VERB_HASH('r', 'a', 6)] = {"rename", 2, "rename <old_name> <new_name>", CommandRename},
+    [VERB_HASH('p', 'i', 5)] = {"print", 1, "print <file_name> [offset] [length]", CommandPrint},
+    [VERB_HASH('r', 'o', 6)] = {"remove", 1, "remove <file_name>", CommandRemove},
+    [VERB_HASH('c', 'p', 4)] = {"copy", 2, "copy <source_file> <destination_file>", CommandCopy},
+    [VERB_HASH('c', 'a', 6)] = {"create", 2, "create <file_name> <content>", CommandCreate},
+    [VERB_HASH('i', 'o', 6)] = {"import", 2, "import <host_path> <file_name>", CommandImport},
+    [VERB_HASH('e', 'o', 6)] = {"export", 2, "export <file_name> <host_path>", CommandExport},
+    [VERB_HASH('i', 't', 11)] = {"import-tree", 1, "import-tree <host_dir>", CommandImportTree},
+    [VERB_HASH('e', 't', 10)] = {"export-tar", 0, "export-tar [host_path]", CommandExportTar},
+    [VERB_HASH('i', 't', 10)] = {"import-tar", 0, "import-tar [host_path]", CommandImportTar},
+    [VERB_HASH('p', 'u', 3)] = {"put", 2, "put <file_name> <bytes> | put <file_name> <<TERMINATOR", CommandPut},
+    [VERB_HASH('w', 'i', 5)] = {"write", 2, "write <file_name> <offset> <bytes> | write <file_name> <offset> <<TERMINATOR", CommandWrite},
+    [VERB_HASH('a', 'e', 6)] = {"append", 2, "append <file_name> <bytes> | append <file_name> <<TERMINATOR", CommandAppend},
+    [VERB_HASH('t', 'c', 8)] = {"truncate", 2, "truncate <file_name> <size>", CommandTruncate},
+    [VERB_HASH('s', 'e', 3)] = {"set", 2, "set <option> <on|off>", CommandSet},
+    [VERB_HASH('d', 'u', 6)] = {"dedupe", 0, NULL, CommandDedupe},
+    [VERB_HASH('d', 'r', 6)] = {"defrag", 0, NULL, CommandDefrag},
+    [VERB_HASH('r', 'i', 6)] = {"resize", 1, "resize <blocks>", CommandResize},
+    [VERB_HASH('f', 's', 9)] = {"fragstats", 0, NULL, CommandFragstats},
+    [VERB_HASH('c', 'c', 5)] = {"cache", 0, NULL, CommandCache},
+    [VERB_HASH('s', 'a', 5)] = {"stats", 0, NULL, CommandStats},
+    [VERB_HASH('f', 'c', 4)] = {"fsck", 0, NULL, CommandFsck},
+    [VERB_HASH('d', 'b', 5)] = {"debug", 0, NULL, CommandDebug},
+    [VERB_HASH('h', 'l', 4)] = {"help", 0, NULL, CommandHelp},
+    [VERB_HASH('c', 'e', 5)] = {"clear", 0, NULL, CommandClear},
+    [VERB_HASH('e', 'i', 4)] = {"exit", 0, NULL, CommandExit},
+};
 
-   free(buffer);
-   return 0;
+/**
+ * @brief Finds a verb in the command table: one hash and one string comparison.
+ * @return Its entry, or NULL if it is not a command.
+ */
+static const COMMAND_SPEC *LookupCommand(const char *verb)
+{
+   size_t length = strlen(verb);
+   const COMMAND_SPEC *spec = &commandTable[VERB_HASH((unsigned char)verb[0], (unsigned char)verb[length / 2], length)];
+   return spec->name != NULL && strcmp(spec->name, verb) == 0 ? spec : NULL;
 }
 
 /**
- * @brief Renames a file from oldName to newName if it exists and newName is not taken.
- * @return 0 on success, -1 on failure.
+ * @brief Tells whether verb names a command.
  */
-int RenameFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, char *oldName, char *newName)
+int IsCommand(const char *verb)
 {
-   if (!oldName || !newName || strlen(newName) == 0)
-   {
-      fprintf(stderr, "Invalid file names.\n");
-      return -1;
-   }
+   return LookupCommand(verb) != NULL;
+}
 
-   int fileIndex = FindFile(directory, inodes, oldName);
-   if (fileIndex == -1)
+/**
+ * @brief Dispatches the user command through the command table: checks that the
+ *        required arguments are present, then calls the command's handler.
+ * @return 0 if the command succeeded, -1 if it failed or was malformed, or
+ *         COMMAND_EXIT for 'exit'.
+ */
+int ProcessCommand(
+    const char *order,
+    const char *arg1,
+    const char *arg2,
+    EXT_SIMPLE_SUPERBLOCK *superBlock,
+    EXT_BYTE_MAPS *byteMaps,
+    EXT_INODE_BLOCK *inodeBlock,
+    EXT_DIRECTORY_ENTRY *directory,
+    EXT_DATA *data,
+    FILE *file)
+{
+   const COMMAND_SPEC *spec = LookupCommand(order);
+   if (spec == NULL)
    {
-      fprintf(stderr, "File '%s' not found.\n", oldName);
+      FsErrorf("Error: Invalid command '%s'. Please try again.\n", order);
+      FsErrorf("Type 'help' to see the list of available commands.\n");
       return -1;
    }
 
-   if (FindFile(directory, inodes, newName) != -1)
+   int argsPresent = arg1[0] == '\0' ? 0 : (arg2[0] == '\0' ? 1 : 2);
+   if (argsPresent < spec->requiredArgs)
    {
-      fprintf(stderr, "A file with the name '%s' already exists.\n", newName);
+      FsErrorf("Usage: %s\n", spec->usage);
       return -1;
    }
 
-   strncpy(directory[fileIndex].file_name, newName, sizeof(directory[fileIndex].file_name) - 1);
-   directory[fileIndex].file_name[sizeof(directory[fileIndex].file_name) - 1] = '\0';
-   printf("File renamed from '%s' to '%s'.\n", oldName, newName);
-   return 0;
+   COMMAND_CONTEXT context = {superBlock, byteMaps, inodeBlock, directory, data, file, arg1, arg2};
+   return spec->handler(&context);
 }
 
+// ---------------------------------------------------------------------------
+// SAVE/LOAD OPERATIONS
+// ---------------------------------------------------------------------------
+
 /**
- * @brief Deletes a file by freeing its data blocks, its inode, and removing its directory entry.
- * @return 0 on success, -1 on failure.
+ * @brief Reads the metadata blocks (superblock, byte maps, inodes and directory)
+ *        straight into their structures.
+ * @return 0 on success, -1 if they could not be read.
  */
-int DeleteFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes,
-               EXT_BYTE_MAPS *byteMaps, EXT_SIMPLE_SUPERBLOCK *superBlock, char *name)
+int LoadMetadata(FILE *file,
+                 EXT_SIMPLE_SUPERBLOCK *superBlock,
+                 EXT_BYTE_MAPS *byteMaps,
+                 EXT_INODE_BLOCK *inodeBlock,
+                 EXT_DIRECTORY_ENTRY *directory)
 {
-   int fileIndex = FindFile(directory, inodes, name);
-   if (fileIndex == -1)
+   // Free blocks are never written, so the image may end right after the directory
+   fseek(file, 0, SEEK_SET);
+   if (fread(superBlock, BLOCK_SIZE, 1, file) != 1 ||
+       fread(byteMaps, BLOCK_SIZE, 1, file) != 1 ||
+       fread(inodeBlock, BLOCK_SIZE, 1, file) != 1 ||
+       fread(directory, sizeof(EXT_DIRECTORY_ENTRY), MAX_FILES, file) != MAX_FILES)
    {
-      fprintf(stderr, "File '%s' not found.\n", name);
       return -1;
    }
-
-   int inodeIndex = directory[fileIndex].inode;
-   EXT_SIMPLE_INODE *inode = &inodes->inodes[inodeIndex];
-
-   // Free data blocks
-   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
-   {
-      if (inode->block_numbers[i] != NULL_BLOCK)
-      {
-         int blockNum = inode->block_numbers[i];
-         byteMaps->block_bytemap[blockNum] = 0;
-         inode->block_numbers[i] = NULL_BLOCK;
-         superBlock->free_blocks++;
-      }
-   }
-
-   // Free inode
-   byteMaps->inode_bytemap[inodeIndex] = 0;
-   memset(inode, 0, sizeof(EXT_SIMPLE_INODE));
-   superBlock->free_inodes++;
-
-   // Remove directory entry
-   directory[fileIndex].inode = NULL_INODE;
-   memset(directory[fileIndex].file_name, 0, sizeof(directory[fileIndex].file_name));
-
-   printf("File '%s' deleted successfully.\n", name);
    return 0;
 }
 
 /**
- * @brief Copies an existing source file to a new destination file by allocating
- *        new blocks and a new inode for the destination. Writes data to 'particion.bin'.
- * @return 0 on success, -1 on failure.
+ * @brief Reads the partition straight into the metadata structures and the data
+ *        block array (no intermediate copy of the image), and binds the block
+ *        cache to the file with every data block resident and clean.
+ * @return 0 on success, -1 if the metadata blocks could not be read.
  */
-int CopyFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
-             EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
-             char *sourceName, char *destName, FILE *file)
+int LoadFilesystem(FILE *file,
+                   EXT_SIMPLE_SUPERBLOCK *superBlock,
+                   EXT_BYTE_MAPS *byteMaps,
+                   EXT_INODE_BLOCK *inodeBlock,
+                   EXT_DIRECTORY_ENTRY *directory,
+                   EXT_DATA *data)
 {
-   if (!directory || !inodes || !byteMaps || !superBlock || !data ||
-       !sourceName || !destName || !file)
+   if (LoadMetadata(file, superBlock, byteMaps, inodeBlock, directory) != 0)
    {
-      fprintf(stderr, "Invalid input parameters.\n");
       return -1;
    }
 
-   // Check if destination already exists
-   if (FindFile(directory, inodes, destName) != -1)
+   // Blocks past the end of the file read as zeros
+   memset(data, 0, MAX_DATA_BLOCKS * BLOCK_SIZE);
+   fseek(file, BLOCK_SIZE * FIRST_DATA_BLOCK, SEEK_SET);
+   if (fread(data, BLOCK_SIZE, MAX_DATA_BLOCKS, file) < MAX_DATA_BLOCKS)
    {
-      fprintf(stderr, "Destination file '%s' already exists.\n", destName);
-      return -1;
+      clearerr(file);
    }
+   ResetBlockCache(file, 1);
+   return 0;
+}
 
-   // Locate source file
-   int sourceIndex = FindFile(directory, inodes, sourceName);
-   if (sourceIndex == -1)
+/**
+ * @brief Lazy variant of LoadFilesystem: only the four metadata blocks are read, so
+ *        the time to the first command does not depend on the partition size. Data
+ *        blocks are read by the block cache on first access, or ahead of time by
+ *        PrefetchBlocks.
+ * @return 0 on success, -1 if the metadata blocks could not be read.
+ */
+int LoadFilesystemLazy(FILE *file,
+                       EXT_SIMPLE_SUPERBLOCK *superBlock,
+                       EXT_BYTE_MAPS *byteMaps,
+                       EXT_INODE_BLOCK *inodeBlock,
+                       EXT_DIRECTORY_ENTRY *directory)
+{
+   if (LoadMetadata(file, superBlock, byteMaps, inodeBlock, directory) != 0)
    {
-      fprintf(stderr, "Source file '%s' not found.\n", sourceName);
       return -1;
    }
+   ResetBlockCache(file, 0);
+   return 0;
+}
 
-   EXT_DIRECTORY_ENTRY *sourceEntry = &directory[sourceIndex];
-   EXT_SIMPLE_INODE *sourceInode = &inodes->inodes[sourceEntry->inode];
+/**
+ * @brief Validates a freshly loaded partition according to how the last session ended,
+ *        then marks it dirty on disk for as long as it stays mounted.
+ *
+ * - Clean unmount: nothing is checked.
+ * - Dirty (crash): only the regions in the dirty-region log are checked, so the cost
+ *   follows the amount of recent activity rather than the partition size.
+ * - No recorded state (older images): everything is checked.
+ *
+ * Problems found are repaired; the log is then cleared, since the checked state is
+ * the new starting point.
+ *
+ * @return 0 if validation was skipped, 1 for an incremental check, 2 for a full check.
+ */
+int MountFilesystem(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, EXT_BYTE_MAPS *byteMaps,
+                    EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, FILE *file)
+{
+   int mode = 0;
 
-   // Find a free inode for the new file
-   int destInodeIndex = -1;
-   for (int i = 0; i < MAX_INODES; i++)
+   if (superBlock->fs_state != FS_STATE_CLEAN)
    {
-      // Usually inodes 0,1,2 are reserved in many simplified FS examples
-      if (byteMaps->inode_bytemap[i] == 0 && i > 2)
+      unsigned int regions = ALL_REGIONS;
+      mode = 2;
+      if (superBlock->fs_state == FS_STATE_DIRTY)
       {
-         destInodeIndex = i;
-         break;
+         regions = superBlock->dirty_regions | 1u; // the metadata region is always checked
+         mode = 1;
+         FsStatusf("Partition was not cleanly unmounted; checking recently modified regions.\n");
+      }
+      else
+      {
+         FsStatusf("Partition has no recorded mount state; checking all regions.\n");
       }
-   }
-   if (destInodeIndex == -1)
-   {
-      fprintf(stderr, "No free inodes available.\n");
-      return -1;
-   }
+
+      if (superBlock->feature_flags & FEATURE_CHECKSUMS)
+      {
+         VerifyChecksums(superBlock, byteMaps, inodeBlock, directory, data, regions);
+      }
+      if (CheckFilesystem(superBlock, byteMaps, inodeBlock, directory, regions, 1) > 0)
+      {
+         SaveAllChanges(directory, inodeBlock, byteMaps, superBlock, data, file);
+      }
+   }
+
+   // Until the next clean unmount, a crash must be detectable
+   superBlock->fs_state = FS_STATE_DIRTY;
+   superBlock->dirty_regions = 0;
+   if (superBlock->feature_flags & FEATURE_CHECKSUMS)
+   {
+      UpdateMetadataChecksums(superBlock, byteMaps, inodeBlock, directory);
+   }
+   SaveSuperBlock(superBlock, file);
+   return mode;
+}
+
+/**
+ * @brief Saves everything and records a clean unmount, so the next mount skips validation.
+ */
+void UnmountFilesystem(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, EXT_BYTE_MAPS *byteMaps,
+                       EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, FILE *file)
+{
+   SaveAllChanges(directory, inodeBlock, byteMaps, superBlock, data, file);
+   superBlock->fs_state = FS_STATE_CLEAN;
+   superBlock->dirty_regions = 0;
+   if (superBlock->feature_flags & FEATURE_CHECKSUMS)
+   {
+      UpdateMetadataChecksums(superBlock, byteMaps, inodeBlock, directory);
+   }
+   SaveSuperBlock(superBlock, file);
+}
+
+/**
+ * @brief Records in the dirty-region log that blockNum is about to change. The log is
+ *        persisted with the superblock, which SaveAllChanges writes before the data blocks.
+ */
+void MarkBlockDirty(EXT_SIMPLE_SUPERBLOCK *superBlock, int blockNum)
+{
+   if (blockNum >= 0 && blockNum < MAX_PARTITION_BLOCKS)
+   {
+      superBlock->dirty_regions |= 1u << (blockNum / DIRTY_REGION_BLOCKS);
+   }
+}
+
+/**
+ * @brief Writes an empty filesystem with the given geometry: superblock, byte maps,
+ *        inode table and a root directory holding only ".".
+ *
+ * Only the four metadata blocks are written; the file is then sized with ftruncate,
+ * so the data blocks stay unallocated (sparse) until something is stored in them.
+ * The image is marked clean, so the first mount does not check it.
+ *
+ * @return 0 on success, -1 if the geometry is out of range or the image cannot be written.
+ */
+int FormatFilesystem(FILE *file, int totalBlocks, int totalInodes)
+{
+   EXT_SIMPLE_SUPERBLOCK superBlock;
+   EXT_BYTE_MAPS byteMaps;
+   EXT_INODE_BLOCK inodeBlock;
+   EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+
+   if (totalBlocks <= FIRST_DATA_BLOCK || totalBlocks > MAX_PARTITION_BLOCKS ||
+       totalInodes <= RESERVED_INODES || totalInodes > MAX_INODES)
+   {
+      return -1;
+   }
+
+   memset(&superBlock, 0, sizeof(superBlock));
+   superBlock.total_inodes = totalInodes;
+   superBlock.total_blocks = totalBlocks;
+   superBlock.free_blocks = totalBlocks - FIRST_DATA_BLOCK;
+   superBlock.free_inodes = totalInodes - RESERVED_INODES;
+   superBlock.first_data_block = FIRST_DATA_BLOCK;
+   superBlock.block_size = BLOCK_SIZE;
+   superBlock.fs_state = FS_STATE_CLEAN;
+
+   memset(&byteMaps, 0, sizeof(byteMaps));
+   memset(byteMaps.block_bytemap, 1, FIRST_DATA_BLOCK);
+   memset(byteMaps.inode_bytemap, 1, RESERVED_INODES);
+
+   memset(&inodeBlock, 0, sizeof(inodeBlock));
+   for (int i = 0; i < MAX_INODES; i++)
+   {
+      for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+      {
+         inodeBlock.inodes[i].block_numbers[j] = NULL_BLOCK;
+      }
+   }
+
+   memset(directory, 0, sizeof(directory));
+   for (int i = 0; i < MAX_FILES; i++)
+   {
+      directory[i].inode = NULL_INODE;
+   }
+   strcpy(directory[0].file_name, ".");
+   directory[0].inode = RESERVED_INODES - 1;
+
+   SaveSuperBlock(&superBlock, file);
+   SaveByteMaps(&byteMaps, file);
+   SaveInodesAndDirectory(directory, &inodeBlock, file);
+   if (ftruncate(fileno(file), (off_t)totalBlocks * BLOCK_SIZE) != 0)
+   {
+      FsPerror("Error sizing partition");
+      return -1;
+   }
+   return ferror(file) ? -1 : 0;
+}
+
+/**
+ * @brief Saves all major filesystem structures (inodes, directory, bytemaps,
+ *        superblock, data blocks) in a single call.
+ */
+void SaveAllChanges(
+    EXT_DIRECTORY_ENTRY *directory,
+    EXT_INODE_BLOCK *inodeBlock,
+    EXT_BYTE_MAPS *byteMaps,
+    EXT_SIMPLE_SUPERBLOCK *superBlock,
+    EXT_DATA *data,
+    FILE *file)
+{
+   // 0. The metadata blocks are rewritten below; refresh their checksums so the superblock matches
+   MarkBlockDirty(superBlock, 0);
+   if (superBlock->feature_flags & FEATURE_CHECKSUMS)
+   {
+      UpdateMetadataChecksums(superBlock, byteMaps, inodeBlock, directory);
+   }
+   // 1. Save inodes and directory
+   SaveInodesAndDirectory(directory, inodeBlock, file);
+   // 2. Save byte maps
+   SaveByteMaps(byteMaps, file);
+   // 3. Save superblock
+   SaveSuperBlock(superBlock, file);
+   // 4. Save data blocks
+   SaveData(superBlock, byteMaps, data, file);
+   // 5. Release the blocks freed since the last save
+   if (superBlock->feature_flags & FEATURE_DISCARD)
+   {
+      FlushDiscards(byteMaps, file);
+   }
+   fsRuntime->uncommittedChanges = 0;
+}
+
+/**
+ * @brief Called after each modifying command. Saves at once by default; with a commit
+ *        interval (batch mode) the change is only counted, and everything is saved every
+ *        commitInterval changes, or only at unmount when the interval is negative.
+ */
+void SaveAfterChange(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, EXT_BYTE_MAPS *byteMaps,
+                     EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, FILE *file)
+{
+   fsRuntime->uncommittedChanges++;
+   if (fsRuntime->commitInterval >= 0 && fsRuntime->uncommittedChanges >= fsRuntime->commitInterval)
+   {
+      SaveAllChanges(directory, inodeBlock, byteMaps, superBlock, data, file);
+   }
+}
+
+/**
+ * @brief Writes the superblock to disk (block 0).
+ */
+void SaveSuperBlock(EXT_SIMPLE_SUPERBLOCK *superBlock, FILE *file)
+{
+   fseek(file, BLOCK_SIZE * 0, SEEK_SET);
+   if (fwrite(superBlock, sizeof(EXT_SIMPLE_SUPERBLOCK), 1, file) != 1)
+   {
+      FsPerror("Error saving SuperBlock");
+   }
+   fflush(file);
+}
+
+/**
+ * @brief Writes the byte maps (block 1) to disk: block-bytemap and inode-bytemap.
+ */
+void SaveByteMaps(EXT_BYTE_MAPS *byteMaps, FILE *file)
+{
+   fseek(file, BLOCK_SIZE * 1, SEEK_SET);
+   if (fwrite(byteMaps, sizeof(EXT_BYTE_MAPS), 1, file) != 1)
+   {
+      FsPerror("Error saving ByteMaps");
+   }
+   fflush(file);
+}
+
+/**
+ * @brief Writes the inode block (block 2) and directory (block 3) to disk.
+ */
+void SaveInodesAndDirectory(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, FILE *file)
+{
+   // Inode block is at block 2
+   fseek(file, BLOCK_SIZE * 2, SEEK_SET);
+   if (fwrite(inodeBlock, sizeof(EXT_INODE_BLOCK), 1, file) != 1)
+   {
+      FsPerror("Error saving InodeBlock");
+   }
+
+   // Directory is at block 3
+   fseek(file, BLOCK_SIZE * 3, SEEK_SET);
+   if (fwrite(directory, sizeof(EXT_DIRECTORY_ENTRY) * MAX_FILES, 1, file) != 1)
+   {
+      FsPerror("Error saving Directory");
+   }
+   fflush(file);
+}
+
+/**
+ * @brief Returns 1 if the block holds only zero bytes. Sixteen bytes are tested per
+ *        step with SSE2 where available, eight otherwise.
+ */
+int IsZeroBlock(const unsigned char *block)
+{
+#ifdef __SSE2__
+   __m128i acc = _mm_setzero_si128();
+   for (int i = 0; i < BLOCK_SIZE; i += 16)
+   {
+      acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(block + i)));
+   }
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+#else
+   unsigned long long acc = 0;
+   for (int i = 0; i < BLOCK_SIZE; i += 8)
+   {
+      unsigned long long word;
+      memcpy(&word, block + i, sizeof(word));
+      acc |= word;
+   }
+   return acc == 0;
+#endif
+}
+
+/**
+ * @brief Releases blocks [start, start + count) of the image to the host: a punched
+ *        hole for a regular file (reads back as zeros, size kept), BLKDISCARD for a
+ *        block device unless mustZero is set, since a discarded device range is not
+ *        guaranteed to read as zeros.
+ * @return 0 on success, -1 if the backend cannot do it.
+ */
+static int ReleaseBlockRange(FILE *file, int start, int count, int mustZero)
+{
+   int result = -1;
+#ifdef __linux__
+   struct stat info;
+   if (fstat(fileno(file), &info) != 0)
+   {
+      return -1;
+   }
+   if (S_ISBLK(info.st_mode))
+   {
+      unsigned long long range[2] = {(unsigned long long)start * BLOCK_SIZE,
+                                     (unsigned long long)count * BLOCK_SIZE};
+      result = mustZero ? -1 : ioctl(fileno(file), BLKDISCARD, &range);
+   }
+   else
+   {
+      result = fallocate(fileno(file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t)start * BLOCK_SIZE, (off_t)count * BLOCK_SIZE);
+   }
+#else
+   (void)file;
+   (void)start;
+   (void)count;
+   (void)mustZero;
+#endif
+   return result;
+}
+
+/**
+ * @brief Writes back the allocated data blocks modified since the last save (starting
+ *        from block 4), one write per run of consecutive modified blocks. Free and
+ *        unmodified blocks are never written, so holes in a sparse or discarded image
+ *        stay holes. Modified blocks are always resident, so data[] is read directly.
+ *
+ * Allocated blocks that are entirely zero are not written either: each run of them
+ * is punched as a hole, which reads back as zeros. If the backend cannot punch
+ * holes they are written like any other block.
+ */
+void SaveData(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data, FILE *file)
+{
+   int totalBlocks = PartitionBlockCount(superBlock);
+   for (int start = FIRST_DATA_BLOCK; start < totalBlocks; )
+   {
+      if (byteMaps->block_bytemap[start] == 0 || !IsBlockModified(start))
+      {
+         start++;
+         continue;
+      }
+      // A run is either all non-zero blocks or all zero blocks
+      int zero = IsZeroBlock(data[start - FIRST_DATA_BLOCK].data);
+      int end = start + 1;
+      while (end < totalBlocks && byteMaps->block_bytemap[end] != 0 && IsBlockModified(end) &&
+             IsZeroBlock(data[end - FIRST_DATA_BLOCK].data) == zero)
+      {
+         end++;
+      }
+      for (int blockNum = start; blockNum < end; blockNum++)
+      {
+         ClearBlockModified(blockNum);
+      }
+
+      size_t runBlocks = (size_t)(end - start);
+      if (zero)
+      {
+         fflush(file);
+         if (ReleaseBlockRange(file, start, (int)runBlocks, 1) == 0)
+         {
+            fsRuntime->stats.zeroBlocksElided += runBlocks;
+            start = end;
+            continue;
+         }
+      }
+      fseek(file, (long)start * BLOCK_SIZE, SEEK_SET);
+      if (fwrite(&data[start - FIRST_DATA_BLOCK], sizeof(EXT_DATA), runBlocks, file) != runBlocks)
+      {
+         FsPerror("Error saving Data blocks");
+      }
+      start = end;
+   }
+   fflush(file);
+}
+
+/**
+ * @brief Queues a freed data block for release at the next save (FEATURE_DISCARD only).
+ */
+void QueueDiscard(EXT_SIMPLE_SUPERBLOCK *superBlock, int blockNum)
+{
+   if ((superBlock->feature_flags & FEATURE_DISCARD) && blockNum >= FIRST_DATA_BLOCK &&
+       blockNum < MAX_PARTITION_BLOCKS)
+   {
+      fsRuntime->discardPending[blockNum] = 1;
+   }
+}
+
+/**
+ * @brief Releases the queued blocks that are still free, one call per run of
+ *        consecutive blocks: BLKDISCARD on a block device, otherwise a punched hole
+ *        (the file keeps its size). Without Linux support the queue is just cleared.
+ * @return The number of blocks released.
+ */
+int FlushDiscards(EXT_BYTE_MAPS *byteMaps, FILE *file)
+{
+   int discarded = 0;
+
+   fflush(file);
+   for (int start = FIRST_DATA_BLOCK; start < MAX_PARTITION_BLOCKS; )
+   {
+      if (!fsRuntime->discardPending[start] || byteMaps->block_bytemap[start] != 0)
+      {
+         fsRuntime->discardPending[start] = 0;
+         start++;
+         continue;
+      }
+      int end = start;
+      while (end < MAX_PARTITION_BLOCKS && fsRuntime->discardPending[end] && byteMaps->block_bytemap[end] == 0)
+      {
+         fsRuntime->discardPending[end] = 0;
+         end++;
+      }
+
+      if (ReleaseBlockRange(file, start, end - start, 0) == 0)
+      {
+         discarded += end - start;
+      }
+      start = end;
+   }
+
+   fsRuntime->stats.blocksDiscarded += discarded;
+   return discarded;
+}
+
+// ---------------------------------------------------------------------------
+// BLOCK CACHE
+// ---------------------------------------------------------------------------
+
+/* Per-block cache state; 0 means resident and unmodified */
+#define CACHE_ABSENT 0x01     // not in memory, read from the image on the next access
+#define CACHE_MODIFIED 0x02   // written since the last save
+#define CACHE_REFERENCED 0x04 // accessed since the clock hand last passed
+#define CACHE_PREFETCHED 0x08 // read ahead and not used yet
+#define CACHE_HELD 0x10       // rewritten under metadata not saved yet: only a save writes it
+
+#define READAHEAD_INITIAL_BLOCKS 4  // window of a new stream
+
+/**
+ * @brief Binds the cache to an image. With resident set, its data blocks were just
+ *        loaded and are all resident; otherwise none is. Nothing is modified, no
+ *        read-ahead stream is open, and the budget is kept.
+ */
+void ResetBlockCache(FILE *file, int resident)
+{
+   fsRuntime->cache.file = file;
+   fsRuntime->cache.clockHand = FIRST_DATA_BLOCK;
+   memset(fsRuntime->cache.state, resident ? 0 : CACHE_ABSENT, sizeof(fsRuntime->cache.state));
+   memset(fsRuntime->cache.pins, 0, sizeof(fsRuntime->cache.pins));
+   memset(fsRuntime->readaheadStreams, 0, sizeof(fsRuntime->readaheadStreams));
+}
+
+/* Reads blocks [start, end) from the image into the data array in one read */
+static void ReadBlockRun(EXT_DATA *data, int start, int end)
+{
+   unsigned char *run = data[start - FIRST_DATA_BLOCK].data;
+   size_t want = (size_t)(end - start) * BLOCK_SIZE;
+   size_t got = 0;
+
+   if (fsRuntime->cache.file != NULL)
+   {
+      fseek(fsRuntime->cache.file, (long)start * BLOCK_SIZE, SEEK_SET);
+      got = fread(run, 1, want, fsRuntime->cache.file);
+      clearerr(fsRuntime->cache.file);
+   }
+   memset(run + got, 0, want - got); // holes past the end of the image
+   for (int blockNum = start; blockNum < end; blockNum++)
+   {
+      fsRuntime->cache.state[blockNum] &= ~CACHE_ABSENT;
+   }
+}
+
+/* Reads an absent block back from the image */
+static void FaultInBlock(EXT_DATA *data, int blockNum)
+{
+   fsRuntime->stats.cacheMisses++;
+   ReadBlockRun(data, blockNum, blockNum + 1);
+}
+
+/**
+ * @brief Returns data block blockNum for reading, reading it from the image first if
+ *        it is not resident. The pointer stays valid until the next TrimBlockCache.
+ */
+unsigned char *ReadDataBlock(EXT_DATA *data, int blockNum)
+{
+   if (fsRuntime->cache.state[blockNum] & CACHE_ABSENT)
+   {
+      FaultInBlock(data, blockNum);
+   }
+   else
+   {
+      fsRuntime->stats.cacheHits++;
+   }
+   if (fsRuntime->cache.state[blockNum] & CACHE_PREFETCHED)
+   {
+      // Read-ahead paid off: allow larger windows again
+      fsRuntime->cache.state[blockNum] &= ~CACHE_PREFETCHED;
+      fsRuntime->stats.readaheadUsed++;
+      if (fsRuntime->readaheadCap < MAX_INODE_BLOCK_NUMS)
+      {
+         fsRuntime->readaheadCap++;
+      }
+   }
+   fsRuntime->cache.state[blockNum] |= CACHE_REFERENCED;
+   return data[blockNum - FIRST_DATA_BLOCK].data;
+}
+
+/**
+ * @brief Returns data block blockNum for writing and marks it for write-back at the
+ *        next save.
+ */
+unsigned char *WriteDataBlock(EXT_DATA *data, int blockNum)
+{
+   unsigned char *block = ReadDataBlock(data, blockNum);
+   fsRuntime->cache.state[blockNum] |= CACHE_MODIFIED;
+   return block;
+}
+
+int IsBlockModified(int blockNum)
+{
+   return (fsRuntime->cache.state[blockNum] & CACHE_MODIFIED) != 0;
+}
+
+void ClearBlockModified(int blockNum)
+{
+   fsRuntime->cache.state[blockNum] &= ~(CACHE_MODIFIED | CACHE_HELD);
+}
+
+/**
+ * @brief Keeps a modified block out of eviction write-back until the next save. For
+ *        blocks whose new bytes only make sense with metadata that is still in memory
+ *        (blocks moved between files, content under a new checksum): on disk alone
+ *        they would show another file's data or a checksum mismatch.
+ */
+void HoldBlockUntilSave(int blockNum)
+{
+   fsRuntime->cache.state[blockNum] |= CACHE_HELD;
+}
+
+/**
+ * @brief Tells whether the image holds the block's current content, i.e. it can be
+ *        read from the file instead of memory.
+ */
+int IsBlockClean(int blockNum)
+{
+   return fsRuntime->cache.file != NULL && !(fsRuntime->cache.state[blockNum] & CACHE_MODIFIED);
+}
+
+/**
+ * @brief Forgets the in-memory copy of a block that was just written to the image
+ *        around the cache; the next access reads it back.
+ */
+void DropCachedBlock(int blockNum)
+{
+   fsRuntime->cache.state[blockNum] = CACHE_ABSENT;
+}
+
+/**
+ * @brief ReadDataBlock for a reader that keeps the pointer beyond the current command.
+ *        Until the matching UnpinDataBlock the block is not evicted, and if its file
+ *        is deleted it is not handed out again, so the bytes stay as they were.
+ */
+unsigned char *PinDataBlock(EXT_DATA *data, int blockNum)
+{
+   unsigned char *block = ReadDataBlock(data, blockNum);
+   fsRuntime->cache.pins[blockNum]++;
+   return block;
+}
+
+void UnpinDataBlock(int blockNum)
+{
+   if (fsRuntime->cache.pins[blockNum] > 0)
+   {
+      fsRuntime->cache.pins[blockNum]--;
+   }
+}
+
+int IsBlockPinned(int blockNum)
+{
+   return fsRuntime->cache.pins[blockNum] > 0;
+}
+
+void SetBlockCacheBudget(int blocks)
+{
+   fsRuntime->cache.budget = blocks > 0 ? blocks : 0;
+}
+
+/* Allocated and inside the partition; other blocks are never written back */
+static int IsBlockInUse(const EXT_SIMPLE_SUPERBLOCK *superBlock, const EXT_BYTE_MAPS *byteMaps, int blockNum)
+{
+   return blockNum < PartitionBlockCount(superBlock) && byteMaps->block_bytemap[blockNum] != 0;
+}
+
+/* Pinned blocks stay, and so do held blocks still in use until a save writes them */
+static int CanEvictBlock(const EXT_SIMPLE_SUPERBLOCK *superBlock, const EXT_BYTE_MAPS *byteMaps, int blockNum)
+{
+   return fsRuntime->cache.pins[blockNum] == 0 &&
+          !((fsRuntime->cache.state[blockNum] & CACHE_HELD) && IsBlockInUse(superBlock, byteMaps, blockNum));
+}
+
+/**
+ * @brief Evicts resident blocks with the CLOCK algorithm until at most `budget`
+ *        remain: a referenced block gets its bit cleared and a second chance, an
+ *        unreferenced one is written back if modified and dropped. Free blocks and
+ *        blocks past the end of the partition are dropped without a write, so they
+ *        cannot refill a discarded hole or regrow a shrunk image. Run between
+ *        commands, so no pointer returned by ReadDataBlock is in use; pinned and held
+ *        blocks stay, even if that leaves the cache over budget. A failed write-back
+ *        stops the sweep.
+ * @return The number of data blocks still resident.
+ */
+int TrimBlockCache(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data)
+{
+   int resident = 0;
+   int evictable = 0;
+   for (int blockNum = FIRST_DATA_BLOCK; blockNum < MAX_PARTITION_BLOCKS; blockNum++)
+   {
+      if (!(fsRuntime->cache.state[blockNum] & CACHE_ABSENT))
+      {
+         resident++;
+         evictable += CanEvictBlock(superBlock, byteMaps, blockNum);
+      }
+   }
+
+   while (fsRuntime->cache.budget > 0 && resident > fsRuntime->cache.budget && evictable > 0)
+   {
+      int blockNum = fsRuntime->cache.clockHand;
+      fsRuntime->cache.clockHand = blockNum + 1 < MAX_PARTITION_BLOCKS ? blockNum + 1 : FIRST_DATA_BLOCK;
+      unsigned char *state = &fsRuntime->cache.state[blockNum];
+
+      if ((*state & CACHE_ABSENT) || !CanEvictBlock(superBlock, byteMaps, blockNum))
+      {
+         continue;
+      }
+      if (*state & CACHE_REFERENCED)
+      {
+         *state &= ~CACHE_REFERENCED;
+         continue;
+      }
+      if ((*state & CACHE_MODIFIED) && IsBlockInUse(superBlock, byteMaps, blockNum) && fsRuntime->cache.file != NULL)
+      {
+         fseek(fsRuntime->cache.file, (long)blockNum * BLOCK_SIZE, SEEK_SET);
+         if (fwrite(data[blockNum - FIRST_DATA_BLOCK].data, BLOCK_SIZE, 1, fsRuntime->cache.file) != 1)
+         {
+            // The block stays resident and modified; retrying now would fail the same way
+            FsPerror("Error writing back data block");
+            break;
+         }
+         fsRuntime->stats.cacheWritebacks++;
+      }
+      if (*state & CACHE_PREFETCHED)
+      {
+         // Read ahead for nothing: halve the largest window
+         fsRuntime->stats.readaheadWasted++;
+         fsRuntime->readaheadCap = fsRuntime->readaheadCap > 1 ? fsRuntime->readaheadCap / 2 : 1;
+      }
+      *state = CACHE_ABSENT;
+      fsRuntime->stats.cacheEvictions++;
+      resident--;
+      evictable--;
+   }
+   if (fsRuntime->cache.file != NULL)
+   {
+      fflush(fsRuntime->cache.file);
+   }
+   return resident;
+}
+
+/**
+ * @brief Reads up to maxBlocks allocated data blocks that are not resident yet, one
+ *        read per run of consecutive blocks. Called between commands after a lazy
+ *        mount, so the cache warms up without delaying the first prompt. Stops when
+ *        the cache budget is reached.
+ * @return The number of blocks read.
+ */
+int PrefetchBlocks(EXT_BYTE_MAPS *byteMaps, EXT_DATA *data, int maxBlocks)
+{
+   int fetched = 0;
+   int room = MAX_DATA_BLOCKS;
+
+   if (fsRuntime->cache.file == NULL)
+   {
+      return 0;
+   }
+   if (fsRuntime->cache.budget > 0)
+   {
+      room = fsRuntime->cache.budget;
+      for (int blockNum = FIRST_DATA_BLOCK; blockNum < MAX_PARTITION_BLOCKS; blockNum++)
+      {
+         room -= !(fsRuntime->cache.state[blockNum] & CACHE_ABSENT);
+      }
+   }
+   if (maxBlocks > room)
+   {
+      maxBlocks = room;
+   }
+
+   for (int start = FIRST_DATA_BLOCK; start < MAX_PARTITION_BLOCKS && fetched < maxBlocks; )
+   {
+      if (!(fsRuntime->cache.state[start] & CACHE_ABSENT) || byteMaps->block_bytemap[start] == 0)
+      {
+         start++;
+         continue;
+      }
+      int end = start + 1;
+      while (end < MAX_PARTITION_BLOCKS && end - start < maxBlocks - fetched &&
+             (fsRuntime->cache.state[end] & CACHE_ABSENT) && byteMaps->block_bytemap[end] != 0)
+      {
+         end++;
+      }
+
+      ReadBlockRun(data, start, end);
+      fetched += end - start;
+      start = end;
+   }
+   fsRuntime->stats.blocksPrefetched += fetched;
+   return fetched;
+}
+
+/**
+ * @brief Sequential read-ahead for file readers, called before block `index` of the
+ *        file is read.
+ *
+ * Each file read is tracked as a stream. Reading the block right after the previous
+ * one is sequential: when such a block is not resident, the stream's window doubles
+ * (up to the current cap), and that many blocks of the file are read, starting with
+ * the one needed. Blocks that are adjacent on disk are read with one call. Any other
+ * access resets the window. The cap follows the hit rate: each read-ahead block that
+ * is used raises it by one, and each one evicted unused halves it.
+ */
+void ReadAheadFile(const EXT_SIMPLE_INODE *inode, int index, EXT_DATA *data)
+{
+   READAHEAD_STREAM *stream = NULL;
+   for (int i = 0; i < READAHEAD_STREAMS; i++)
+   {
+      if (fsRuntime->readaheadStreams[i].inode == inode)
+      {
+         stream = &fsRuntime->readaheadStreams[i];
+         break;
+      }
+   }
+   if (stream == NULL)
+   {
+      stream = &fsRuntime->readaheadStreams[fsRuntime->readaheadNextSlot];
+      fsRuntime->readaheadNextSlot = (fsRuntime->readaheadNextSlot + 1) % READAHEAD_STREAMS;
+      stream->inode = inode;
+      stream->nextIndex = 0;
+      stream->window = READAHEAD_INITIAL_BLOCKS / 2; // doubled by the first sequential miss
+   }
+
+   int sequential = index == stream->nextIndex;
+   stream->nextIndex = index + 1;
+   int blockNum = inode->block_numbers[index];
+   if (blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS ||
+       !(fsRuntime->cache.state[blockNum] & CACHE_ABSENT))
+   {
+      return;
+   }
+
+   stream->window = sequential ? stream->window * 2 : 1;
+   if (stream->window > fsRuntime->readaheadCap)
+   {
+      stream->window = fsRuntime->readaheadCap;
+   }
+
+   // Read the window, one call per run of blocks that are adjacent on disk
+   int last = index + stream->window < MAX_INODE_BLOCK_NUMS ? index + stream->window : MAX_INODE_BLOCK_NUMS;
+   fsRuntime->stats.cacheMisses++;
+   for (int i = index; i < last; )
+   {
+      int start = inode->block_numbers[i];
+      if (start < FIRST_DATA_BLOCK || start >= MAX_PARTITION_BLOCKS || !(fsRuntime->cache.state[start] & CACHE_ABSENT))
+      {
+         i++;
+         continue;
+      }
+      int end = start + 1;
+      i++;
+      while (i < last && inode->block_numbers[i] == end && (fsRuntime->cache.state[end] & CACHE_ABSENT))
+      {
+         end++;
+         i++;
+      }
+      ReadBlockRun(data, start, end);
+      for (int ahead = start; ahead < end; ahead++)
+      {
+         if (ahead != blockNum)
+         {
+            fsRuntime->cache.state[ahead] |= CACHE_PREFETCHED;
+            fsRuntime->stats.readaheadBlocks++;
+         }
+      }
+   }
+}
+
+/**
+ * @brief Prints the cache budget, resident blocks and hit/miss/eviction counters.
+ */
+void PrintBlockCacheStats(void)
+{
+   const FS_STATS *stats = &fsRuntime->stats;
+   int resident = 0;
+   int modified = 0;
+   for (int blockNum = FIRST_DATA_BLOCK; blockNum < MAX_PARTITION_BLOCKS; blockNum++)
+   {
+      resident += !(fsRuntime->cache.state[blockNum] & CACHE_ABSENT);
+      modified += (fsRuntime->cache.state[blockNum] & CACHE_MODIFIED) != 0;
+   }
+   FsPrintf("Block cache: %d of %d data blocks resident (budget: ", resident, MAX_DATA_BLOCKS);
+   if (fsRuntime->cache.budget > 0)
+   {
+      FsPrintf("%d blocks, %d bytes)", fsRuntime->cache.budget, fsRuntime->cache.budget * BLOCK_SIZE);
+   }
+   else
+   {
+      FsPrintf("unlimited)");
+   }
+   FsPrintf(", %d modified\n", modified);
+   FsPrintf("Hits: %llu, misses: %llu, evictions: %llu, write-backs: %llu, prefetched: %llu\n",
+            stats->cacheHits, stats->cacheMisses, stats->cacheEvictions, stats->cacheWritebacks,
+            stats->blocksPrefetched);
+   FsPrintf("Read-ahead: %llu blocks, %llu used, %llu evicted unused (window cap %d)\n",
+            stats->readaheadBlocks, stats->readaheadUsed, stats->readaheadWasted, fsRuntime->readaheadCap);
+}
+
+// ---------------------------------------------------------------------------
+// FILESYSTEM AND COMMAND-RELATED FUNCTIONS
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Lists all files in the directory along with their sizes, inodes, and allocated blocks.
+ * 
+ * Iterates through the directory entries, skipping empty ones and the special entry ".", 
+ * retrieves corresponding inodes, and displays file information.
+ * 
+ * @param directory Pointer to the directory entries array.
+ * @param inodes Pointer to the inode block structure.
+ */
+void ListDirectory(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes)
+{
+   int i, j;
+   int fileCount = 0; // Counter for found files
+
+   FsPrintf("List of files in the directory:\n");
+   FsPrintf("-------------------------------------------------------\n");
+   for (i = 0; i < MAX_FILES; i++)
+   {
+      // Skip empty entries and the special entry "."
+      if (directory[i].inode == NULL_INODE || strcmp(directory[i].file_name, ".") == 0)
+      {
+         continue;
+      }
+
+      // Get the corresponding inode
+      EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[i].inode];
+
+      // Print file name, size, and inode
+      FsPrintf("\n%-20s size:%-6u inode:%-2d blocks:",
+               directory[i].file_name, // File name
+               inode->file_size,       // File size
+               directory[i].inode);    // Inode number
+  
+        // Print occupied blocks
+        for (j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+        {
+           if (inode->block_numbers[j] != NULL_BLOCK) // Skip unassigned blocks
+           {
+              FsPrintf(" %u", inode->block_numbers[j]);
+         }
+      }
+      if (inode->codec == INODE_CODEC_LZ)
+      {
+         FsPrintf(" (compressed)");
+      }
+
+      fileCount++; // Increment the file counter
+   }
+   FsPrintf("\n");
+
+   // Check if no files were found
+   if (fileCount == 0)
+   {
+      FsPrintf("No files in the directory.\n");
+   }
+}
+
+/**
+ * @brief Prints the metadata stored in the superblock.
+ * 
+ * Displays details such as the total number of inodes, total blocks, free blocks, 
+ * free inodes, the starting data block, and the block size.
+ * 
+ * @param superBlock Pointer to the superblock structure.
+ */
+void PrintSuperBlock(EXT_SIMPLE_SUPERBLOCK *superBlock)
+{
+   FsPrintf("\nSuperblock Information:\n");
+   FsPrintf("Total inodes: %u\n", superBlock->total_inodes);
+   FsPrintf("Total blocks: %u\n", superBlock->total_blocks);
+   FsPrintf("Free blocks: %u\n", superBlock->free_blocks);
+   FsPrintf("Free inodes: %u\n", superBlock->free_inodes);
+   FsPrintf("First data block: %u\n", superBlock->first_data_block);
+   FsPrintf("Block size: %u bytes\n", superBlock->block_size);
+   FsPrintf("Features:");
+   if ((superBlock->feature_flags & (FEATURE_DEDUP | FEATURE_COMPRESS | FEATURE_CHECKSUMS | FEATURE_DISCARD)) == 0)
+   {
+      FsPrintf(" none");
+   }
+   if (superBlock->feature_flags & FEATURE_DEDUP)
+   {
+      FsPrintf(" dedup");
+   }
+   if (superBlock->feature_flags & FEATURE_COMPRESS)
+   {
+      FsPrintf(" compress");
+   }
+   if (superBlock->feature_flags & FEATURE_CHECKSUMS)
+   {
+      FsPrintf(" checksums");
+   }
+   if (superBlock->feature_flags & FEATURE_DISCARD)
+   {
+      FsPrintf(" discard");
+   }
+   FsPrintf("\n");
+   FsPrintf("Dirty regions since mount: 0x%08x\n", superBlock->dirty_regions);
+}
+
+/**
+ * @brief Displays the allocation status of inodes and data blocks.
+ * 
+ * Prints the inode bitmap and the first 25 entries of the block bitmap, 
+ * showing which resources are currently allocated or free.
+ * 
+ * @param byteMaps Pointer to the structure containing the byte maps.
+ */
+void PrintByteMaps(EXT_BYTE_MAPS *byteMaps)
+{
+   int i;
+
+   FsPrintf("\nByte maps information:");
+
+   // Display the contents of the inode bytemap
+   FsPrintf("\nInodes: ");
+   for (i = 0; i < MAX_INODES; i++)
+   {
+      FsPrintf("%u ", byteMaps->inode_bytemap[i]);
+   }
+   FsPrintf("\n");
+   // Display the contents of the block bytemap (first 25 elements)
+   FsPrintf("Blocks [0-25]: ");
+   for (i = 0; i < 25; i++)
+   {
+      FsPrintf("%u ", byteMaps->block_bytemap[i]);
+   }
+   FsPrintf("\n");
+}
+
+/* Writes all of spans to fd, going on after partial writes; the spans are consumed */
+static int WriteSpans(int fd, struct iovec *spans, int count)
+{
+   while (count > 0)
+   {
+      ssize_t written = writev(fd, spans, count > IOV_MAX ? IOV_MAX : count);
+      if (written < 0)
+      {
+         return -1;
+      }
+      while (count > 0 && (size_t)written >= spans->iov_len)
+      {
+         written -= spans->iov_len;
+         spans++;
+         count--;
+      }
+      if (count > 0)
+      {
+         spans->iov_base = (char *)spans->iov_base + written;
+         spans->iov_len -= written;
+      }
+   }
+   return 0;
+}
+
+/**
+ * @brief Displays the content of a specified file, or of a range of it.
+ * 
+ * Finds the file in the directory, retrieves its associated inode, and writes the
+ * requested bytes to standard output with one writev straight from the data blocks:
+ * adjacent blocks form one span, nothing is copied or allocated, and binary content
+ * comes out whole. Only the blocks in the range are verified and read, so the tail
+ * of a file costs only its own blocks. Compressed files are decoded first.
+ * 
+ * @param directory Pointer to the directory entries array.
+ * @param inodes Pointer to the inode block structure.
+ * @param superBlock Pointer to the superblock (holds the block checksums).
+ * @param data Pointer to the data blocks array.
+ * @param name Name of the file to be printed.
+ * @param offset First byte to print; negative counts back from the end of the file.
+ * @param length Bytes to print at most, or PRINT_TO_END.
+ * @return 0 on success, -1 if the file is not found or an error occurs.
+ */
+int PrintFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_SIMPLE_SUPERBLOCK *superBlock,
+              EXT_DATA *data, char *name, long offset, size_t length)
+{
+   // Find the file using FindFile
+   int fileIndex = FindFile(directory, inodes, name);
+
+   if (fileIndex == -1)
+   {
+      FsPrintf("File '%s' not found.\n", name);
+      return -1;
+   }
+
+   // Get the inode of the file
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[fileIndex].inode];
+
+   // Check if the file size is valid
+   if (inode->file_size == 0)
+   {
+      FsPrintf("File '%s' is empty.\n", name);
+      return 0;
+   }
+
+   if (inode->file_size > MAX_FILE_SIZE)
+   {
+      FsErrorf("Error: Invalid size %u for file '%s'.\n", inode->file_size, name);
+      return -1;
+   }
+
+   // Clamp the range to the file; a negative offset counts back from the end
+   size_t size = inode->file_size;
+   size_t start = (size_t)offset;
+   if (offset < 0)
+   {
+      size_t back = (size_t)(-(offset + 1)) + 1; // no overflow for LONG_MIN
+      start = back < size ? size - back : 0;
+   }
+   start = start < size ? start : size;
+   size_t end = length < size - start ? start + length : size;
+   int firstIndex = start / BLOCK_SIZE;
+   int lastIndex = end > start ? (int)((end - 1) / BLOCK_SIZE) : firstIndex - 1;
+
+   struct iovec spans[MAX_INODE_BLOCK_NUMS];
+   int spanCount = 0;
+   unsigned char content[MAX_FILE_SIZE];
+   if (inode->codec == INODE_CODEC_LZ)
+   {
+      // Refuse to print content that no longer matches its checksums; ReadFileContent
+      // then reads the stream in order, with read-ahead
+      for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+      {
+         int blockNumber = inode->block_numbers[i];
+         if (blockNumber != NULL_BLOCK && VerifyDataChecksum(superBlock, data, blockNumber) != 0)
+         {
+            FsErrorf("Error: Checksum mismatch in block %d of file '%s'.\n", blockNumber, name);
+            return -1;
+         }
+      }
+
+      // Compressed files are decoded as a whole, through the decompression cache
+      if (ReadFileContent(inode, data, content) != (int)size)
+      {
+         FsErrorf("Error: Corrupt compressed data in file '%s'.\n", name);
+         return -1;
+      }
+      spans[spanCount].iov_base = content + start;
+      spans[spanCount++].iov_len = end - start;
+   }
+   else
+   {
+      // Only the blocks in the range are read, verified and collected; nothing is
+      // written until all of them check out
+      for (int i = firstIndex; i <= lastIndex; i++)
+      {
+         int blockNumber = inode->block_numbers[i];
+
+         // Ensure blockNumber is within valid range
+         if (blockNumber < FIRST_DATA_BLOCK || blockNumber >= (FIRST_DATA_BLOCK + MAX_DATA_BLOCKS))
+         {
+            FsErrorf("Error: Invalid block number %d for file '%s'.\n", blockNumber, name);
+            return -1;
+         }
+
+         ReadAheadFile(inode, i, data);
+         if (VerifyDataChecksum(superBlock, data, blockNumber) != 0)
+         {
+            FsErrorf("Error: Checksum mismatch in block %d of file '%s'.\n", blockNumber, name);
+            return -1;
+         }
+         unsigned char *block = ReadDataBlock(data, blockNumber);
+         size_t from = i == firstIndex ? start % BLOCK_SIZE : 0;
+         size_t to = i == lastIndex ? end - (size_t)i * BLOCK_SIZE : BLOCK_SIZE;
+
+         // Blocks that follow each other in the partition follow each other in memory
+         if (spanCount > 0 && (unsigned char *)spans[spanCount - 1].iov_base + spans[spanCount - 1].iov_len == block + from)
+         {
+            spans[spanCount - 1].iov_len += to - from;
+         }
+         else
+         {
+            spans[spanCount].iov_base = block + from;
+            spans[spanCount++].iov_len = to - from;
+         }
+      }
+   }
+
+   if (fsRuntime->quiet)
+   {
+      return 0;
+   }
+   FsPrintf("Content of file '%s':\n", name);
+   fflush(stdout); // the spans bypass the stdio buffer
+   if (WriteSpans(STDOUT_FILENO, spans, spanCount) != 0)
+   {
+      FsPerror("Error writing file content");
+      return -1;
+   }
+   FsPrintf("\n");
+   return 0;
+}
+
+/**
+ * @brief Renames a file from oldName to newName if it exists and newName is not taken.
+ * @return 0 on success, -1 on failure.
+ */
+int RenameFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, char *oldName, char *newName)
+{
+   if (!oldName || !newName || strlen(newName) == 0)
+   {
+      FsErrorf("Invalid file names.\n");
+      return -1;
+   }
+
+   int fileIndex = FindFile(directory, inodes, oldName);
+   if (fileIndex == -1)
+   {
+      FsErrorf("File '%s' not found.\n", oldName);
+      return -1;
+   }
+
+   if (FindFile(directory, inodes, newName) != -1)
+   {
+      FsErrorf("A file with the name '%s' already exists.\n", newName);
+      return -1;
+   }
+
+   strncpy(directory[fileIndex].file_name, newName, sizeof(directory[fileIndex].file_name) - 1);
+   directory[fileIndex].file_name[sizeof(directory[fileIndex].file_name) - 1] = '\0';
+   FsStatusf("File renamed from '%s' to '%s'.\n", oldName, newName);
+   return 0;
+}
+
+/**
+ * @brief Deletes a file by freeing its data blocks, its inode, and removing its directory entry.
+ * @return 0 on success, -1 on failure.
+ */
+int DeleteFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes,
+               EXT_BYTE_MAPS *byteMaps, EXT_SIMPLE_SUPERBLOCK *superBlock, char *name)
+{
+   int fileIndex = FindFile(directory, inodes, name);
+   if (fileIndex == -1)
+   {
+      FsErrorf("File '%s' not found.\n", name);
+      return -1;
+   }
+
+   int inodeIndex = directory[fileIndex].inode;
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[inodeIndex];
+
+   // Drop this file's reference to each of its data blocks
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      if (inode->block_numbers[i] != NULL_BLOCK)
+      {
+         ReleaseDataBlock(superBlock, byteMaps, inode->block_numbers[i]);
+         inode->block_numbers[i] = NULL_BLOCK;
+      }
+   }
+
+   // Free inode
+   byteMaps->inode_bytemap[inodeIndex] = 0;
+   memset(inode, 0, sizeof(EXT_SIMPLE_INODE));
+   superBlock->free_inodes++;
+
+   // Remove directory entry
+   directory[fileIndex].inode = NULL_INODE;
+   memset(directory[fileIndex].file_name, 0, sizeof(directory[fileIndex].file_name));
+
+   FsStatusf("File '%s' deleted successfully.\n", name);
+   return 0;
+}
+
+/**
+ * @brief Copies an existing source file to a new destination file by allocating
+ *        new blocks and a new inode for the destination. The new blocks are written
+ *        to 'particion.bin' at the next save, like any other change.
+ *        With dedup enabled the destination shares the source's blocks instead.
+ * @return 0 on success, -1 on failure.
+ */
+int CopyFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+             EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+             char *sourceName, char *destName, FILE *file)
+{
+   if (!directory || !inodes || !byteMaps || !superBlock || !data ||
+       !sourceName || !destName || !file)
+   {
+      FsErrorf("Invalid input parameters.\n");
+      return -1;
+   }
+
+   // Check if destination already exists
+   if (FindFile(directory, inodes, destName) != -1)
+   {
+      FsErrorf("Destination file '%s' already exists.\n", destName);
+      return -1;
+   }
+
+   // Locate source file
+   int sourceIndex = FindFile(directory, inodes, sourceName);
+   if (sourceIndex == -1)
+   {
+      FsErrorf("Source file '%s' not found.\n", sourceName);
+      return -1;
+   }
+
+   EXT_DIRECTORY_ENTRY *sourceEntry = &directory[sourceIndex];
+   EXT_SIMPLE_INODE *sourceInode = &inodes->inodes[sourceEntry->inode];
+
+   // Find a free inode for the new file
+   int destInodeIndex = -1;
+   for (int i = 0; i < PartitionInodeCount(superBlock); i++)
+   {
+      // Usually inodes 0,1,2 are reserved in many simplified FS examples
+      if (byteMaps->inode_bytemap[i] == 0 && i > 2)
+      {
+         destInodeIndex = i;
+         break;
+      }
+   }
+   if (destInodeIndex == -1)
+   {
+      FsErrorf("No free inodes available.\n");
+      return -1;
+   }
 
    // Mark the inode as occupied
    byteMaps->inode_bytemap[destInodeIndex] = 1;
    superBlock->free_inodes--;
 
-   // Initialize the destination inode
-   EXT_SIMPLE_INODE *destInode = &inodes->inodes[destInodeIndex];
-   destInode->file_size = sourceInode->file_size;
-   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   // Initialize the destination inode
+   EXT_SIMPLE_INODE *destInode = &inodes->inodes[destInodeIndex];
+   destInode->file_size = sourceInode->file_size;
+   destInode->codec = INODE_CODEC_RAW;
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      destInode->block_numbers[i] = NULL_BLOCK;
+   }
+
+   if ((superBlock->feature_flags & FEATURE_COMPRESS) && sourceInode->codec != INODE_CODEC_LZ)
+   {
+      // Compression is on and the source is stored raw: compress it on the way
+      unsigned char content[MAX_FILE_SIZE];
+      int readFailed = ReadFileContent(sourceInode, data, content) < 0;
+      if (readFailed ||
+          WriteFileContent(superBlock, byteMaps, data, destInode, content, sourceInode->file_size) != 0)
+      {
+         if (readFailed)
+         {
+            FsErrorf("Could not read source file '%s'; its blocks may be corrupt.\n", sourceName);
+         }
+         else
+         {
+            FsErrorf("No free blocks available to copy data.\n");
+         }
+         byteMaps->inode_bytemap[destInodeIndex] = 0;
+         superBlock->free_inodes++;
+         memset(destInode, 0, sizeof(EXT_SIMPLE_INODE));
+         return -1;
+      }
+   }
+   else
+   {
+      // Copy data blocks as they are stored (compressed streams stay compressed)
+      destInode->codec = sourceInode->codec;
+      unsigned char buffer[BLOCK_SIZE];
+      for (int i = 0; i < MAX_INODE_BLOCK_NUMS && sourceInode->block_numbers[i] != NULL_BLOCK; i++)
+      {
+         // Calculate the source data index
+         int dataIndex = sourceInode->block_numbers[i] - FIRST_DATA_BLOCK;
+         if (dataIndex < 0 || dataIndex >= MAX_DATA_BLOCKS)
+         {
+            FsErrorf("Invalid data index %d for block %d.\n", dataIndex, sourceInode->block_numbers[i]);
+            // rollback
+            for (int k = 0; k < i; k++)
+            {
+               if (destInode->block_numbers[k] != NULL_BLOCK)
+               {
+                  ReleaseDataBlock(superBlock, byteMaps, destInode->block_numbers[k]);
+                  destInode->block_numbers[k] = NULL_BLOCK;
+               }
+            }
+            byteMaps->inode_bytemap[destInodeIndex] = 0;
+            superBlock->free_inodes++;
+            memset(destInode, 0, sizeof(EXT_SIMPLE_INODE));
+            return -1;
+         }
+
+         // Copy through the block cache
+         ReadAheadFile(sourceInode, i, data);
+         memcpy(buffer, ReadDataBlock(data, dataIndex + FIRST_DATA_BLOCK), BLOCK_SIZE);
+
+         // Store the block; with dedup enabled this just takes another reference on the source block
+         int destBlockNum = StoreDataBlock(superBlock, byteMaps, data, buffer);
+         if (destBlockNum == -1)
+         {
+            FsErrorf("No free blocks available to copy data.\n");
+            // rollback the blocks taken so far and the inode
+            for (int k = 0; k < i; k++)
+            {
+               ReleaseDataBlock(superBlock, byteMaps, destInode->block_numbers[k]);
+            }
+            byteMaps->inode_bytemap[destInodeIndex] = 0;
+            superBlock->free_inodes++;
+            memset(destInode, 0, sizeof(EXT_SIMPLE_INODE));
+            return -1;
+         }
+         // StoreDataBlock leaves a fresh block modified in the cache; the next save writes it
+         destInode->block_numbers[i] = destBlockNum;
+      }
+   }
+
+   // Find a free directory entry
+   int destDirIndex = -1;
+   for (int i = 0; i < MAX_FILES; i++)
+   {
+      if (directory[i].inode == NULL_INODE)
+      {
+         destDirIndex = i;
+         break;
+      }
+   }
+   if (destDirIndex == -1)
+   {
+      FsErrorf("No free directory entries available.\n");
+      // rollback inode and blocks
+      for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+      {
+         if (destInode->block_numbers[i] != NULL_BLOCK)
+         {
+            ReleaseDataBlock(superBlock, byteMaps, destInode->block_numbers[i]);
+            destInode->block_numbers[i] = NULL_BLOCK;
+         }
+      }
+      byteMaps->inode_bytemap[destInodeIndex] = 0;
+      superBlock->free_inodes++;
+      memset(destInode, 0, sizeof(EXT_SIMPLE_INODE));
+      return -1;
+   }
+
+   // Create the directory entry
+   strncpy(directory[destDirIndex].file_name, destName, FILE_NAME_LENGTH - 1);
+   directory[destDirIndex].file_name[FILE_NAME_LENGTH - 1] = '\0';
+   directory[destDirIndex].inode = destInodeIndex;
+
+   FsStatusf("File '%s' copied to '%s' successfully.\n", sourceName, destName);
+   return 0;
+}
+
+/**
+ * @brief Creates a new file with the specified name and content, allocating
+ *        an inode and the required data blocks (or reusing identical ones when
+ *        dedup is enabled).
+ */
+int CreateFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+               EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+               char *fileName, char *content)
+{
+   return CreateFileFromBuffer(directory, inodes, byteMaps, superBlock, data, fileName,
+                               (const unsigned char *)content, strlen(content));
+}
+
+/**
+ * @brief CreateFile for arbitrary bytes: the content is size bytes long and may hold
+ *        zeros. Nothing is allocated unless the whole file can be created.
+ * @return 0 on success, -1 on failure.
+ */
+int CreateFileFromBuffer(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                         EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+                         const char *fileName, const unsigned char *content, size_t size)
+{
+   // Check if file already exists
+   if (FindFile(directory, inodes, (char *)fileName) != -1)
+   {
+      FsErrorf("Error: File '%s' already exists.\n", fileName);
+      return -1;
+   }
+
+   if (size > MAX_FILE_SIZE)
+   {
+      FsErrorf("Error: Content exceeds the maximum file size of %d bytes.\n", MAX_FILE_SIZE);
+      return -1;
+   }
+
+   // Locate a free directory entry
+   int entryIndex = -1;
+   for (int i = 0; i < MAX_FILES; i++)
+   {
+      if (directory[i].inode == NULL_INODE)
+      {
+         entryIndex = i;
+         break;
+      }
+   }
+   if (entryIndex == -1)
+   {
+      FsErrorf("Error: No free directory entries available.\n");
+      return -1;
+   }
+
+   // Locate a free inode
+   int inodeIndex = -1;
+   for (int i = 0; i < PartitionInodeCount(superBlock); i++)
+   {
+      if (byteMaps->inode_bytemap[i] == 0)
+      {
+         inodeIndex = i;
+         break;
+      }
+   }
+   if (inodeIndex == -1)
+   {
+      FsErrorf("Error: No free inodes available.\n");
+      return -1;
+   }
+
+   // Initialize the inode
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[inodeIndex];
+   inode->file_size = size;
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      inode->block_numbers[i] = NULL_BLOCK;
+   }
+
+   // Store the content (compressed when enabled and worthwhile)
+   if (WriteFileContent(superBlock, byteMaps, data, inode, content, inode->file_size) != 0)
+   {
+      FsErrorf("Error: No free blocks available to create file.\n");
+      memset(inode, 0, sizeof(EXT_SIMPLE_INODE));
+      return -1;
+   }
+
+   // Mark inode as used and create the directory entry
+   byteMaps->inode_bytemap[inodeIndex] = 1;
+   superBlock->free_inodes--;
+   strncpy(directory[entryIndex].file_name, fileName, FILE_NAME_LENGTH - 1);
+   directory[entryIndex].file_name[FILE_NAME_LENGTH - 1] = '\0';
+   directory[entryIndex].inode = inodeIndex;
+   FsStatusf("File '%s' created successfully.\n", fileName);
+   return 0;
+}
+
+/* Finds a free directory entry and a free inode for a new file; nothing is taken yet */
+static int ReserveFileSlot(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                           EXT_SIMPLE_SUPERBLOCK *superBlock, const char *fileName,
+                           int *entryIndex, int *inodeIndex)
+{
+   if (FindFile(directory, inodes, (char *)fileName) != -1)
+   {
+      FsErrorf("Error: File '%s' already exists.\n", fileName);
+      return -1;
+   }
+
+   *entryIndex = -1;
+   for (int i = 0; i < MAX_FILES && *entryIndex == -1; i++)
+   {
+      if (directory[i].inode == NULL_INODE)
+      {
+         *entryIndex = i;
+      }
+   }
+   *inodeIndex = -1;
+   for (int i = 0; i < PartitionInodeCount(superBlock) && *inodeIndex == -1; i++)
+   {
+      if (byteMaps->inode_bytemap[i] == 0)
+      {
+         *inodeIndex = i;
+      }
+   }
+   if (*entryIndex == -1 || *inodeIndex == -1)
+   {
+      FsErrorf("Error: No free %s available.\n", *entryIndex == -1 ? "directory entries" : "inodes");
+      return -1;
+   }
+
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[*inodeIndex];
+   inode->file_size = 0;
+   inode->codec = INODE_CODEC_RAW;
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      inode->block_numbers[i] = NULL_BLOCK;
+   }
+   return 0;
+}
+
+/* Takes the slots found by ReserveFileSlot once the new file's inode is filled in */
+static void LinkNewFile(EXT_DIRECTORY_ENTRY *directory, EXT_BYTE_MAPS *byteMaps, EXT_SIMPLE_SUPERBLOCK *superBlock,
+                        const char *fileName, int entryIndex, int inodeIndex)
+{
+   byteMaps->inode_bytemap[inodeIndex] = 1;
+   superBlock->free_inodes--;
+   strncpy(directory[entryIndex].file_name, fileName, FILE_NAME_LENGTH - 1);
+   directory[entryIndex].file_name[FILE_NAME_LENGTH - 1] = '\0';
+   directory[entryIndex].inode = inodeIndex;
+}
+
+/* Undoes LinkNewFile for a file whose content could not be stored */
+static void UnlinkNewFile(EXT_DIRECTORY_ENTRY *directory, EXT_BYTE_MAPS *byteMaps, EXT_SIMPLE_SUPERBLOCK *superBlock,
+                          int entryIndex, int inodeIndex)
+{
+   byteMaps->inode_bytemap[inodeIndex] = 0;
+   superBlock->free_inodes++;
+   directory[entryIndex].inode = NULL_INODE;
+   memset(directory[entryIndex].file_name, 0, sizeof(directory[entryIndex].file_name));
+}
+
+/* Undoes a partly stored new file: its blocks go back, the inode is cleared */
+static void DiscardNewFile(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_SIMPLE_INODE *inode)
+{
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      if (inode->block_numbers[i] != NULL_BLOCK)
+      {
+         ReleaseDataBlock(superBlock, byteMaps, inode->block_numbers[i]);
+      }
+   }
+   memset(inode, 0, sizeof(EXT_SIMPLE_INODE));
+}
+
+/**
+ * @brief Creates a file from content pulled from read one data block at a time, so
+ *        memory use does not depend on the file size. Each block is stored as soon as
+ *        it is full (shared when dedup is on); streamed files are not compressed.
+ *
+ * read is called until it returns 0 (end of content); -1 means the content is
+ * incomplete. The reader may be left part-way through its content on failure.
+ *
+ * @return 0 on success, -1 on failure (nothing stays allocated).
+ */
+int CreateFileFromStream(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                         EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+                         const char *fileName, CONTENT_READER read, void *source)
+{
+   int entryIndex;
+   int inodeIndex;
+   if (ReserveFileSlot(directory, inodes, byteMaps, superBlock, fileName, &entryIndex, &inodeIndex) != 0)
+   {
+      return -1;
+   }
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[inodeIndex];
+
+   // Fill one block at a time; a short block is the last one
+   unsigned char block[BLOCK_SIZE];
+   const char *error = NULL;
+   for (int i = 0; error == NULL; i++)
+   {
+      size_t filled = 0;
+      long got = 0;
+      while (filled < BLOCK_SIZE && (got = read(source, block + filled, BLOCK_SIZE - filled)) > 0)
+      {
+         filled += got;
+      }
+      if (got < 0)
+      {
+         error = "Content ended early";
+         break;
+      }
+      if (filled == 0)
+      {
+         break;
+      }
+      if (i == MAX_INODE_BLOCK_NUMS)
+      {
+         error = "Content exceeds the maximum file size";
+         break;
+      }
+
+      memset(block + filled, 0, BLOCK_SIZE - filled);
+      int blockNum = StoreDataBlock(superBlock, byteMaps, data, block);
+      if (blockNum == -1)
+      {
+         error = "No free blocks available to create file";
+         break;
+      }
+      inode->block_numbers[i] = blockNum;
+      inode->file_size += filled;
+      if (filled < BLOCK_SIZE)
+      {
+         break;
+      }
+   }
+
+   if (error != NULL)
+   {
+      FsErrorf("Error: %s.\n", error);
+      DiscardNewFile(superBlock, byteMaps, inode);
+      return -1;
+   }
+
+   LinkNewFile(directory, byteMaps, superBlock, fileName, entryIndex, inodeIndex);
+   FsStatusf("File '%s' created successfully (%u bytes).\n", fileName, inode->file_size);
+   return 0;
+}
+
+/* A block a file may not change in place: other files share it, or a read view holds it */
+static int MustCopyBlock(EXT_BYTE_MAPS *byteMaps, int blockNum)
+{
+   return byteMaps->block_bytemap[blockNum] > 1 || IsBlockPinned(blockNum);
+}
+
+/* Checks that a raw file's size fits its block list and every block it covers is a data block */
+static int CheckFileBlocks(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_SIMPLE_INODE *inode, const char *fileName)
+{
+   if (inode->file_size > MAX_FILE_SIZE)
+   {
+      FsErrorf("Error: Invalid size %u for file '%s'.\n", inode->file_size, fileName);
+      return -1;
+   }
+   for (int i = 0; i < (int)((inode->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE); i++)
+   {
+      int blockNumber = inode->block_numbers[i];
+      if (blockNumber < FIRST_DATA_BLOCK || blockNumber >= PartitionBlockCount(superBlock))
+      {
+         FsErrorf("Error: Invalid block number %d for file '%s'.\n", blockNumber, fileName);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/* Stores new content for a compressed file (compressed again if worthwhile) and frees
+   the old stream; the old blocks are kept until the new ones are in place */
+static int RewriteFileContent(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data,
+                              EXT_SIMPLE_INODE *inode, const unsigned char *content, size_t size)
+{
+   EXT_SIMPLE_INODE replacement = *inode;
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      replacement.block_numbers[i] = NULL_BLOCK;
+   }
+   if (WriteFileContent(superBlock, byteMaps, data, &replacement, content, size) != 0)
+   {
+      return -1;
+   }
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      if (inode->block_numbers[i] != NULL_BLOCK)
+      {
+         InvalidateDecompressCache(inode->block_numbers[i]);
+         ReleaseDataBlock(superBlock, byteMaps, inode->block_numbers[i]);
+      }
+   }
+   replacement.file_size = size;
+   *inode = replacement;
+   return 0;
+}
+
+/**
+ * @brief Writes size bytes of content into an existing file at offset, growing it if
+ *        the write ends past the end. A gap between the old end and offset reads as
+ *        zeros.
+ *
+ * Only the blocks the write touches are changed. A block only this file uses is
+ * rewritten in place and held in the cache until the next save writes it after its
+ * new checksum; a block shared with other files (dedup, copy) or pinned by a
+ * read view is copied on write: the file drops its reference and gets a new block,
+ * which dedup may share again. The blocks needed are counted first, so the write
+ * either happens whole or not at all. A compressed file is decoded, changed and
+ * stored again as a whole.
+ *
+ * @return 0 on success, -1 if the file does not exist, would exceed the maximum file
+ *         size, or there is not enough space (nothing is changed).
+ */
+int WriteFileRange(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                   EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+                   const char *fileName, size_t offset, const unsigned char *content, size_t size)
+{
+   int fileIndex = FindFile(directory, inodes, (char *)fileName);
+   if (fileIndex == -1)
+   {
+      FsErrorf("File '%s' not found.\n", fileName);
+      return -1;
+   }
+   if (offset > MAX_FILE_SIZE || size > MAX_FILE_SIZE - offset)
+   {
+      FsErrorf("Error: Content exceeds the maximum file size of %d bytes.\n", MAX_FILE_SIZE);
+      return -1;
+   }
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[fileIndex].inode];
+   size_t oldSize = inode->file_size;
+   size_t end = offset + size;
+   size_t newSize = end > oldSize ? end : oldSize;
+
+   if (inode->codec == INODE_CODEC_LZ)
+   {
+      unsigned char whole[MAX_FILE_SIZE];
+      if (ReadFileContent(inode, data, whole) != (int)oldSize)
+      {
+         FsErrorf("Error: Corrupt compressed data in file '%s'.\n", fileName);
+         return -1;
+      }
+      memset(whole + oldSize, 0, newSize - oldSize);
+      if (size > 0) // growing by truncate passes no content
+      {
+         memcpy(whole + offset, content, size);
+      }
+      if (RewriteFileContent(superBlock, byteMaps, data, inode, whole, newSize) != 0)
+      {
+         FsErrorf("Error: No free blocks available to write to file.\n");
+         return -1;
+      }
+      return 0;
+   }
+
+   if (CheckFileBlocks(superBlock, inode, fileName) != 0)
+   {
+      return -1;
+   }
+
+   // The touched blocks: from the write, or from the old end when the write leaves a gap
+   size_t from = offset < oldSize ? offset : oldSize;
+   int first = from / BLOCK_SIZE;
+   int last = end > from ? (int)((end - 1) / BLOCK_SIZE) : first - 1;
+   int oldBlocks = (oldSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+   int needed = 0;
+   for (int i = first; i <= last; i++)
+   {
+      needed += i >= oldBlocks || MustCopyBlock(byteMaps, inode->block_numbers[i]);
+   }
+   if (needed > CountAllocatableBlocks(superBlock, byteMaps))
+   {
+      FsErrorf("Error: No free blocks available to write to file.\n");
+      return -1;
+   }
+
+   unsigned char block[BLOCK_SIZE];
+   for (int i = first; i <= last; i++)
+   {
+      // Old bytes up to the old end, zeros after it, the new content over both
+      size_t blockStart = (size_t)i * BLOCK_SIZE;
+      memset(block, 0, BLOCK_SIZE);
+      if (i < oldBlocks)
+      {
+         size_t keep = oldSize - blockStart < BLOCK_SIZE ? oldSize - blockStart : BLOCK_SIZE;
+         memcpy(block, ReadDataBlock(data, inode->block_numbers[i]), keep);
+      }
+      size_t copyFrom = offset > blockStart ? offset : blockStart;
+      size_t copyTo = end < blockStart + BLOCK_SIZE ? end : blockStart + BLOCK_SIZE;
+      if (copyTo > copyFrom)
+      {
+         memcpy(block + (copyFrom - blockStart), content + (copyFrom - offset), copyTo - copyFrom);
+      }
+
+      if (i < oldBlocks && !MustCopyBlock(byteMaps, inode->block_numbers[i]))
+      {
+         // Held until the save: on disk before the superblock, the new bytes would
+         // fail the old checksum
+         int blockNum = inode->block_numbers[i];
+         memcpy(WriteDataBlock(data, blockNum), block, BLOCK_SIZE);
+         HoldBlockUntilSave(blockNum);
+         if (superBlock->feature_flags & FEATURE_DEDUP)
+         {
+            byteMaps->block_fingerprints[blockNum - FIRST_DATA_BLOCK] = HashBlock(block);
+         }
+         MarkBlockDirty(superBlock, blockNum);
+         UpdateDataChecksum(superBlock, data, blockNum);
+      }
+      else
+      {
+         if (i < oldBlocks)
+         {
+            ReleaseDataBlock(superBlock, byteMaps, inode->block_numbers[i]);
+         }
+         inode->block_numbers[i] = StoreDataBlock(superBlock, byteMaps, data, block);
+      }
+   }
+   inode->file_size = newSize;
+   return 0;
+}
+
+/**
+ * @brief Writes content at the end of an existing file; see WriteFileRange.
+ * @return 0 on success, -1 on failure (nothing is changed).
+ */
+int AppendFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+               EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+               const char *fileName, const unsigned char *content, size_t size)
+{
+   int fileIndex = FindFile(directory, inodes, (char *)fileName);
+   if (fileIndex == -1)
+   {
+      FsErrorf("File '%s' not found.\n", fileName);
+      return -1;
+   }
+   size_t end = inodes->inodes[directory[fileIndex].inode].file_size;
+   return WriteFileRange(directory, inodes, byteMaps, superBlock, data, fileName, end, content, size);
+}
+
+/**
+ * @brief Sets the size of an existing file. Shrinking releases the blocks past the
+ *        new end (a shared block just loses a reference) and leaves the others as
+ *        they are; growing adds zeros, as a write at the new size would.
+ * @return 0 on success, -1 on failure (nothing is changed).
+ */
+int TruncateFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                 EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, const char *fileName, size_t size)
+{
+   int fileIndex = FindFile(directory, inodes, (char *)fileName);
+   if (fileIndex == -1)
+   {
+      FsErrorf("File '%s' not found.\n", fileName);
+      return -1;
+   }
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[fileIndex].inode];
+   if (size >= inode->file_size)
+   {
+      return WriteFileRange(directory, inodes, byteMaps, superBlock, data, fileName, size, NULL, 0);
+   }
+
+   if (inode->codec == INODE_CODEC_LZ)
+   {
+      unsigned char whole[MAX_FILE_SIZE];
+      if (ReadFileContent(inode, data, whole) != (int)inode->file_size)
+      {
+         FsErrorf("Error: Corrupt compressed data in file '%s'.\n", fileName);
+         return -1;
+      }
+      if (RewriteFileContent(superBlock, byteMaps, data, inode, whole, size) != 0)
+      {
+         FsErrorf("Error: No free blocks available to truncate file.\n");
+         return -1;
+      }
+      return 0;
+   }
+
+   if (CheckFileBlocks(superBlock, inode, fileName) != 0)
+   {
+      return -1;
+   }
+   for (int i = (size + BLOCK_SIZE - 1) / BLOCK_SIZE; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      if (inode->block_numbers[i] != NULL_BLOCK)
+      {
+         ReleaseDataBlock(superBlock, byteMaps, inode->block_numbers[i]);
+         inode->block_numbers[i] = NULL_BLOCK;
+      }
+   }
+
+   // Zero the cut tail of the last block so it hashes like freshly stored content. A
+   // shared or pinned block keeps its bytes: reads stop at file_size, and a later
+   // write zeroes everything past the end anyway.
+   int lastBlock = inode->block_numbers[size / BLOCK_SIZE];
+   if (size % BLOCK_SIZE != 0 && !MustCopyBlock(byteMaps, lastBlock))
+   {
+      unsigned char *block = WriteDataBlock(data, lastBlock);
+      memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+      HoldBlockUntilSave(lastBlock);
+      if (superBlock->feature_flags & FEATURE_DEDUP)
+      {
+         byteMaps->block_fingerprints[lastBlock - FIRST_DATA_BLOCK] = HashBlock(block);
+      }
+      MarkBlockDirty(superBlock, lastBlock);
+      UpdateDataChecksum(superBlock, data, lastBlock);
+   }
+   inode->file_size = size;
+   return 0;
+}
+
+/**
+ * @brief Enables or disables an optional filesystem feature ("dedup", "compress", "checksums"
+ *        or "discard").
+ *
+ * Turning dedup on rebuilds the fingerprint index from the blocks already in use,
+ * so existing content can be shared by later writes.
+ *
+ * @return 0 on success, -1 on an unknown option or value.
+ */
+int SetOption(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data,
+              const char *name, const char *value)
+{
+   int enable;
+   if (strcmp(value, "on") == 0)
+   {
+      enable = 1;
+   }
+   else if (strcmp(value, "off") == 0)
+   {
+      enable = 0;
+   }
+   else
+   {
+      FsErrorf("Error: Option value must be 'on' or 'off'.\n");
+      return -1;
+   }
+
+   if (strcmp(name, "dedup") == 0)
+   {
+      if (enable)
+      {
+         RebuildFingerprintIndex(byteMaps, data);
+         superBlock->feature_flags |= FEATURE_DEDUP;
+      }
+      else
+      {
+         superBlock->feature_flags &= ~FEATURE_DEDUP;
+      }
+   }
+   else if (strcmp(name, "checksums") == 0)
+   {
+      if (enable)
+      {
+         // Metadata blocks are checksummed by SaveAllChanges; data blocks here
+         superBlock->feature_flags |= FEATURE_CHECKSUMS;
+         for (int blockNum = FIRST_DATA_BLOCK; blockNum < PartitionBlockCount(superBlock); blockNum++)
+         {
+            if (byteMaps->block_bytemap[blockNum] > 0)
+            {
+               UpdateDataChecksum(superBlock, data, blockNum);
+            }
+         }
+      }
+      else
+      {
+         superBlock->feature_flags &= ~FEATURE_CHECKSUMS;
+      }
+   }
+   else if (strcmp(name, "discard") == 0)
+   {
+      if (enable)
+      {
+         // Release everything already free at the next save
+         superBlock->feature_flags |= FEATURE_DISCARD;
+         for (int blockNum = FIRST_DATA_BLOCK; blockNum < PartitionBlockCount(superBlock); blockNum++)
+         {
+            if (byteMaps->block_bytemap[blockNum] == 0)
+            {
+               QueueDiscard(superBlock, blockNum);
+            }
+         }
+      }
+      else
+      {
+         superBlock->feature_flags &= ~FEATURE_DISCARD;
+      }
+   }
+   else if (strcmp(name, "compress") == 0)
+   {
+      if (enable)
+      {
+         superBlock->feature_flags |= FEATURE_COMPRESS;
+      }
+      else
+      {
+         superBlock->feature_flags &= ~FEATURE_COMPRESS;
+      }
+   }
+   else
+   {
+      FsErrorf("Error: Unknown option '%s'.\n", name);
+      return -1;
+   }
+
+   FsStatusf("Option '%s' set to %s.\n", name, value);
+   return 0;
+}
+
+// ---------------------------------------------------------------------------
+// HOST FILE IMPORT AND EXPORT
+// ---------------------------------------------------------------------------
+
+#define HOST_COPY_CHUNK (64 * 1024) // buffered copy size where the kernel cannot copy
+
+/**
+ * @brief Copies length bytes from one file descriptor to another at the given offsets.
+ *        On Linux the data stays in the kernel (copy_file_range, which may share
+ *        extents on filesystems that support it); where that is unavailable, or for
+ *        whatever it did not copy, pread/pwrite in large chunks are used. The bytes
+ *        are counted in stats, which import workers keep to themselves.
+ * @return 0 on success, -1 if the input ended early or a read or write failed.
+ */
+static int CopyHostRange(int inFd, off_t inOffset, int outFd, off_t outOffset, size_t length, FS_STATS *stats)
+{
+#ifdef __linux__
+   while (length > 0)
+   {
+      ssize_t copied = copy_file_range(inFd, &inOffset, outFd, &outOffset, length, 0);
+      if (copied <= 0)
+      {
+         break; // not supported for this pair (EXDEV, ENOSYS, EINVAL...) or end of input
+      }
+      length -= copied;
+      stats->bytesCopiedInKernel += copied;
+   }
+#endif
+
+   unsigned char buffer[HOST_COPY_CHUNK];
+   while (length > 0)
+   {
+      size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+      ssize_t got = pread(inFd, buffer, chunk, inOffset);
+      if (got <= 0 || pwrite(outFd, buffer, got, outOffset) != got)
+      {
+         return -1;
+      }
+      inOffset += got;
+      outOffset += got;
+      length -= got;
+      stats->bytesCopiedBuffered += got;
+   }
+   return 0;
+}
+
+/**
+ * @brief Writes the first size bytes of a host file into the image blocks listed in
+ *        blockNumbers, one CopyHostRange per contiguous run, and zeroes the rest of the
+ *        last block as a buffered write would have. Touches neither the cache nor the
+ *        metadata, so several can run at once on different blocks.
+ * @return 0 on success, -1 on failure.
+ */
+static int CopyHostFileToBlocks(int fd, size_t size, const unsigned short int *blockNumbers, int imageFd,
+                                FS_STATS *stats)
+{
+   int blockCount = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+   for (int i = 0; i < blockCount;)
+   {
+      int run = 1;
+      while (i + run < blockCount && blockNumbers[i + run] == blockNumbers[i] + run)
+      {
+         run++;
+      }
+      size_t offset = (size_t)i * BLOCK_SIZE;
+      size_t length = size - offset < (size_t)run * BLOCK_SIZE ? size - offset : (size_t)run * BLOCK_SIZE;
+      if (CopyHostRange(fd, offset, imageFd, (off_t)blockNumbers[i] * BLOCK_SIZE, length, stats) != 0)
+      {
+         return -1;
+      }
+      i += run;
+   }
+   if (size % BLOCK_SIZE != 0)
+   {
+      unsigned char zeros[BLOCK_SIZE] = {0};
+      size_t tail = BLOCK_SIZE - size % BLOCK_SIZE;
+      off_t tailOffset = (off_t)blockNumbers[blockCount - 1] * BLOCK_SIZE + size % BLOCK_SIZE;
+      if (pwrite(imageFd, zeros, tail, tailOffset) != (ssize_t)tail)
+      {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/* Content read straight from a host file descriptor */
+static long ReadHostFile(void *source, unsigned char *buffer, size_t capacity)
+{
+   ssize_t got = read(*(int *)source, buffer, capacity);
+   return got < 0 ? -1 : (long)got;
+}
+
+/**
+ * @brief Copies a host file into the partition as a new file.
+ *
+ * When the blocks do not need to be seen on the way in (dedup off) and the block
+ * cache is bound to the image, free blocks are allocated first, preferably as one
+ * contiguous run, and the content goes from the host file to them with
+ * CopyHostRange, one call per run. The in-memory copies of those blocks are then
+ * dropped so the next access reads them from the image. Otherwise the file is
+ * streamed in block by block through CreateFileFromStream.
+ *
+ * @return 0 on success, -1 on failure (nothing stays allocated).
+ */
+int ImportFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+               EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+               const char *hostPath, const char *fileName, FILE *file)
+{
+   int fd = open(hostPath, O_RDONLY);
+   if (fd < 0)
+   {
+      FsPerror(hostPath);
+      return -1;
+   }
+   struct stat info;
+   if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size > MAX_FILE_SIZE)
+   {
+      FsErrorf("Error: '%s' is not a regular file of at most %d bytes.\n", hostPath, MAX_FILE_SIZE);
+      close(fd);
+      return -1;
+   }
+
+   if ((superBlock->feature_flags & FEATURE_DEDUP) || file == NULL || fsRuntime->cache.file != file)
+   {
+      int result = CreateFileFromStream(directory, inodes, byteMaps, superBlock, data, fileName, ReadHostFile, &fd);
+      close(fd);
+      return result;
+   }
+
+   int entryIndex;
+   int inodeIndex;
+   if (ReserveFileSlot(directory, inodes, byteMaps, superBlock, fileName, &entryIndex, &inodeIndex) != 0)
+   {
+      close(fd);
+      return -1;
+   }
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[inodeIndex];
+   size_t size = info.st_size;
+   int blockCount = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+   if (AllocateDataBlocks(superBlock, byteMaps, blockCount, inode->block_numbers) != 0)
+   {
+      FsErrorf("Error: No free blocks available to create file.\n");
+      close(fd);
+      return -1;
+   }
+
+   fflush(file);
+   int failed = CopyHostFileToBlocks(fd, size, inode->block_numbers, fileno(file), &fsRuntime->stats) != 0;
+   close(fd);
+   fflush(file); // the stream must not serve what it buffered before the writes
+
+   for (int i = 0; i < blockCount; i++)
+   {
+      DropCachedBlock(inode->block_numbers[i]);
+      InvalidateDecompressCache(inode->block_numbers[i]);
+   }
+   if (failed)
+   {
+      FsErrorf("Error: Could not copy '%s' into the partition.\n", hostPath);
+      DiscardNewFile(superBlock, byteMaps, inode);
+      return -1;
+   }
+   for (int i = 0; i < blockCount; i++)
+   {
+      UpdateDataChecksum(superBlock, data, inode->block_numbers[i]);
+   }
+
+   inode->file_size = size;
+   LinkNewFile(directory, byteMaps, superBlock, fileName, entryIndex, inodeIndex);
+   FsStatusf("File '%s' imported from '%s' (%u bytes).\n", fileName, hostPath, inode->file_size);
+   return 0;
+}
+
+/**
+ * @brief Writes a file of the partition to a host file, created or truncated.
+ *
+ * Blocks whose current content is in the image (see IsBlockClean) are copied from it
+ * with CopyHostRange, merging adjacent ones into one copy; blocks changed since the
+ * last save are written from memory, and compressed files are decompressed first.
+ * With checksums enabled every block is verified before anything is written.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int ExportFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_SIMPLE_SUPERBLOCK *superBlock,
+               EXT_DATA *data, const char *fileName, const char *hostPath, FILE *file)
+{
+   int fileIndex = FindFile(directory, inodes, (char *)fileName);
+   if (fileIndex == -1)
+   {
+      FsErrorf("File '%s' not found.\n", fileName);
+      return -1;
+   }
+   EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[fileIndex].inode];
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      if (inode->block_numbers[i] != NULL_BLOCK && VerifyDataChecksum(superBlock, data, inode->block_numbers[i]) != 0)
+      {
+         FsErrorf("Error: Checksum mismatch in block %d of file '%s'.\n", inode->block_numbers[i], fileName);
+         return -1;
+      }
+   }
+
+   int fd = open(hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+   {
+      FsPerror(hostPath);
+      return -1;
+   }
+
+   int failed = 0;
+   if (inode->codec == INODE_CODEC_LZ)
+   {
+      unsigned char content[MAX_FILE_SIZE];
+      failed = ReadFileContent(inode, data, content) != (int)inode->file_size ||
+               write(fd, content, inode->file_size) != (ssize_t)inode->file_size;
+   }
+   else
+   {
+      if (file != NULL)
+      {
+         fflush(file);
+      }
+      size_t size = inode->file_size;
+      for (int i = 0; (size_t)i * BLOCK_SIZE < size && !failed;)
+      {
+         int blockNum = inode->block_numbers[i];
+         size_t offset = (size_t)i * BLOCK_SIZE;
+         if (i >= MAX_INODE_BLOCK_NUMS || blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS)
+         {
+            failed = 1;
+            break;
+         }
+         if (file == NULL || fsRuntime->cache.file != file || !IsBlockClean(blockNum))
+         {
+            size_t length = size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE;
+            failed = pwrite(fd, ReadDataBlock(data, blockNum), length, offset) != (ssize_t)length;
+            fsRuntime->stats.bytesCopiedBuffered += length;
+            i++;
+            continue;
+         }
+         int run = 1;
+         while (i + run < MAX_INODE_BLOCK_NUMS && (size_t)(i + run) * BLOCK_SIZE < size &&
+                inode->block_numbers[i + run] == blockNum + run && IsBlockClean(blockNum + run))
+         {
+            run++;
+         }
+         size_t length = size - offset < (size_t)run * BLOCK_SIZE ? size - offset : (size_t)run * BLOCK_SIZE;
+         failed = CopyHostRange(fileno(file), (off_t)blockNum * BLOCK_SIZE, fd, offset, length,
+                                &fsRuntime->stats) != 0;
+         i += run;
+      }
+   }
+   if (close(fd) != 0 || failed)
+   {
+      FsErrorf("Error: Could not write '%s' to '%s'.\n", fileName, hostPath);
+      return -1;
+   }
+   FsStatusf("File '%s' exported to '%s' (%u bytes).\n", fileName, hostPath, inode->file_size);
+   return 0;
+}
+
+#define IMPORT_TREE_THREADS 8      // most import-tree workers, whatever the core count
+#define IMPORT_PATH_LENGTH 1024
+
+/* One host file of an import-tree, from the directory walk to the final commit */
+typedef struct
+{
+   char hostPath[IMPORT_PATH_LENGTH];
+   char fileName[FILE_NAME_LENGTH];
+   size_t size;
+   int entryIndex; // slots taken at reservation; inodeIndex is -1 if the file got none
+   int inodeIndex;
+   const unsigned short int *blockNumbers;
+   int failed;
+   FS_STATS stats; // this file's copy counters, added to the runtime's after the join
+} IMPORT_JOB;
+
+/* Work shared by the import-tree workers: each takes the next job until none is left */
+typedef struct
+{
+   IMPORT_JOB *jobs;
+   int count;
+   int next;
+   int imageFd;
+   pthread_mutex_t lock;
+} IMPORT_QUEUE;
+
+static int CompareImportJobs(const void *a, const void *b)
+{
+   return strcmp(((const IMPORT_JOB *)a)->hostPath, ((const IMPORT_JOB *)b)->hostPath);
+}
+
+/**
+ * @brief Adds the regular files under dirPath, recursively, to jobs. Files that cannot
+ *        become a partition file (name too long, too large, more than capacity) are
+ *        reported and counted in skipped, and so is a subdirectory that cannot be
+ *        read; symbolic links are not followed.
+ * @return 0 on success, -1 if dirPath cannot be read.
+ */
+static int CollectHostFiles(const char *dirPath, IMPORT_JOB *jobs, int *count, int capacity, int *skipped)
+{
+   DIR *dir = opendir(dirPath);
+   if (dir == NULL)
+   {
+      FsPerror(dirPath);
+      return -1;
+   }
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      {
+         continue;
+      }
+      char path[IMPORT_PATH_LENGTH];
+      struct stat info;
+      if (snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name) >= (int)sizeof(path) ||
+          lstat(path, &info) != 0)
+      {
+         FsErrorf("Skipping '%s/%s': cannot be read.\n", dirPath, entry->d_name);
+         (*skipped)++;
+      }
+      else if (S_ISDIR(info.st_mode))
+      {
+         if (CollectHostFiles(path, jobs, count, capacity, skipped) != 0)
+         {
+            (*skipped)++; // the rest of the tree is still imported, but the import fails
+         }
+      }
+      else if (!S_ISREG(info.st_mode))
+      {
+         continue;
+      }
+      else if (strlen(entry->d_name) >= FILE_NAME_LENGTH || info.st_size > MAX_FILE_SIZE || *count == capacity)
+      {
+         FsErrorf("Skipping '%s': %s.\n", path,
+                  *count == capacity ? "the directory is full"
+                  : info.st_size > MAX_FILE_SIZE ? "larger than the maximum file size" : "name too long");
+         (*skipped)++;
+      }
+      else
+      {
+         IMPORT_JOB *job = &jobs[(*count)++];
+         memset(job, 0, sizeof(*job));
+         strcpy(job->hostPath, path);
+         strcpy(job->fileName, entry->d_name);
+         job->size = info.st_size;
+         job->inodeIndex = -1;
+      }
+   }
+   closedir(dir);
+   return 0;
+}
+
+/* import-tree worker: copies reserved jobs into the image until the queue is empty */
+static void *ImportWorker(void *argument)
+{
+   IMPORT_QUEUE *queue = argument;
+   for (;;)
+   {
+      pthread_mutex_lock(&queue->lock);
+      int index = queue->next++;
+      pthread_mutex_unlock(&queue->lock);
+      if (index >= queue->count)
+      {
+         return NULL;
+      }
+      IMPORT_JOB *job = &queue->jobs[index];
+      if (job->inodeIndex < 0)
+      {
+         continue;
+      }
+      int fd = open(job->hostPath, O_RDONLY);
+      job->failed = fd < 0 || CopyHostFileToBlocks(fd, job->size, job->blockNumbers, queue->imageFd, &job->stats) != 0;
+      if (fd >= 0)
+      {
+         close(fd);
+      }
+   }
+}
+
+/**
+ * @brief Imports every regular file under a host directory, each under its own name.
+ *
+ * The tree is walked first, then inodes, directory entries and data blocks are
+ * reserved for all files at once on this thread. Up to IMPORT_TREE_THREADS workers
+ * (no more than the online cores) then read the host files and write their blocks
+ * into the image concurrently with CopyHostFileToBlocks; they share nothing but a
+ * job counter. Back on this thread the checksums are computed and files that failed
+ * are released, so the metadata is saved once by the caller. With dedup on, or
+ * when the cache is not bound to file, the files go through ImportFile one by one.
+ *
+ * @param imported Set to the number of files imported.
+ * @return 0 if every file was imported, -1 if any was skipped or failed.
+ */
+int ImportTree(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+               EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+               const char *hostDir, FILE *file, int *imported)
+{
+   IMPORT_JOB jobs[MAX_FILES];
+   int count = 0;
+   int skipped = 0;
+   *imported = 0;
+   double start = NowSeconds();
+   if (CollectHostFiles(hostDir, jobs, &count, MAX_FILES, &skipped) != 0)
+   {
+      return -1;
+   }
+   qsort(jobs, count, sizeof(IMPORT_JOB), CompareImportJobs);
+
+   int threads = 1;
+   if ((superBlock->feature_flags & FEATURE_DEDUP) || file == NULL || fsRuntime->cache.file != file)
+   {
+      for (int i = 0; i < count; i++)
+      {
+         jobs[i].failed = ImportFile(directory, inodes, byteMaps, superBlock, data,
+                                     jobs[i].hostPath, jobs[i].fileName, file) != 0;
+      }
+   }
+   else
+   {
+      // Reserve everything up front; files are linked now so later names and slots see them
+      for (int i = 0; i < count; i++)
+      {
+         IMPORT_JOB *job = &jobs[i];
+         int entryIndex;
+         int inodeIndex;
+         job->failed = 1;
+         if (ReserveFileSlot(directory, inodes, byteMaps, superBlock, job->fileName, &entryIndex, &inodeIndex) != 0)
+         {
+            continue;
+         }
+         EXT_SIMPLE_INODE *inode = &inodes->inodes[inodeIndex];
+         if (AllocateDataBlocks(superBlock, byteMaps, (job->size + BLOCK_SIZE - 1) / BLOCK_SIZE,
+                                inode->block_numbers) != 0)
+         {
+            FsErrorf("Error: No free blocks available to import '%s'.\n", job->hostPath);
+            continue;
+         }
+         inode->file_size = job->size;
+         LinkNewFile(directory, byteMaps, superBlock, job->fileName, entryIndex, inodeIndex);
+         job->entryIndex = entryIndex;
+         job->inodeIndex = inodeIndex;
+         job->blockNumbers = inode->block_numbers;
+      }
+
+      IMPORT_QUEUE queue = {jobs, count, 0, fileno(file), PTHREAD_MUTEX_INITIALIZER};
+      long cores = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cores < 1 ? 1 : cores > IMPORT_TREE_THREADS ? IMPORT_TREE_THREADS : (int)cores;
+      threads = threads > count ? (count > 0 ? count : 1) : threads;
+      pthread_t workers[IMPORT_TREE_THREADS];
+      int started = 0;
+      fflush(file);
+      while (started < threads - 1 && pthread_create(&workers[started], NULL, ImportWorker, &queue) == 0)
+      {
+         started++;
+      }
+      ImportWorker(&queue); // this thread works too, so the import finishes even if no worker started
+      for (int i = 0; i < started; i++)
+      {
+         pthread_join(workers[i], NULL);
+      }
+      threads = started + 1;
+      fflush(file); // the stream must not serve what it buffered before the writes
+
+      for (int i = 0; i < count; i++)
+      {
+         IMPORT_JOB *job = &jobs[i];
+         if (job->inodeIndex < 0)
+         {
+            continue;
+         }
+         EXT_SIMPLE_INODE *inode = &inodes->inodes[job->inodeIndex];
+         int blockCount = (job->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+         for (int b = 0; b < blockCount; b++)
+         {
+            DropCachedBlock(inode->block_numbers[b]);
+            InvalidateDecompressCache(inode->block_numbers[b]);
+         }
+         fsRuntime->stats.bytesCopiedInKernel += job->stats.bytesCopiedInKernel;
+         fsRuntime->stats.bytesCopiedBuffered += job->stats.bytesCopiedBuffered;
+         if (job->failed)
+         {
+            FsErrorf("Error: Could not copy '%s' into the partition.\n", job->hostPath);
+            UnlinkNewFile(directory, byteMaps, superBlock, job->entryIndex, job->inodeIndex);
+            DiscardNewFile(superBlock, byteMaps, inode);
+            continue;
+         }
+         for (int b = 0; b < blockCount; b++)
+         {
+            UpdateDataChecksum(superBlock, data, inode->block_numbers[b]);
+         }
+      }
+   }
+
+   size_t bytes = 0;
+   int failed = 0;
+   for (int i = 0; i < count; i++)
+   {
+      if (jobs[i].failed)
+      {
+         failed++;
+      }
+      else
+      {
+         (*imported)++;
+         bytes += jobs[i].size;
+      }
+   }
+   double seconds = NowSeconds() - start;
+   FsPrintf("Imported %d of %d files, %zu bytes in %.3f s (%.2f MB/s, %.0f files/s) with %d thread%s.\n",
+            *imported, count + skipped, bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+            seconds > 0 ? *imported / seconds : 0.0, threads, threads == 1 ? "" : "s");
+   return failed == 0 && skipped == 0 ? 0 : -1;
+}
+
+#define TAR_BLOCK 512
+
+/* A file of the partition in an export-tar, placed by the first block of its data */
+typedef struct
+{
+   int entryIndex;
+   int firstBlock;
+} TAR_MEMBER;
+
+static int CompareTarMembers(const void *a, const void *b)
+{
+   return ((const TAR_MEMBER *)a)->firstBlock - ((const TAR_MEMBER *)b)->firstBlock;
+}
+
+/* Fills a ustar header for a regular file; the partition keeps no owners or times */
+static void FillTarHeader(unsigned char header[TAR_BLOCK], const char *name, size_t size)
+{
+   memset(header, 0, TAR_BLOCK);
+   strncpy((char *)header, name, 100);
+   memcpy(header + 100, "0000644", 8);    // mode
+   memcpy(header + 108, "0000000", 8);    // uid
+   memcpy(header + 116, "0000000", 8);    // gid
+   snprintf((char *)header + 124, 12, "%011lo", (unsigned long)size);
+   memcpy(header + 136, "00000000000", 12); // mtime
+   header[156] = '0';                     // regular file
+   memcpy(header + 257, "ustar", 6);
+   memcpy(header + 263, "00", 2);
+
+   unsigned int sum = 8 * ' '; // the checksum field counts as spaces
+   for (int i = 0; i < TAR_BLOCK; i++)
+   {
+      sum += header[i];
+   }
+   snprintf((char *)header + 148, 8, "%06o", sum);
+   header[155] = ' ';
+}
+
+/* Numeric header field: octal text, or base-256 when the first byte has its top bit set */
+static unsigned long long ParseTarNumber(const unsigned char *field, int length)
+{
+   unsigned long long value = 0;
+   if (field[0] & 0x80)
+   {
+      value = field[0] & 0x7f;
+      for (int i = 1; i < length; i++)
+      {
+         value = value << 8 | field[i];
+      }
+      return value;
+   }
+   for (int i = 0; i < length && field[i] != '\0'; i++)
+   {
+      if (field[i] >= '0' && field[i] <= '7')
+      {
+         value = value * 8 + (field[i] - '0');
+      }
+   }
+   return value;
+}
+
+/* Reads past count bytes of in, a block at a time; -1 if it ends first */
+static int SkipTarBytes(FILE *in, unsigned long long count)
+{
+   unsigned char discard[TAR_BLOCK];
+   while (count > 0)
+   {
+      size_t chunk = count < sizeof(discard) ? (size_t)count : sizeof(discard);
+      if (fread(discard, 1, chunk, in) != chunk)
+      {
+         return -1;
+      }
+      count -= chunk;
+   }
+   return 0;
+}
+
+/**
+ * @brief Writes every file of the partition to out as a POSIX (ustar) tar stream.
+ *
+ * Files are written in the order of their first data block, so that after a defrag
+ * the image is read front to back. Raw files are streamed one block at a time through
+ * the block cache, so memory use stays bounded whatever the image size; compressed
+ * files are decoded into one file-sized buffer. Each file's checksums are verified
+ * before its header is written; a file that fails is left out and reported.
+ *
+ * @return 0 on success, -1 if a file was left out or out could not be written.
+ */
+int ExportTar(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_SIMPLE_SUPERBLOCK *superBlock,
+              EXT_DATA *data, FILE *out, int *exported)
+{
+   TAR_MEMBER members[MAX_FILES];
+   int count = 0;
+   *exported = 0;
+   for (int i = 0; i < MAX_FILES; i++)
+   {
+      if (directory[i].inode == NULL_INODE || strcmp(directory[i].file_name, ".") == 0)
+      {
+         continue;
+      }
+      EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[i].inode];
+      members[count].entryIndex = i;
+      members[count].firstBlock = inode->file_size > 0 ? inode->block_numbers[0] : 0;
+      count++;
+   }
+   qsort(members, count, sizeof(TAR_MEMBER), CompareTarMembers);
+
+   int failed = 0;
+   unsigned char header[TAR_BLOCK];
+   for (int m = 0; m < count; m++)
+   {
+      const char *name = directory[members[m].entryIndex].file_name;
+      EXT_SIMPLE_INODE *inode = &inodes->inodes[directory[members[m].entryIndex].inode];
+      size_t size = inode->file_size;
+      int blockCount = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      int broken = 0;
+      for (int i = 0; i < MAX_INODE_BLOCK_NUMS && !broken; i++)
+      {
+         broken = inode->block_numbers[i] != NULL_BLOCK &&
+                  VerifyDataChecksum(superBlock, data, inode->block_numbers[i]) != 0;
+      }
+      if (broken)
+      {
+         FsErrorf("Error: Checksum mismatch in file '%s'; left out of the archive.\n", name);
+         failed = 1;
+         continue;
+      }
+
+      FillTarHeader(header, name, size);
+      fwrite(header, 1, TAR_BLOCK, out);
+      if (inode->codec == INODE_CODEC_LZ)
+      {
+         unsigned char content[MAX_FILE_SIZE + TAR_BLOCK];
+         if (ReadFileContent(inode, data, content) != (int)size)
+         {
+            memset(content, 0, size); // keep the stream well formed; the file is reported
+            FsErrorf("Error: Cannot decompress file '%s'.\n", name);
+            failed = 1;
+         }
+         size_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+         memset(content + size, 0, padded - size);
+         fwrite(content, 1, padded, out);
+      }
+      else
+      {
+         // A tar block is a partition block; only the tail of the last one needs zeroing
+         unsigned char block[BLOCK_SIZE];
+         for (int i = 0; i < blockCount; i++)
+         {
+            int blockNum = inode->block_numbers[i];
+            if (i >= MAX_INODE_BLOCK_NUMS || blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS)
+            {
+               memset(block, 0, BLOCK_SIZE);
+               FsErrorf("Error: Invalid block in file '%s'.\n", name);
+               failed = 1;
+            }
+            else
+            {
+               memcpy(block, ReadDataBlock(data, blockNum), BLOCK_SIZE);
+            }
+            if (i == blockCount - 1 && size % BLOCK_SIZE != 0)
+            {
+               memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+            }
+            fwrite(block, 1, BLOCK_SIZE, out);
+         }
+      }
+      (*exported)++;
+   }
+
+   // End of archive: two zero blocks
+   memset(header, 0, TAR_BLOCK);
+   fwrite(header, 1, TAR_BLOCK, out);
+   fwrite(header, 1, TAR_BLOCK, out);
+   if (fflush(out) != 0 || ferror(out))
+   {
+      FsErrorf("Error: Could not write the archive.\n");
+      return -1;
+   }
+   return failed ? -1 : 0;
+}
+
+/**
+ * @brief Creates a file for every regular file in a tar stream read from in, up to
+ *        the end-of-archive marker; in is left just after it (and after any zero
+ *        padding), so commands can follow the archive in the same input.
+ *
+ * Each member's data is streamed through CreateFileFromStream one block at a time,
+ * so nothing larger than a block is held in memory. Members are named after the
+ * last component of their path. Directories and other entry types are skipped, and
+ * so are files that cannot be created (the name is taken, too long, no space); their
+ * data is read past so the rest of the archive still imports.
+ *
+ * @return 0 if every regular file was imported, -1 otherwise or on a malformed stream.
+ */
+int ImportTar(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+              EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, FILE *in, int *imported)
+{
+   unsigned char header[TAR_BLOCK];
+   int failed = 0;
+   int longName = 0; // the last entry was a GNU long name: this entry's own name is truncated
+   *imported = 0;
+   for (;;)
+   {
+      if (fread(header, 1, TAR_BLOCK, in) != TAR_BLOCK)
+      {
+         FsErrorf("Error: The archive ended before its end marker.\n");
+         return -1;
+      }
+      int zero = 1;
+      for (int i = 0; i < TAR_BLOCK && zero; i++)
+      {
+         zero = header[i] == 0;
+      }
+      if (zero)
+      {
+         break;
+      }
+
+      unsigned int sum = 8 * ' ';
+      for (int i = 0; i < TAR_BLOCK; i++)
+      {
+         sum += i >= 148 && i < 156 ? 0 : header[i];
+      }
+      if (sum != ParseTarNumber(header + 148, 8))
+      {
+         FsErrorf("Error: Bad tar header checksum.\n");
+         return -1;
+      }
+
+      // A base-256 size can be far past what a long holds; such members are only skipped
+      unsigned long long size = ParseTarNumber(header + 124, 12);
+      int tooLarge = size > MAX_FILE_SIZE;
+      LENGTH_SOURCE member = {in, tooLarge ? 0 : (long)size};
+      char path[101];
+      memcpy(path, header, 100);
+      path[100] = '\0';
+      char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+      char type = header[156];
+
+      // A long name applies to the entry right after it, whatever that entry is
+      int nameTruncated = longName;
+      longName = type == 'L';
+      if (type != '0' && type != '\0')
+      {
+         // long names, directories, links, pax headers...: nothing to create
+      }
+      else if (nameTruncated || strlen(name) >= FILE_NAME_LENGTH || *name == '\0')
+      {
+         FsErrorf("Skipping '%s': name too long.\n", path);
+         failed = 1;
+      }
+      else if (tooLarge)
+      {
+         FsErrorf("Skipping '%s': larger than the maximum file size of %d bytes.\n", path, MAX_FILE_SIZE);
+         failed = 1;
+      }
+      else if (CreateFileFromStream(directory, inodes, byteMaps, superBlock, data, name,
+                                    ReadLengthPrefixed, &member) != 0)
+      {
+         failed = 1;
+      }
+      else
+      {
+         (*imported)++;
+      }
+
+      // Read past whatever of the member is left, then its padding
+      unsigned char discard[TAR_BLOCK];
+      long got;
+      while ((got = ReadLengthPrefixed(&member, discard, sizeof(discard))) > 0)
+      {
+      }
+      size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+      if (got < 0 || SkipTarBytes(in, tooLarge ? size : 0) != 0 || SkipTarBytes(in, padding) != 0)
+      {
+         FsErrorf("Error: The archive ended inside a member.\n");
+         return -1;
+      }
+   }
+
+   // The second end block and any record padding after it are zero bytes
+   int c;
+   while ((c = getc(in)) == 0)
+   {
+   }
+   if (c != EOF)
+   {
+      ungetc(c, in);
+   }
+   return failed ? -1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// BLOCK ALLOCATION AND DEDUPLICATION
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Number of blocks in this partition, from the superblock. Images written
+ *        before the geometry was honoured fall back to the compiled maximum.
+ */
+int PartitionBlockCount(const EXT_SIMPLE_SUPERBLOCK *superBlock)
+{
+   if (superBlock->total_blocks <= FIRST_DATA_BLOCK || superBlock->total_blocks > MAX_PARTITION_BLOCKS)
+   {
+      return MAX_PARTITION_BLOCKS;
+   }
+   return (int)superBlock->total_blocks;
+}
+
+/**
+ * @brief Number of inodes in this partition, from the superblock (see PartitionBlockCount).
+ */
+int PartitionInodeCount(const EXT_SIMPLE_SUPERBLOCK *superBlock)
+{
+   if (superBlock->total_inodes <= RESERVED_INODES || superBlock->total_inodes > MAX_INODES)
+   {
+      return MAX_INODES;
+   }
+   return (int)superBlock->total_inodes;
+}
+
+/**
+ * @brief Computes the 32-bit FNV-1a fingerprint of a full data block.
+ *
+ * 0 is reserved to mark an empty slot in the fingerprint index, so a hash of 0
+ * is folded to 1.
+ */
+unsigned int HashBlock(const unsigned char *block)
+{
+   unsigned int hash = 2166136261u;
+   for (int i = 0; i < BLOCK_SIZE; i++)
+   {
+      hash ^= block[i];
+      hash *= 16777619u;
+   }
+   return hash != 0 ? hash : 1;
+}
+
+/**
+ * @brief Stores one block of content and returns the block number holding it.
+ *
+ * With FEATURE_DEDUP enabled the fingerprint index is searched first; a block whose
+ * hash and bytes both match is reused by bumping its reference count. Otherwise the
+ * first free data block is allocated and filled.
+ *
+ * @return The block number, or -1 if no free block is available.
+ */
+int StoreDataBlock(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data,
+                   const unsigned char *block)
+{
+   int dedup = (superBlock->feature_flags & FEATURE_DEDUP) != 0;
+   unsigned int hash = 0;
+
+   if (dedup)
+   {
+      hash = HashBlock(block);
+      for (int i = 0; i < MAX_DATA_BLOCKS; i++)
+      {
+         int blockNum = i + FIRST_DATA_BLOCK;
+         if (byteMaps->block_fingerprints[i] == hash &&
+             byteMaps->block_bytemap[blockNum] > 0 &&
+             byteMaps->block_bytemap[blockNum] < MAX_BLOCK_REFS &&
+             memcmp(ReadDataBlock(data, blockNum), block, BLOCK_SIZE) == 0)
+         {
+            byteMaps->block_bytemap[blockNum]++;
+            MarkBlockDirty(superBlock, blockNum);
+            return blockNum;
+         }
+      }
+   }
+
+   for (int blockNum = FIRST_DATA_BLOCK; blockNum < PartitionBlockCount(superBlock); blockNum++)
+   {
+      if (byteMaps->block_bytemap[blockNum] == 0 && !IsBlockPinned(blockNum))
+      {
+         int dataIndex = blockNum - FIRST_DATA_BLOCK;
+         byteMaps->block_bytemap[blockNum] = 1;
+         superBlock->free_blocks--;
+         MarkBlockDirty(superBlock, blockNum);
+         memcpy(WriteDataBlock(data, blockNum), block, BLOCK_SIZE);
+         byteMaps->block_fingerprints[dataIndex] = hash;
+         UpdateDataChecksum(superBlock, data, blockNum);
+         return blockNum;
+      }
+   }
+   return -1;
+}
+
+/**
+ * @brief Counts the data blocks an allocation can take: free, and not pinned by a
+ *        read view (a pinned block stays unused after its file is deleted).
+ */
+int CountAllocatableBlocks(const EXT_SIMPLE_SUPERBLOCK *superBlock, const EXT_BYTE_MAPS *byteMaps)
+{
+   int count = 0;
+   for (int blockNum = FIRST_DATA_BLOCK; blockNum < PartitionBlockCount(superBlock); blockNum++)
+   {
+      count += byteMaps->block_bytemap[blockNum] == 0 && !IsBlockPinned(blockNum);
+   }
+   return count;
+}
+
+/**
+ * @brief Allocates count free data blocks, unshared and without content yet, for data
+ *        written to the image directly. A contiguous run is taken if there is one,
+ *        otherwise the lowest free blocks.
+ * @return 0 with the block numbers in blocks, or -1 (nothing taken) if there are not
+ *         enough free blocks.
+ */
+int AllocateDataBlocks(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, int count,
+                       unsigned short *blocks)
+{
+   int partitionBlocks = PartitionBlockCount(superBlock);
+   int runStart = -1;
+   for (int start = FIRST_DATA_BLOCK, length = 0; start + length < partitionBlocks && runStart == -1;)
+   {
+      if (byteMaps->block_bytemap[start + length] != 0 || IsBlockPinned(start + length))
+      {
+         start += length + 1;
+         length = 0;
+      }
+      else if (++length == count)
+      {
+         runStart = start;
+      }
+   }
+
+   int taken = 0;
+   for (int blockNum = runStart != -1 ? runStart : FIRST_DATA_BLOCK; blockNum < partitionBlocks && taken < count; blockNum++)
+   {
+      if (byteMaps->block_bytemap[blockNum] == 0 && !IsBlockPinned(blockNum))
+      {
+         blocks[taken++] = blockNum;
+      }
+   }
+   if (taken < count)
+   {
+      return -1;
+   }
+
+   for (int i = 0; i < count; i++)
+   {
+      byteMaps->block_bytemap[blocks[i]] = 1;
+      byteMaps->block_fingerprints[blocks[i] - FIRST_DATA_BLOCK] = 0;
+      superBlock->free_blocks--;
+      MarkBlockDirty(superBlock, blocks[i]);
+   }
+   return 0;
+}
+
+/**
+ * @brief Drops one reference to a data block, freeing it when the last one goes.
+ */
+void ReleaseDataBlock(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, int blockNum)
+{
+   if (blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS ||
+       byteMaps->block_bytemap[blockNum] == 0)
+   {
+      return;
+   }
+
+   byteMaps->block_bytemap[blockNum]--;
+   MarkBlockDirty(superBlock, blockNum);
+   if (byteMaps->block_bytemap[blockNum] == 0)
+   {
+      byteMaps->block_fingerprints[blockNum - FIRST_DATA_BLOCK] = 0;
+      superBlock->block_checksums[blockNum] = 0;
+      superBlock->free_blocks++;
+      ClearBlockModified(blockNum); // its bytes are dead; never write them back
+      InvalidateDecompressCache(blockNum);
+      QueueDiscard(superBlock, blockNum);
+   }
+}
+
+/**
+ * @brief Recomputes the fingerprint of every allocated data block. Used when dedup is
+ *        switched on, since the index is not maintained while the feature is off.
+ */
+void RebuildFingerprintIndex(EXT_BYTE_MAPS *byteMaps, EXT_DATA *data)
+{
+   for (int i = 0; i < MAX_DATA_BLOCKS; i++)
+   {
+      if (byteMaps->block_bytemap[i + FIRST_DATA_BLOCK] > 0)
+      {
+         byteMaps->block_fingerprints[i] = HashBlock(ReadDataBlock(data, i + FIRST_DATA_BLOCK));
+      }
+      else
+      {
+         byteMaps->block_fingerprints[i] = 0;
+      }
+   }
+}
+
+/* Strong hash of one allocated block, sorted to bring duplicate candidates together */
+typedef struct
+{
+   unsigned long long hash;
+   int blockNum;
+} BLOCK_HASH;
+
+static int CompareBlockHashes(const void *a, const void *b)
+{
+   const BLOCK_HASH *x = (const BLOCK_HASH *)a;
+   const BLOCK_HASH *y = (const BLOCK_HASH *)b;
+   if (x->hash != y->hash)
+   {
+      return x->hash < y->hash ? -1 : 1;
+   }
+   return x->blockNum - y->blockNum;
+}
+
+/**
+ * @brief Offline deduplication: merges byte-identical data blocks already on disk.
+ *
+ * Every allocated data block is hashed (64-bit FNV-1a) and the hashes are sorted so
+ * candidates end up adjacent. Within a run of equal hashes each block is compared
+ * byte-for-byte against the earlier blocks of the run; a match is merged into the
+ * lowest-numbered copy. Inodes are then rewritten to point at the surviving block,
+ * its reference count absorbs the duplicate's, and the duplicate is returned to the
+ * block bytemap with free_blocks adjusted.
+ *
+ * @param maxMerges Maximum number of blocks to merge in this pass (0 = no limit), so
+ *                  the scan can be run in small steps during a maintenance window.
+ * @param bytesReclaimed Receives the number of bytes freed.
+ * @return The number of blocks merged.
+ */
+int DeduplicateBlocks(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                      EXT_DATA *data, int maxMerges, unsigned int *bytesReclaimed)
+{
+   BLOCK_HASH hashes[MAX_DATA_BLOCKS];
+   unsigned short remap[MAX_PARTITION_BLOCKS];
+   int count = 0;
+   int merges = 0;
+   int budgetReached = 0;
+
+   for (int i = 0; i < MAX_PARTITION_BLOCKS; i++)
+   {
+      remap[i] = (unsigned short)i;
+   }
+
+   // 1. Hash every allocated data block
+   for (int i = 0; i < MAX_DATA_BLOCKS; i++)
+   {
+      if (byteMaps->block_bytemap[i + FIRST_DATA_BLOCK] == 0)
+      {
+         continue;
+      }
+      const unsigned char *block = ReadDataBlock(data, i + FIRST_DATA_BLOCK);
+      unsigned long long hash = 14695981039346656037ull;
+      for (int j = 0; j < BLOCK_SIZE; j++)
+      {
+         hash ^= block[j];
+         hash *= 1099511628211ull;
+      }
+      hashes[count].hash = hash;
+      hashes[count].blockNum = i + FIRST_DATA_BLOCK;
+      count++;
+   }
+   qsort(hashes, count, sizeof(BLOCK_HASH), CompareBlockHashes);
+
+   // 2. Within each run of equal hashes, fold byte-identical blocks into the first copy
+   for (int start = 0; start < count && !budgetReached; )
+   {
+      int end = start + 1;
+      while (end < count && hashes[end].hash == hashes[start].hash)
+      {
+         end++;
+      }
+
+      for (int i = start + 1; i < end; i++)
+      {
+         int dup = hashes[i].blockNum;
+         for (int j = start; j < i; j++)
+         {
+            int keep = hashes[j].blockNum;
+            if (remap[keep] != keep ||
+                byteMaps->block_bytemap[keep] + byteMaps->block_bytemap[dup] > MAX_BLOCK_REFS ||
+                memcmp(ReadDataBlock(data, keep), ReadDataBlock(data, dup), BLOCK_SIZE) != 0)
+            {
+               continue;
+            }
+
+            // Move the references to keep; releasing the last one frees dup like any
+            // other block (checksum, decompress cache and discard included)
+            remap[dup] = (unsigned short)keep;
+            MarkBlockDirty(superBlock, keep);
+            byteMaps->block_bytemap[keep] += byteMaps->block_bytemap[dup];
+            byteMaps->block_bytemap[dup] = 1;
+            ReleaseDataBlock(superBlock, byteMaps, dup);
+            merges++;
+            break;
+         }
+
+         if (maxMerges > 0 && merges >= maxMerges)
+         {
+            budgetReached = 1;
+            break;
+         }
+      }
+      start = end;
+   }
+
+   // 3. Point every inode at the surviving copies
+   if (merges > 0)
+   {
+      for (int i = 0; i < MAX_INODES; i++)
+      {
+         if (byteMaps->inode_bytemap[i] == 0)
+         {
+            continue;
+         }
+         for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+         {
+            unsigned short blockNum = inodes->inodes[i].block_numbers[j];
+            if (blockNum != NULL_BLOCK && blockNum < MAX_PARTITION_BLOCKS)
+            {
+               inodes->inodes[i].block_numbers[j] = remap[blockNum];
+            }
+         }
+      }
+   }
+
+   *bytesReclaimed = (unsigned int)merges * BLOCK_SIZE;
+   FsPrintf("Deduplication: scanned %d blocks, merged %d duplicates, reclaimed %u bytes.\n",
+            count, merges, *bytesReclaimed);
+   if (budgetReached)
+   {
+      FsPrintf("Merge budget reached; run 'dedupe' again to continue.\n");
+   }
+   return merges;
+}
+
+// ---------------------------------------------------------------------------
+// FILE CONTENT AND COMPRESSION
+// ---------------------------------------------------------------------------
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define COMPRESS_MAX_ENTROPY (7 * 256) // bits per byte (x256) above which compression is skipped
+
+/**
+ * @brief Stores a file's content in freshly stored data blocks and fills in the inode's
+ *        block list and codec.
+ *
+ * With FEATURE_COMPRESS enabled, content larger than one block whose estimated entropy
+ * is low enough is LZ-compressed; the compressed stream is kept only if it needs fewer
+ * blocks than the raw content. Every block goes through StoreDataBlock, so dedup still
+ * applies to the stored stream.
+ *
+ * @return 0 on success, -1 if the content is too large or the partition is full (any
+ *         blocks taken are released again).
+ */
+int WriteFileContent(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data,
+                     EXT_SIMPLE_INODE *inode, const unsigned char *content, int size)
+{
+   unsigned char packed[MAX_FILE_SIZE];
+   unsigned char block[BLOCK_SIZE];
+   const unsigned char *stream = content;
+   int streamLength = size;
+
+   inode->codec = INODE_CODEC_RAW;
+   if (size > MAX_FILE_SIZE)
+   {
+      return -1;
+   }
+
+   if ((superBlock->feature_flags & FEATURE_COMPRESS) && size > BLOCK_SIZE &&
+       EstimateEntropy(content, size) <= COMPRESS_MAX_ENTROPY)
+   {
+      int packedLength = LzCompress(content, size, packed, sizeof(packed));
+      if (packedLength > 0 &&
+          (packedLength + BLOCK_SIZE - 1) / BLOCK_SIZE < (size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+      {
+         stream = packed;
+         streamLength = packedLength;
+         inode->codec = INODE_CODEC_LZ;
+      }
+   }
+
+   int offset = 0;
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS && offset < streamLength; i++)
+   {
+      // Zero-pad the last block so identical content always hashes the same
+      int bytesToCopy = (streamLength - offset < BLOCK_SIZE) ? streamLength - offset : BLOCK_SIZE;
+      memset(block, 0, BLOCK_SIZE);
+      memcpy(block, stream + offset, bytesToCopy);
+
+      int blockNum = StoreDataBlock(superBlock, byteMaps, data, block);
+      if (blockNum == -1)
+      {
+         for (int k = 0; k < i; k++)
+         {
+            ReleaseDataBlock(superBlock, byteMaps, inode->block_numbers[k]);
+            inode->block_numbers[k] = NULL_BLOCK;
+         }
+         inode->codec = INODE_CODEC_RAW;
+         return -1;
+      }
+      inode->block_numbers[i] = blockNum;
+      offset += bytesToCopy;
+   }
+   return 0;
+}
+
+/**
+ * @brief Reads a file's logical content into buffer (at least file_size bytes long),
+ *        decompressing it if needed. Decompressed content is served from a small cache
+ *        of recently decoded files.
+ * @return The number of bytes read (file_size), or -1 on an invalid block or stream.
+ */
+int ReadFileContent(EXT_SIMPLE_INODE *inode, EXT_DATA *data, unsigned char *buffer)
+{
+   unsigned char stream[MAX_FILE_SIZE];
+   int streamLength = 0;
+
+   if (inode->file_size > MAX_FILE_SIZE)
+   {
+      return -1;
+   }
+
+   if (inode->codec == INODE_CODEC_LZ)
+   {
+      for (int i = 0; i < DECOMPRESS_CACHE_ENTRIES; i++)
+      {
+         DECOMPRESS_CACHE_ENTRY *entry = &fsRuntime->decompressCache[i];
+         if (entry->valid && entry->fileSize == inode->file_size &&
+             memcmp(entry->blockNumbers, inode->block_numbers, sizeof(entry->blockNumbers)) == 0)
+         {
+            entry->lastUse = ++fsRuntime->decompressCacheClock;
+            memcpy(buffer, entry->content, inode->file_size);
+            return inode->file_size;
+         }
+      }
+   }
+
+   // Gather the stored bytes (the whole stream, or just file_size bytes when raw)
+   unsigned int wanted = inode->codec == INODE_CODEC_LZ ? MAX_FILE_SIZE : inode->file_size;
+   unsigned char *target = inode->codec == INODE_CODEC_LZ ? stream : buffer;
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS && (unsigned int)streamLength < wanted; i++)
+   {
+      int blockNum = inode->block_numbers[i];
+      if (blockNum == NULL_BLOCK)
+      {
+         continue;
+      }
+      if (blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS)
+      {
+         return -1;
+      }
+      int bytesToCopy = (wanted - streamLength < BLOCK_SIZE) ? (int)(wanted - streamLength) : BLOCK_SIZE;
+      ReadAheadFile(inode, i, data);
+      memcpy(target + streamLength, ReadDataBlock(data, blockNum), bytesToCopy);
+      streamLength += bytesToCopy;
+   }
+
+   if (inode->codec != INODE_CODEC_LZ)
+   {
+      return (unsigned int)streamLength == inode->file_size ? streamLength : -1;
+   }
+
+   if (LzDecompress(stream, streamLength, buffer, inode->file_size) != (int)inode->file_size)
+   {
+      return -1;
+   }
+
+   // Keep the result, replacing the least recently used entry
+   DECOMPRESS_CACHE_ENTRY *victim = &fsRuntime->decompressCache[0];
+   for (int i = 0; i < DECOMPRESS_CACHE_ENTRIES; i++)
+   {
+      if (!fsRuntime->decompressCache[i].valid)
+      {
+         victim = &fsRuntime->decompressCache[i];
+         break;
+      }
+      if (fsRuntime->decompressCache[i].lastUse < victim->lastUse)
+      {
+         victim = &fsRuntime->decompressCache[i];
+      }
+   }
+   victim->valid = 1;
+   victim->fileSize = inode->file_size;
+   memcpy(victim->blockNumbers, inode->block_numbers, sizeof(victim->blockNumbers));
+   memcpy(victim->content, buffer, inode->file_size);
+   victim->lastUse = ++fsRuntime->decompressCacheClock;
+   return inode->file_size;
+}
+
+/**
+ * @brief Drops cached decompressed content that was read from blockNum. Called when
+ *        the block is freed, since it may be reused for different content.
+ */
+void InvalidateDecompressCache(int blockNum)
+{
+   for (int i = 0; i < DECOMPRESS_CACHE_ENTRIES; i++)
+   {
+      for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+      {
+         if (fsRuntime->decompressCache[i].valid && fsRuntime->decompressCache[i].blockNumbers[j] == blockNum)
+         {
+            fsRuntime->decompressCache[i].valid = 0;
+         }
+      }
+   }
+}
+
+/* log2(x) in 1/256 units, linearly interpolated between powers of two */
+static unsigned int Log2Fixed(unsigned int x)
+{
+   unsigned int msb = 0;
+   while ((x >> (msb + 1)) != 0)
+   {
+      msb++;
+   }
+   unsigned int fraction = (unsigned int)((((unsigned long long)x << 8) >> msb) & 0xFF);
+   return msb * 256 + fraction;
+}
+
+/**
+ * @brief Estimates the order-0 Shannon entropy of a buffer.
+ * @return Bits per byte, scaled by 256 (so 8 * 256 means incompressible).
+ */
+unsigned int EstimateEntropy(const unsigned char *buffer, int length)
+{
+   unsigned int counts[256] = {0};
+   unsigned long long weighted = 0;
+
+   if (length <= 0)
+   {
+      return 0;
+   }
+   for (int i = 0; i < length; i++)
+   {
+      counts[buffer[i]]++;
+   }
+   for (int i = 0; i < 256; i++)
+   {
+      if (counts[i] > 0)
+      {
+         weighted += (unsigned long long)counts[i] * Log2Fixed(counts[i]);
+      }
+   }
+   // H = log2(n) - sum(c * log2(c)) / n
+   unsigned int entropy = Log2Fixed((unsigned int)length) - (unsigned int)(weighted / (unsigned int)length);
+   return entropy;
+}
+
+static unsigned int LzHash(const unsigned char *p)
+{
+   unsigned int value = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+   return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the 255-run continuation bytes of a long length; returns the new output position or -1 */
+static int LzPutLength(unsigned char *dst, int op, int dstCap, int length)
+{
+   while (length >= 255)
+   {
+      if (op >= dstCap)
+      {
+         return -1;
+      }
+      dst[op++] = 255;
+      length -= 255;
+   }
+   if (op >= dstCap)
+   {
+      return -1;
+   }
+   dst[op++] = (unsigned char)length;
+   return op;
+}
+
+/* Emits one sequence: token, literals and (when matchLength > 0) offset and match length */
+static int LzPutSequence(const unsigned char *literals, int literalLength, int offset, int matchLength,
+                         unsigned char *dst, int op, int dstCap)
+{
+   int literalCode = literalLength < 15 ? literalLength : 15;
+   int matchCode = 0;
+   if (matchLength > 0)
+   {
+      matchCode = (matchLength - LZ_MIN_MATCH) < 15 ? matchLength - LZ_MIN_MATCH : 15;
+   }
+
+   if (op >= dstCap)
+   {
+      return -1;
+   }
+   dst[op++] = (unsigned char)((literalCode << 4) | matchCode);
+   if (literalCode == 15 && (op = LzPutLength(dst, op, dstCap, literalLength - 15)) < 0)
+   {
+      return -1;
+   }
+   if (op + literalLength > dstCap)
+   {
+      return -1;
+   }
+   memcpy(dst + op, literals, literalLength);
+   op += literalLength;
+
+   if (matchLength > 0)
+   {
+      if (op + 2 > dstCap)
+      {
+         return -1;
+      }
+      dst[op++] = (unsigned char)(offset & 0xFF);
+      dst[op++] = (unsigned char)(offset >> 8);
+      if (matchCode == 15 && (op = LzPutLength(dst, op, dstCap, matchLength - LZ_MIN_MATCH - 15)) < 0)
+      {
+         return -1;
+      }
+   }
+   return op;
+}
+
+/**
+ * @brief Compresses src with a small LZ77 codec in the style of LZ4.
+ *
+ * The stream is a series of sequences: a token (literal length in the high nibble,
+ * match length - 4 in the low nibble, 15 meaning "more bytes follow"), the literals,
+ * then a 2-byte little-endian match offset. The final sequence carries literals only;
+ * the decoder knows the output size and stops there.
+ *
+ * @return The compressed length, or -1 if it does not fit in dstCap bytes.
+ */
+int LzCompress(const unsigned char *src, int srcLen, unsigned char *dst, int dstCap)
+{
+   int table[1 << LZ_HASH_BITS];
+   int ip = 0;
+   int anchor = 0;
+   int op = 0;
+
+   for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+   {
+      table[i] = -1;
+   }
+
+   while (ip + LZ_MIN_MATCH <= srcLen)
+   {
+      unsigned int hash = LzHash(src + ip);
+      int ref = table[hash];
+      table[hash] = ip;
+
+      if (ref >= 0 && ip - ref <= LZ_MAX_OFFSET && memcmp(src + ref, src + ip, LZ_MIN_MATCH) == 0)
+      {
+         int matchLength = LZ_MIN_MATCH;
+         while (ip + matchLength < srcLen && src[ref + matchLength] == src[ip + matchLength])
+         {
+            matchLength++;
+         }
+         op = LzPutSequence(src + anchor, ip - anchor, ip - ref, matchLength, dst, op, dstCap);
+         if (op < 0)
+         {
+            return -1;
+         }
+         ip += matchLength;
+         anchor = ip;
+      }
+      else
+      {
+         ip++;
+      }
+   }
+
+   if (anchor < srcLen || op == 0)
+   {
+      op = LzPutSequence(src + anchor, srcLen - anchor, 0, 0, dst, op, dstCap);
+   }
+   return op;
+}
+
+/**
+ * @brief Decompresses an LzCompress stream into exactly dstLen bytes. srcLen may
+ *        include trailing block padding.
+ * @return dstLen on success, -1 if the stream is malformed.
+ */
+int LzDecompress(const unsigned char *src, int srcLen, unsigned char *dst, int dstLen)
+{
+   int ip = 0;
+   int op = 0;
+
+   while (op < dstLen)
+   {
+      int value;
+      if (ip >= srcLen)
+      {
+         return -1;
+      }
+      int token = src[ip++];
+
+      int literalLength = token >> 4;
+      if (literalLength == 15)
+      {
+         do
+         {
+            if (ip >= srcLen)
+            {
+               return -1;
+            }
+            value = src[ip++];
+            literalLength += value;
+         } while (value == 255);
+      }
+      if (ip + literalLength > srcLen || op + literalLength > dstLen)
+      {
+         return -1;
+      }
+      memcpy(dst + op, src + ip, literalLength);
+      ip += literalLength;
+      op += literalLength;
+      if (op == dstLen)
+      {
+         break;
+      }
+
+      if (ip + 2 > srcLen)
+      {
+         return -1;
+      }
+      int offset = src[ip] | (src[ip + 1] << 8);
+      ip += 2;
+      int matchLength = (token & 0x0F) + LZ_MIN_MATCH;
+      if ((token & 0x0F) == 15)
+      {
+         do
+         {
+            if (ip >= srcLen)
+            {
+               return -1;
+            }
+            value = src[ip++];
+            matchLength += value;
+         } while (value == 255);
+      }
+      if (offset == 0 || offset > op || op + matchLength > dstLen)
+      {
+         return -1;
+      }
+      // Byte by byte: the match may overlap the bytes it produces
+      for (int i = 0; i < matchLength; i++)
+      {
+         dst[op] = dst[op - offset];
+         op++;
+      }
+   }
+   return op;
+}
+
+// ---------------------------------------------------------------------------
+// CHECKSUMS AND STATISTICS
+// ---------------------------------------------------------------------------
+
+#define CRC32C_POLY 0x82F63B78u // reflected Castagnoli polynomial
+
+static unsigned int crc32cTable[8][256];
+static int crc32cTableReady = 0;
+
+/* Builds the eight slicing tables: table[k][b] is the CRC of byte b followed by k zero bytes */
+static void BuildCrc32cTables(void)
+{
+   for (unsigned int b = 0; b < 256; b++)
+   {
+      unsigned int crc = b;
+      for (int bit = 0; bit < 8; bit++)
+      {
+         crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      }
+      crc32cTable[0][b] = crc;
+   }
+   for (unsigned int b = 0; b < 256; b++)
+   {
+      for (int k = 1; k < 8; k++)
+      {
+         crc32cTable[k][b] = (crc32cTable[k - 1][b] >> 8) ^ crc32cTable[0][crc32cTable[k - 1][b] & 0xFF];
+      }
+   }
+   crc32cTableReady = 1;
+}
+
+/**
+ * @brief Portable CRC32C using slicing-by-8 (eight table lookups per 8 input bytes).
+ */
+unsigned int Crc32cSoftware(const void *buffer, size_t length)
+{
+   const unsigned char *p = (const unsigned char *)buffer;
+   unsigned int crc = 0xFFFFFFFFu;
+
+   if (!crc32cTableReady)
+   {
+      BuildCrc32cTables();
+   }
+
+   while (length >= 8)
+   {
+      unsigned int low = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+      unsigned int high = p[4] | (p[5] << 8) | (p[6] << 16) | ((unsigned int)p[7] << 24);
+      crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+            crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+            crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+            crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+      p += 8;
+      length -= 8;
+   }
+   while (length-- > 0)
+   {
+      crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *p++) & 0xFF];
+   }
+   return ~crc;
+}
+
+#ifdef HAVE_SSE42_CRC32C
+/* CRC32C with the SSE4.2 crc32 instruction, 8 bytes per step */
+__attribute__((target("sse4.2"))) static unsigned int Crc32cHardware(const void *buffer, size_t length)
+{
+   const unsigned char *p = (const unsigned char *)buffer;
+   unsigned long long crc = 0xFFFFFFFFu;
+
+   while (length >= 8)
+   {
+      unsigned long long chunk;
+      memcpy(&chunk, p, sizeof(chunk));
+      crc = _mm_crc32_u64(crc, chunk);
+      p += 8;
+      length -= 8;
+   }
+   while (length-- > 0)
+   {
+      crc = _mm_crc32_u8((unsigned int)crc, *p++);
+   }
+   return ~(unsigned int)crc;
+}
+#endif
+
+/**
+ * @brief Computes the CRC32C of a buffer, using the SSE4.2 instruction when the CPU
+ *        has it and the slicing-by-8 tables otherwise.
+ */
+unsigned int Crc32c(const void *buffer, size_t length)
+{
+#ifdef HAVE_SSE42_CRC32C
+   if (__builtin_cpu_supports("sse4.2"))
+   {
+      return Crc32cHardware(buffer, length);
+   }
+#endif
+   return Crc32cSoftware(buffer, length);
+}
+
+/**
+ * @brief Names the CRC32C implementation Crc32c() uses on this machine.
+ */
+const char *Crc32cImplementation(void)
+{
+#ifdef HAVE_SSE42_CRC32C
+   if (__builtin_cpu_supports("sse4.2"))
+   {
+      return "sse4.2";
+   }
+#endif
+   return "slicing-by-8";
+}
+
+/**
+ * @brief Returns a wall-clock timestamp in seconds, for the statistics counters.
+ */
+double NowSeconds(void)
+{
+   struct timespec now;
+   timespec_get(&now, TIME_UTC);
+   return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Records the checksum of a data block that was just written in memory.
+ *        Does nothing unless FEATURE_CHECKSUMS is enabled.
+ */
+void UpdateDataChecksum(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, int blockNum)
+{
+   if (!(superBlock->feature_flags & FEATURE_CHECKSUMS) ||
+       blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS)
+   {
+      return;
+   }
+   double start = NowSeconds();
+   superBlock->block_checksums[blockNum] = Crc32c(ReadDataBlock(data, blockNum), BLOCK_SIZE);
+   fsRuntime->stats.updateSeconds += NowSeconds() - start;
+   fsRuntime->stats.checksumsUpdated++;
+}
+
+/* CRC of the superblock as stored, computed with its own checksum slot zeroed */
+static unsigned int SuperBlockChecksum(EXT_SIMPLE_SUPERBLOCK *superBlock)
+{
+   EXT_SIMPLE_SUPERBLOCK copy;
+   memcpy(&copy, superBlock, sizeof(copy));
+   copy.block_checksums[0] = 0;
+   return Crc32c(&copy, sizeof(copy));
+}
+
+/**
+ * @brief Recomputes the checksums of the metadata blocks (byte maps, inodes, directory
+ *        and, last, the superblock itself). Called on every writeback.
+ */
+void UpdateMetadataChecksums(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps,
+                             EXT_INODE_BLOCK *inodeBlock, EXT_DIRECTORY_ENTRY *directory)
+{
+   double start = NowSeconds();
+   superBlock->block_checksums[1] = Crc32c(byteMaps, sizeof(EXT_BYTE_MAPS));
+   superBlock->block_checksums[2] = Crc32c(inodeBlock, sizeof(EXT_INODE_BLOCK));
+   superBlock->block_checksums[3] = Crc32c(directory, sizeof(EXT_DIRECTORY_ENTRY) * MAX_FILES);
+   superBlock->block_checksums[0] = SuperBlockChecksum(superBlock);
+   fsRuntime->stats.updateSeconds += NowSeconds() - start;
+   fsRuntime->stats.checksumsUpdated += FIRST_DATA_BLOCK;
+}
+
+/**
+ * @brief Verifies one data block against its stored checksum.
+ * @return 0 if it matches (or checksums are disabled), -1 on a mismatch.
+ */
+int VerifyDataChecksum(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, int blockNum)
+{
+   if (!(superBlock->feature_flags & FEATURE_CHECKSUMS) ||
+       blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS)
+   {
+      return 0;
+   }
+   double start = NowSeconds();
+   int ok = Crc32c(ReadDataBlock(data, blockNum), BLOCK_SIZE) == superBlock->block_checksums[blockNum];
+   fsRuntime->stats.verifySeconds += NowSeconds() - start;
+   fsRuntime->stats.checksumsVerified++;
+   if (!ok)
+   {
+      fsRuntime->stats.checksumFailures++;
+      return -1;
+   }
+   return 0;
+}
+
+/**
+ * @brief Verifies the metadata blocks and every allocated data block in the given
+ *        dirty-log regions (ALL_REGIONS for all), reporting each mismatch. Run at mount
+ *        when FEATURE_CHECKSUMS is enabled.
+ * @return The number of blocks that failed verification.
+ */
+int VerifyChecksums(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodeBlock,
+                    EXT_DIRECTORY_ENTRY *directory, EXT_DATA *data, unsigned int regions)
+{
+   const char *names[FIRST_DATA_BLOCK] = {"superblock", "byte maps", "inode block", "directory"};
+   unsigned int actual[FIRST_DATA_BLOCK];
+   int failures = 0;
+   int verified = 0;
+
+   double start = NowSeconds();
+   actual[0] = SuperBlockChecksum(superBlock);
+   actual[1] = Crc32c(byteMaps, sizeof(EXT_BYTE_MAPS));
+   actual[2] = Crc32c(inodeBlock, sizeof(EXT_INODE_BLOCK));
+   actual[3] = Crc32c(directory, sizeof(EXT_DIRECTORY_ENTRY) * MAX_FILES);
+   fsRuntime->stats.verifySeconds += NowSeconds() - start;
+   fsRuntime->stats.checksumsVerified += FIRST_DATA_BLOCK;
+
+   for (int i = 0; i < FIRST_DATA_BLOCK; i++)
+   {
+      verified++;
+      if (actual[i] != superBlock->block_checksums[i])
+      {
+         FsErrorf("Error: Checksum mismatch in the %s (block %d).\n", names[i], i);
+         fsRuntime->stats.checksumFailures++;
+         failures++;
+      }
+   }
+
+   for (int blockNum = FIRST_DATA_BLOCK; blockNum < PartitionBlockCount(superBlock); blockNum++)
+   {
+      if (byteMaps->block_bytemap[blockNum] == 0 || !(regions & (1u << (blockNum / DIRTY_REGION_BLOCKS))))
+      {
+         continue;
+      }
+      verified++;
+      if (VerifyDataChecksum(superBlock, data, blockNum) != 0)
+      {
+         FsErrorf("Error: Checksum mismatch in data block %d.\n", blockNum);
+         failures++;
+      }
+   }
+
+   FsPrintf("Checksums verified: %d blocks, %d mismatches.\n", verified, failures);
+   return failures;
+}
+
+/**
+ * @brief Prints the runtime counters, including how much of the command time went
+ *        into computing and verifying checksums.
+ */
+void PrintStats(void)
+{
+   const FS_STATS *stats = &fsRuntime->stats;
+
+   FsPrintf("\nStatistics:\n");
+   FsPrintf("Commands executed: %llu (%.3f ms)\n", stats->commands, stats->commandSeconds * 1e3);
+   FsPrintf("CRC32C implementation: %s\n", Crc32cImplementation());
+   FsPrintf("Checksums computed: %llu blocks (%.3f ms)\n", stats->checksumsUpdated, stats->updateSeconds * 1e3);
+   FsPrintf("Checksums verified: %llu blocks, %llu failures (%.3f ms)\n",
+            stats->checksumsVerified, stats->checksumFailures, stats->verifySeconds * 1e3);
+   if (stats->commandSeconds > 0)
+   {
+      FsPrintf("Checksum overhead: %.2f%% of command time\n",
+               100.0 * (stats->updateSeconds + stats->verifySeconds) / stats->commandSeconds);
+   }
+   FsPrintf("Blocks discarded: %llu\n", stats->blocksDiscarded);
+   FsPrintf("Zero blocks stored as holes: %llu\n", stats->zeroBlocksElided);
+   FsPrintf("Host copies: %llu bytes in the kernel, %llu bytes buffered\n",
+            stats->bytesCopiedInKernel, stats->bytesCopiedBuffered);
+   PrintBlockCacheStats();
+}
+
+// ---------------------------------------------------------------------------
+// CONSISTENCY CHECKING
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Cross-checks the byte maps, inodes, directory and superblock counters.
+ *
+ * Directory entries must point at allocated inodes, each allocated inode must be
+ * reachable from exactly one entry, and each block's count in block_bytemap must
+ * equal the number of block_numbers slots that claim it. Blocks claimed more times
+ * than their count are reported as doubly-claimed, counted blocks nobody claims as
+ * leaked. Finally free_blocks and free_inodes are recomputed from the byte maps.
+ *
+ * Everything is a single pass over the fixed-size tables (at most MAX_INODES inodes
+ * and MAX_PARTITION_BLOCKS blocks).
+ *
+ * @param regions Dirty-log regions whose blocks are cross-checked (ALL_REGIONS for a
+ *                full check). The metadata tables themselves are always checked.
+ * @param repair When non-zero, each problem is fixed as it is found: dangling entries
+ *               are removed, leaked inodes freed, invalid block numbers cleared, blocks
+ *               past a file's size released, a raw file short of blocks cut to the
+ *               ones it has, block counts set to the number of claims and the
+ *               counters rewritten.
+ * @return The number of problems found.
+ */
+int CheckFilesystem(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps,
+                    EXT_INODE_BLOCK *inodeBlock, EXT_DIRECTORY_ENTRY *directory, unsigned int regions, int repair)
+{
+   int problems = 0;
+   int entryForInode[MAX_INODES];
+   unsigned int claims[MAX_PARTITION_BLOCKS];
+   const char *action = repair ? " (repaired)" : "";
+
+   for (int i = 0; i < MAX_INODES; i++)
+   {
+      entryForInode[i] = -1;
+   }
+   memset(claims, 0, sizeof(claims));
+
+   // 1. Metadata blocks and reserved inodes are always allocated
+   for (int blockNum = 0; blockNum < FIRST_DATA_BLOCK; blockNum++)
+   {
+      if (byteMaps->block_bytemap[blockNum] == 0)
+      {
+         FsPrintf("fsck: metadata block %d is marked free%s.\n", blockNum, action);
+         problems++;
+         if (repair)
+         {
+            byteMaps->block_bytemap[blockNum] = 1;
+         }
+      }
+   }
+   for (int i = 0; i < RESERVED_INODES; i++)
+   {
+      if (byteMaps->inode_bytemap[i] == 0)
+      {
+         FsPrintf("fsck: reserved inode %d is marked free%s.\n", i, action);
+         problems++;
+         if (repair)
+         {
+            byteMaps->inode_bytemap[i] = 1;
+         }
+      }
+   }
+
+   // 2. Directory entries must point at distinct, allocated inodes
+   for (int i = 0; i < MAX_FILES; i++)
+   {
+      int inodeIndex = directory[i].inode;
+      if (inodeIndex == NULL_INODE || strcmp(directory[i].file_name, ".") == 0)
+      {
+         continue;
+      }
+
+      const char *reason = NULL;
+      if (inodeIndex < RESERVED_INODES || inodeIndex >= MAX_INODES)
+      {
+         reason = "an invalid inode";
+      }
+      else if (byteMaps->inode_bytemap[inodeIndex] == 0)
+      {
+         reason = "a free inode";
+      }
+      else if (entryForInode[inodeIndex] != -1)
+      {
+         reason = "an inode already used by another entry";
+      }
+
+      if (reason != NULL)
+      {
+         FsPrintf("fsck: entry '%s' points to %s (%d)%s.\n", directory[i].file_name, reason, inodeIndex, action);
+         problems++;
+         if (repair)
+         {
+            directory[i].inode = NULL_INODE;
+            memset(directory[i].file_name, 0, sizeof(directory[i].file_name));
+         }
+         continue;
+      }
+      entryForInode[inodeIndex] = i;
+   }
+
+   // 3. Allocated inodes must be reachable; collect the block claims of those that are
+   for (int i = RESERVED_INODES; i < MAX_INODES; i++)
+   {
+      EXT_SIMPLE_INODE *inode = &inodeBlock->inodes[i];
+      if (byteMaps->inode_bytemap[i] == 0)
+      {
+         continue;
+      }
+      if (entryForInode[i] == -1)
+      {
+         FsPrintf("fsck: inode %d is allocated but not in the directory (leaked)%s.\n", i, action);
+         problems++;
+         if (repair)
+         {
+            byteMaps->inode_bytemap[i] = 0;
+            memset(inode, 0, sizeof(EXT_SIMPLE_INODE));
+            for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+            {
+               inode->block_numbers[j] = NULL_BLOCK;
+            }
+         }
+         continue;
+      }
+
+      const char *name = directory[entryForInode[i]].file_name;
+      int blockCount = 0;
+      for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+      {
+         int blockNum = inode->block_numbers[j];
+         if (blockNum == NULL_BLOCK)
+         {
+            continue;
+         }
+         if (blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS)
+         {
+            FsPrintf("fsck: file '%s' refers to invalid block %d%s.\n", name, blockNum, action);
+            problems++;
+            if (repair)
+            {
+               inode->block_numbers[j] = NULL_BLOCK;
+            }
+            continue;
+         }
+         claims[blockNum]++;
+         blockCount++;
+      }
+
+      // Raw files need exactly enough blocks for their size; compressed ones no more
+      unsigned int needed = (inode->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      if ((inode->codec == INODE_CODEC_LZ) ? (unsigned int)blockCount > needed : (unsigned int)blockCount != needed)
+      {
+         FsPrintf("fsck: file '%s' has %d blocks for %u bytes%s.\n", name, blockCount, inode->file_size, action);
+         problems++;
+         if (repair)
+         {
+            // Keep the blocks in order at the front and release those past the size
+            int kept = 0;
+            for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+            {
+               int blockNum = inode->block_numbers[j];
+               inode->block_numbers[j] = NULL_BLOCK;
+               if (blockNum == NULL_BLOCK)
+               {
+                  continue;
+               }
+               if ((unsigned int)kept < needed)
+               {
+                  inode->block_numbers[kept++] = blockNum;
+               }
+               else
+               {
+                  claims[blockNum]--;
+               }
+            }
+            // A raw file short of blocks ends where its last block does
+            if (inode->codec != INODE_CODEC_LZ && (unsigned int)kept < needed)
+            {
+               inode->file_size = kept * BLOCK_SIZE;
+            }
+         }
+      }
+   }
+
+   // 4. Block counts must match the claims
+   for (int blockNum = FIRST_DATA_BLOCK; blockNum < MAX_PARTITION_BLOCKS; blockNum++)
+   {
+      unsigned int count = byteMaps->block_bytemap[blockNum];
+      if (count == claims[blockNum] || !(regions & (1u << (blockNum / DIRTY_REGION_BLOCKS))))
+      {
+         continue;
+      }
+      if (claims[blockNum] == 0)
+      {
+         FsPrintf("fsck: block %d is marked in use but no file claims it (leaked)%s.\n", blockNum, action);
+      }
+      else if (count == 0)
+      {
+         FsPrintf("fsck: block %d is used by %u file(s) but marked free%s.\n", blockNum, claims[blockNum], action);
+      }
+      else if (claims[blockNum] > count)
+      {
+         FsPrintf("fsck: block %d is claimed %u times but counted %u (doubly-claimed)%s.\n",
+                  blockNum, claims[blockNum], count, action);
+      }
+      else
+      {
+         FsPrintf("fsck: block %d is counted %u times but claimed %u%s.\n", blockNum, count, claims[blockNum], action);
+      }
+      problems++;
+      if (repair)
+      {
+         byteMaps->block_bytemap[blockNum] =
+             (unsigned char)(claims[blockNum] < MAX_BLOCK_REFS ? claims[blockNum] : MAX_BLOCK_REFS);
+      }
+   }
+
+   // 5. Superblock counters must match the byte maps
+   unsigned int freeBlocks = 0;
+   unsigned int freeInodes = 0;
+   for (int blockNum = 0; blockNum < PartitionBlockCount(superBlock); blockNum++)
    {
-      destInode->block_numbers[i] = NULL_BLOCK;
+      if (byteMaps->block_bytemap[blockNum] == 0)
+      {
+         freeBlocks++;
+      }
+   }
+   for (int i = 0; i < PartitionInodeCount(superBlock); i++)
+   {
+      if (byteMaps->inode_bytemap[i] == 0)
+      {
+         freeInodes++;
+      }
+   }
+   if (superBlock->free_blocks != freeBlocks)
+   {
+      FsPrintf("fsck: superblock says %u free blocks, byte map has %u%s.\n", superBlock->free_blocks, freeBlocks, action);
+      problems++;
+      if (repair)
+      {
+         superBlock->free_blocks = freeBlocks;
+      }
+   }
+   if (superBlock->free_inodes != freeInodes)
+   {
+      FsPrintf("fsck: superblock says %u free inodes, byte map has %u%s.\n", superBlock->free_inodes, freeInodes, action);
+      problems++;
+      if (repair)
+      {
+         superBlock->free_inodes = freeInodes;
+      }
+   }
+
+   if (problems > 0)
+   {
+      FsPrintf("fsck: %d problem(s) found%s.\n", problems, repair ? ", repaired" : "");
+   }
+   else
+   {
+      FsStatusf("fsck: 0 problem(s) found.\n"); // a confirmation, left out of batch output
    }
+   return problems;
+}
+
+// ---------------------------------------------------------------------------
+// DEFRAGMENTATION AND FRAGMENTATION ANALYSIS
+// ---------------------------------------------------------------------------
 
-   // Copy data blocks
-   unsigned char buffer[BLOCK_SIZE];
-   for (int i = 0; i < MAX_INODE_BLOCK_NUMS && sourceInode->block_numbers[i] != NULL_BLOCK; i++)
+/**
+ * @brief Exchanges two blocks: their contents, reference counts, fingerprints and
+ *        checksums, and every inode reference to either of them. Either block may be free.
+ */
+static void SwapDataBlocks(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                           EXT_DATA *data, int a, int b)
+{
+   unsigned char block[BLOCK_SIZE];
+   unsigned char *blockA = WriteDataBlock(data, a);
+   unsigned char *blockB = WriteDataBlock(data, b);
+   memcpy(block, blockA, BLOCK_SIZE);
+   memcpy(blockA, blockB, BLOCK_SIZE);
+   memcpy(blockB, block, BLOCK_SIZE);
+
+   unsigned char refs = byteMaps->block_bytemap[a];
+   byteMaps->block_bytemap[a] = byteMaps->block_bytemap[b];
+   byteMaps->block_bytemap[b] = refs;
+
+   unsigned int fingerprint = byteMaps->block_fingerprints[a - FIRST_DATA_BLOCK];
+   byteMaps->block_fingerprints[a - FIRST_DATA_BLOCK] = byteMaps->block_fingerprints[b - FIRST_DATA_BLOCK];
+   byteMaps->block_fingerprints[b - FIRST_DATA_BLOCK] = fingerprint;
+
+   unsigned int checksum = superBlock->block_checksums[a];
+   superBlock->block_checksums[a] = superBlock->block_checksums[b];
+   superBlock->block_checksums[b] = checksum;
+
+   for (int i = 0; i < MAX_INODES; i++)
    {
-      // Find a free block
-      int destBlockNum = -1;
-      for (int j = FIRST_DATA_BLOCK; j < MAX_PARTITION_BLOCKS; j++)
+      if (byteMaps->inode_bytemap[i] == 0)
+      {
+         continue;
+      }
+      for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
       {
-         if (byteMaps->block_bytemap[j] == 0)
+         unsigned short *blockNum = &inodes->inodes[i].block_numbers[j];
+         if (*blockNum == a)
          {
-            destBlockNum = j;
-            break;
+            *blockNum = (unsigned short)b;
+         }
+         else if (*blockNum == b)
+         {
+            *blockNum = (unsigned short)a;
          }
       }
-      if (destBlockNum == -1)
+   }
+
+   InvalidateDecompressCache(a);
+   InvalidateDecompressCache(b);
+   HoldBlockUntilSave(a);
+   HoldBlockUntilSave(b);
+   MarkBlockDirty(superBlock, a);
+   MarkBlockDirty(superBlock, b);
+   // The block that ends up free still holds the other one's old data
+   QueueDiscard(superBlock, byteMaps->block_bytemap[a] == 0 ? a : b);
+}
+
+/**
+ * @brief Online defragmentation: lays the files out as contiguous runs, in directory
+ *        order, from the first data block up, leaving the free space at the end.
+ *
+ * A block that is not yet where it belongs is swapped with whatever occupies its
+ * target (a free block or another file's block), and all inodes are updated in
+ * the same step, so the in-memory metadata is consistent after every move. A block
+ * shared by several files (dedup) is placed once, with the first file that uses it.
+ *
+ * @param maxMoves Maximum number of block moves in this pass (0 = no limit). Blocks
+ *                 already in place are not moved again, so repeated passes continue
+ *                 where the previous one stopped.
+ * @return The number of blocks moved.
+ */
+int DefragmentFilesystem(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                         EXT_DIRECTORY_ENTRY *directory, EXT_DATA *data, int maxMoves)
+{
+   unsigned char placed[MAX_PARTITION_BLOCKS];
+   int target = FIRST_DATA_BLOCK;
+   int moves = 0;
+   int budgetReached = 0;
+
+   memset(placed, 0, sizeof(placed));
+   for (int i = 0; i < MAX_FILES && !budgetReached; i++)
+   {
+      unsigned short inodeIndex = directory[i].inode;
+      if (inodeIndex == NULL_INODE || inodeIndex >= MAX_INODES)
       {
-         fprintf(stderr, "No free blocks available to copy data.\n");
-         // rollback the inode
-         byteMaps->inode_bytemap[destInodeIndex] = 0;
-         superBlock->free_inodes++;
-         memset(destInode, 0, sizeof(EXT_SIMPLE_INODE));
-         return -1;
+         continue;
       }
 
-      byteMaps->block_bytemap[destBlockNum] = 1;
-      superBlock->free_blocks--;
-      destInode->block_numbers[i] = destBlockNum;
-
-      // Calculate the source data index
-      int dataIndex = sourceInode->block_numbers[i] - FIRST_DATA_BLOCK;
-      if (dataIndex < 0 || dataIndex >= MAX_DATA_BLOCKS)
+      EXT_SIMPLE_INODE *inode = &inodes->inodes[inodeIndex];
+      for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
       {
-         fprintf(stderr, "Invalid data index %d for block %d.\n", dataIndex, sourceInode->block_numbers[i]);
-         // rollback
-         for (int k = 0; k < i; k++)
+         unsigned short blockNum = inode->block_numbers[j];
+         if (blockNum == NULL_BLOCK || blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS ||
+             placed[blockNum])
          {
-            if (destInode->block_numbers[k] != NULL_BLOCK)
+            continue;
+         }
+         if (blockNum != target)
+         {
+            if (maxMoves > 0 && moves >= maxMoves)
             {
-               byteMaps->block_bytemap[destInode->block_numbers[k]] = 0;
-               superBlock->free_blocks++;
-               destInode->block_numbers[k] = NULL_BLOCK;
+               budgetReached = 1;
+               break;
             }
+            SwapDataBlocks(superBlock, byteMaps, inodes, data, blockNum, target);
+            moves++;
          }
-         byteMaps->inode_bytemap[destInodeIndex] = 0;
-         superBlock->free_inodes++;
-         memset(destInode, 0, sizeof(EXT_SIMPLE_INODE));
-         return -1;
+         placed[target] = 1;
+         target++;
       }
+   }
+
+   FsPrintf("Defragmentation: moved %d blocks", moves);
+   if (budgetReached)
+   {
+      FsPrintf("; move budget reached, run 'defrag' again to continue.\n");
+   }
+   else
+   {
+      FsPrintf(", %d blocks in use, free space starts at block %d.\n", target - FIRST_DATA_BLOCK, target);
+   }
+   return moves;
+}
+
+/* Sets the image file to blocks blocks */
+static int TruncateImage(FILE *file, int blocks)
+{
+   fflush(file);
+   if (ftruncate(fileno(file), (off_t)blocks * BLOCK_SIZE) != 0)
+   {
+      FsPerror("Error resizing partition");
+      return -1;
+   }
+   return 0;
+}
+
+/**
+ * @brief Grows or shrinks the open partition to newBlocks blocks (metadata included).
+ *
+ * Growing extends the backing file and hands the new blocks to the allocator.
+ * Shrinking first swaps every block in use in the truncated tail into a free block
+ * below the new end (updating all inodes, as defrag does), saves everything, then
+ * cuts the file. The caller saves the new size afterwards.
+ *
+ * @return 0 on success, -1 if the size is out of range, the blocks in the tail do
+ *         not fit in the free space that remains, or the image file cannot be resized
+ *         (the partition keeps its size).
+ */
+int ResizeFilesystem(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                     EXT_DIRECTORY_ENTRY *directory, EXT_DATA *data, int newBlocks, FILE *file)
+{
+   int oldBlocks = PartitionBlockCount(superBlock);
 
-      // Copy from in-memory data array
-      memcpy(buffer, data[dataIndex].data, BLOCK_SIZE);
+   if (newBlocks <= FIRST_DATA_BLOCK || newBlocks > MAX_PARTITION_BLOCKS)
+   {
+      FsErrorf("Error: Size must be between %d and %d blocks.\n", FIRST_DATA_BLOCK + 1, MAX_PARTITION_BLOCKS);
+      return -1;
+   }
 
-      // Write the copied data to the new block in "particion.bin"
-      long destOffset = destBlockNum * BLOCK_SIZE;
-      if (fseek(file, destOffset, SEEK_SET) != 0)
+   if (newBlocks < oldBlocks)
+   {
+      // 1. The blocks in use in the tail must fit in the free blocks that stay
+      int tailUsed = 0;
+      int headFree = 0;
+      for (int blockNum = FIRST_DATA_BLOCK; blockNum < oldBlocks; blockNum++)
+      {
+         if (blockNum >= newBlocks && byteMaps->block_bytemap[blockNum] != 0)
+         {
+            tailUsed++;
+         }
+         else if (blockNum < newBlocks && byteMaps->block_bytemap[blockNum] == 0)
+         {
+            headFree++;
+         }
+      }
+      if (tailUsed > headFree)
       {
-         fprintf(stderr, "Error seeking to destination block %d.\n", destBlockNum);
+         FsErrorf("Error: %d blocks in use beyond block %d but only %d free blocks before it.\n",
+                  tailUsed, newBlocks - 1, headFree);
          return -1;
       }
 
-      size_t bytesWritten = fwrite(buffer, 1, BLOCK_SIZE, file);
-      if (bytesWritten != BLOCK_SIZE)
+      // 2. Move them down into the lowest free blocks
+      int freeBlock = FIRST_DATA_BLOCK;
+      for (int blockNum = newBlocks; blockNum < oldBlocks; blockNum++)
       {
-         fprintf(stderr, "Error writing to destination block %d.\n", destBlockNum);
-         return -1;
+         if (byteMaps->block_bytemap[blockNum] == 0)
+         {
+            continue;
+         }
+         while (byteMaps->block_bytemap[freeBlock] != 0)
+         {
+            freeBlock++;
+         }
+         SwapDataBlocks(superBlock, byteMaps, inodes, data, blockNum, freeBlock);
       }
 
-      // Update the 'data' array in memory
-      memcpy(data[destBlockNum - FIRST_DATA_BLOCK].data, buffer, BLOCK_SIZE);
-   }
+      // 3. Save the moved blocks with the inodes that now point at them, so cutting the
+      // file cannot take data that the image still refers to
+      SaveAllChanges(directory, inodes, byteMaps, superBlock, data, file);
 
-   // Find a free directory entry
-   int destDirIndex = -1;
-   for (int i = 0; i < MAX_FILES; i++)
-   {
-      if (directory[i].inode == NULL_INODE)
+      // 4. The image shrinks before the tail is forgotten, so a failure changes nothing
+      // but where the moved blocks live
+      if (TruncateImage(file, newBlocks) != 0)
       {
-         destDirIndex = i;
-         break;
+         return -1;
+      }
+      for (int blockNum = newBlocks; blockNum < oldBlocks; blockNum++)
+      {
+         byteMaps->block_fingerprints[blockNum - FIRST_DATA_BLOCK] = 0;
+         superBlock->block_checksums[blockNum] = 0;
       }
+      superBlock->free_blocks -= oldBlocks - newBlocks;
    }
-   if (destDirIndex == -1)
+   else
    {
-      fprintf(stderr, "No free directory entries available.\n");
-      // rollback inode and blocks
-      for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+      if (TruncateImage(file, newBlocks) != 0)
       {
-         if (destInode->block_numbers[i] != NULL_BLOCK)
-         {
-            byteMaps->block_bytemap[destInode->block_numbers[i]] = 0;
-            superBlock->free_blocks++;
-            destInode->block_numbers[i] = NULL_BLOCK;
-         }
+         return -1;
       }
-      byteMaps->inode_bytemap[destInodeIndex] = 0;
-      superBlock->free_inodes++;
-      memset(destInode, 0, sizeof(EXT_SIMPLE_INODE));
-      return -1;
+      // New blocks start out free and zeroed
+      for (int blockNum = oldBlocks; blockNum < newBlocks; blockNum++)
+      {
+         memset(ReadDataBlock(data, blockNum), 0, BLOCK_SIZE);
+      }
+      superBlock->free_blocks += newBlocks - oldBlocks;
    }
 
-   // Create the directory entry
-   strncpy(directory[destDirIndex].file_name, destName, FILE_NAME_LENGTH - 1);
-   directory[destDirIndex].file_name[FILE_NAME_LENGTH - 1] = '\0';
-   directory[destDirIndex].inode = destInodeIndex;
-
-   printf("File '%s' copied to '%s' successfully.\n", sourceName, destName);
+   superBlock->total_blocks = newBlocks;
+   FsPrintf("Partition resized from %d to %d blocks, %u free.\n", oldBlocks, newBlocks, superBlock->free_blocks);
    return 0;
 }
 
 /**
- * @brief Creates a new file with the specified name and content, allocating
- *        an inode and the required data blocks.
-
+ * @brief Counts the contiguous runs in a file's block list (1 for an unfragmented file,
+ *        0 for an empty one).
  */
-int CreateFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
-               EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
-               char *fileName, char *content)
+int CountFileExtents(EXT_SIMPLE_INODE *inode)
 {
-   // Check if file already exists
-   if (FindFile(directory, inodes, fileName) != -1)
+   int extents = 0;
+   int previous = -2;
+   for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
    {
-      fprintf(stderr, "Error: File '%s' already exists.\n", fileName);
-      return -1;
+      unsigned short blockNum = inode->block_numbers[j];
+      if (blockNum == NULL_BLOCK || blockNum >= MAX_PARTITION_BLOCKS)
+      {
+         continue;
+      }
+      if (blockNum != previous + 1)
+      {
+         extents++;
+      }
+      previous = blockNum;
    }
+   return extents;
+}
 
-   // Locate a free inode
-   int inodeIndex = -1;
-   for (int i = 0; i < MAX_INODES; i++)
+/* Non-zero if any byte of word is zero */
+#define WORD_HAS_ZERO_BYTE(word) \
+   (((word) - 0x0101010101010101ull) & ~(word) & 0x8080808080808080ull)
+
+/**
+ * @brief Returns the end of the run of blocks starting at start that share its
+ *        occupancy (all free or all in use). Eight bytemap entries are tested at a
+ *        time while the run continues, falling back to single bytes at its edge.
+ */
+static int ScanOccupancyRun(const unsigned char *bytemap, int start, int end)
+{
+   int used = bytemap[start] != 0;
+   int i = start + 1;
+   while (i < end)
    {
-      if (byteMaps->inode_bytemap[i] == 0)
+      if (i + 8 <= end)
+      {
+         unsigned long long word;
+         memcpy(&word, bytemap + i, sizeof(word));
+         if (used ? !WORD_HAS_ZERO_BYTE(word) : word == 0)
+         {
+            i += 8;
+            continue;
+         }
+      }
+      if ((bytemap[i] != 0) != used)
       {
-         inodeIndex = i;
          break;
       }
+      i++;
    }
-   if (inodeIndex == -1)
-   {
-      fprintf(stderr, "Error: No free inodes available.\n");
-      return -1;
-   }
+   return i;
+}
 
-   // Mark inode as used
-   byteMaps->inode_bytemap[inodeIndex] = 1;
-   superBlock->free_inodes--;
+/**
+ * @brief Summarises the layout of the whole device in one pass over the block
+ *        bytemap (free runs, histogram and occupancy map) and one over the files.
+ */
+void CollectFragStats(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                      EXT_DIRECTORY_ENTRY *directory, FRAG_STATS *stats)
+{
+   int totalBlocks = PartitionBlockCount(superBlock);
 
-   // Initialize the inode
-   EXT_SIMPLE_INODE *inode = &inodes->inodes[inodeIndex];
-   inode->file_size = strlen(content);
-   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   memset(stats, 0, sizeof(*stats));
+   stats->firstRunUsed = byteMaps->block_bytemap[0] != 0;
+   for (int start = 0; start < totalBlocks; )
    {
-      inode->block_numbers[i] = NULL_BLOCK;
+      int end = ScanOccupancyRun(byteMaps->block_bytemap, start, totalBlocks);
+      int length = end - start;
+      stats->runLengths[stats->runCount++] = (unsigned short)length;
+      if (byteMaps->block_bytemap[start] == 0)
+      {
+         int bucket = 0;
+         while (bucket < FRAG_HISTOGRAM_BUCKETS - 1 && (length >> (bucket + 1)) != 0)
+         {
+            bucket++;
+         }
+         stats->freeRunHistogram[bucket]++;
+         stats->freeBlocks += length;
+         stats->freeExtents++;
+         if (length > stats->largestFreeRun)
+         {
+            stats->largestFreeRun = length;
+         }
+      }
+      start = end;
    }
 
-   int bytesRemaining = inode->file_size;
-   int contentOffset = 0;
-
-   // Assign data blocks for this new file
-   for (int i = 0; i < MAX_INODE_BLOCK_NUMS && bytesRemaining > 0; i++)
+   for (int i = 0; i < MAX_FILES; i++)
    {
-      // Find free block
-      int blockNum = -1;
-      for (int j = FIRST_DATA_BLOCK; j < MAX_PARTITION_BLOCKS; j++)
+      unsigned short inodeIndex = directory[i].inode;
+      if (inodeIndex == NULL_INODE || inodeIndex >= MAX_INODES)
       {
-         if (byteMaps->block_bytemap[j] == 0)
-         {
-            blockNum = j;
-            break;
-         }
+         continue;
       }
-      if (blockNum == -1)
+      int extents = CountFileExtents(&inodes->inodes[inodeIndex]);
+      if (extents == 0)
       {
-         fprintf(stderr, "Error: No free blocks available to create file.\n");
-         return -1;
+         continue;
       }
+      for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+      {
+         if (inodes->inodes[inodeIndex].block_numbers[j] < MAX_PARTITION_BLOCKS)
+         {
+            stats->fileBlocks++;
+         }
+      }
+      stats->files++;
+      stats->fileExtents += extents;
+   }
+}
 
-      // Mark block as used
-      byteMaps->block_bytemap[blockNum] = 1;
-      superBlock->free_blocks--;
-
-      // Assign block to inode
-      inode->block_numbers[i] = blockNum;
+/**
+ * @brief Prints the fragmentation report: free-extent histogram, largest free run,
+ *        per-file extents and a run-length encoded occupancy map (U = used, F = free).
+ */
+void PrintFragStats(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                    EXT_DIRECTORY_ENTRY *directory)
+{
+   FRAG_STATS stats;
+   CollectFragStats(superBlock, byteMaps, inodes, directory, &stats);
 
-      // Copy content into this block
-      int dataIndex = blockNum - FIRST_DATA_BLOCK;
-      int bytesToCopy = (bytesRemaining < BLOCK_SIZE) ? bytesRemaining : BLOCK_SIZE;
-      memcpy(data[dataIndex].data, content + contentOffset, bytesToCopy);
-      contentOffset += bytesToCopy;
-      bytesRemaining -= bytesToCopy;
+   FsPrintf("\nFragmentation Report:\n");
+   FsPrintf("Free blocks: %d in %d extents, largest free run: %d blocks\n",
+            stats.freeBlocks, stats.freeExtents, stats.largestFreeRun);
+   FsPrintf("Free extent sizes:\n");
+   for (int bucket = 0; bucket < FRAG_HISTOGRAM_BUCKETS; bucket++)
+   {
+      FsPrintf("  %3d-%-3d blocks: %d\n", 1 << bucket, (1 << (bucket + 1)) - 1, stats.freeRunHistogram[bucket]);
    }
 
-   // Create a directory entry
+   FsPrintf("Files:\n");
    for (int i = 0; i < MAX_FILES; i++)
    {
-      if (directory[i].inode == NULL_INODE)
+      unsigned short inodeIndex = directory[i].inode;
+      if (inodeIndex == NULL_INODE || inodeIndex >= MAX_INODES)
+      {
+         continue;
+      }
+      int extents = CountFileExtents(&inodes->inodes[inodeIndex]);
+      if (extents > 0)
       {
-         strncpy(directory[i].file_name, fileName, FILE_NAME_LENGTH - 1);
-         directory[i].file_name[FILE_NAME_LENGTH - 1] = '\0';
-         directory[i].inode = inodeIndex;
-         printf("File '%s' created successfully.\n", fileName);
-         return 0;
+         FsPrintf("  %-20s extents: %d\n", directory[i].file_name, extents);
       }
    }
+   if (stats.fileExtents > 0)
+   {
+      FsPrintf("Average fragment length: %.2f blocks over %d files\n",
+               (double)stats.fileBlocks / stats.fileExtents, stats.files);
+   }
 
-   fprintf(stderr, "Error: No free directory entries available.\n");
-   return -1;
+   FsPrintf("Occupancy map:");
+   for (int r = 0; r < stats.runCount; r++)
+   {
+      int used = (r % 2 == 0) ? stats.firstRunUsed : !stats.firstRunUsed;
+      FsPrintf(" %c%d", used ? 'U' : 'F', stats.runLengths[r]);
+   }
+   FsPrintf("\n");
 }
 
 // ---------------------------------------------------------------------------
 // DEBUG AND UTILITY FUNCTIONS
 // ---------------------------------------------------------------------------
 
+/* Runtime used until a caller selects another one (the REPL and the standalone tools) */
+static FS_RUNTIME defaultRuntime = {.readaheadCap = MAX_INODE_BLOCK_NUMS};
+
+FS_RUNTIME *fsRuntime = &defaultRuntime;
+
+/**
+ * @brief Clears a runtime for a new mount: no counters, nothing cached, no cache budget,
+ *        messages enabled.
+ */
+void InitRuntime(FS_RUNTIME *runtime)
+{
+   memset(runtime, 0, sizeof(*runtime));
+   runtime->readaheadCap = MAX_INODE_BLOCK_NUMS;
+}
+
+/**
+ * @brief Makes runtime the one the core functions work on; NULL selects the default
+ *        runtime again. Each mounted image needs its own runtime, selected before any
+ *        call on it.
+ */
+void SelectRuntime(FS_RUNTIME *runtime)
+{
+   fsRuntime = runtime != NULL ? runtime : &defaultRuntime;
+}
+
+/**
+ * @brief printf for the core's messages, silent when the current runtime is quiet.
+ */
+int FsPrintf(const char *format, ...)
+{
+   if (fsRuntime->quiet)
+   {
+      return 0;
+   }
+   va_list args;
+   va_start(args, format);
+   int written = vprintf(format, args);
+   va_end(args);
+   return written;
+}
+
+/**
+ * @brief Like FsPrintf, for error messages on stderr.
+ */
+int FsErrorf(const char *format, ...)
+{
+   if (fsRuntime->quiet)
+   {
+      return 0;
+   }
+   va_list args;
+   va_start(args, format);
+   int written = vfprintf(stderr, format, args);
+   va_end(args);
+   return written;
+}
+
+/**
+ * @brief Like FsPrintf, for confirmations that a command did what was asked. Batch
+ *        mode leaves them out.
+ */
+int FsStatusf(const char *format, ...)
+{
+   if (fsRuntime->quiet || fsRuntime->terse)
+   {
+      return 0;
+   }
+   va_list args;
+   va_start(args, format);
+   int written = vprintf(format, args);
+   va_end(args);
+   return written;
+}
+
+/**
+ * @brief perror, silent when the current runtime is quiet.
+ */
+void FsPerror(const char *message)
+{
+   if (!fsRuntime->quiet)
+   {
+      perror(message);
+   }
+}
+
 /**
  * @brief Finds a file by name and returns its index in the directory, or -1 if not found.
  */
@@ -907,22 +5599,22 @@ int FindFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, char *name
  */
 void DebugListAllDirectoryEntries(EXT_DIRECTORY_ENTRY *directory)
 {
-   printf("Debug: Listing all directory entries:\n");
-   printf("-------------------------------------------------\n");
+   FsPrintf("Debug: Listing all directory entries:\n");
+   FsPrintf("-------------------------------------------------\n");
    for (int i = 0; i < MAX_FILES; i++)
    {
-      printf("Entry %d: ", i);
+      FsPrintf("Entry %d: ", i);
       if (directory[i].inode != NULL_INODE && strlen(directory[i].file_name) > 0)
       {
-         printf("Occupied - File Name: %s, Inode: %u\n",
-                directory[i].file_name, directory[i].inode);
+         FsPrintf("Occupied - File Name: %s, Inode: %u\n",
+                  directory[i].file_name, directory[i].inode);
       }
       else
       {
-         printf("Free\n");
+         FsPrintf("Free\n");
       }
    }
-   printf("-------------------------------------------------\n");
+   FsPrintf("-------------------------------------------------\n");
 }
 
 /**
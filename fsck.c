@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+#include "headers.h"
+
+// Exit codes follow the usual fsck convention
+#define FSCK_OK 0
+#define FSCK_ERRORS_CORRECTED 1
+#define FSCK_ERRORS_UNCORRECTED 4
+#define FSCK_USAGE 16
+
+/**
+ * @brief Standalone consistency checker for a partition image.
+ *
+ * Usage: fsck [-r] [image]   (default image: particion.bin)
+ *   -r  repair the problems found and write the fixed metadata back.
+ */
+int main(int argc, char *argv[])
+{
+   const char *path = "particion.bin";
+   int repair = 0;
+
+   EXT_SIMPLE_SUPERBLOCK superBlock;
+   EXT_BYTE_MAPS byteMaps;
+   EXT_INODE_BLOCK inodeBlock;
+   EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+   EXT_DATA data[MAX_DATA_BLOCKS];
+
+   for (int i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "-r") == 0)
+      {
+         repair = 1;
+      }
+      else if (argv[i][0] == '-')
+      {
+         fprintf(stderr, "Usage: %s [-r] [image]\n", argv[0]);
+         return FSCK_USAGE;
+      }
+      else
+      {
+         path = argv[i];
+      }
+   }
+
+   FILE *file = fopen(path, repair ? "r+b" : "rb");
+   if (file == NULL)
+   {
+      perror(path);
+      return FSCK_USAGE;
+   }
+
+   if (LoadFilesystem(file, &superBlock, &byteMaps, &inodeBlock, directory, data) != 0)
+   {
+      fprintf(stderr, "Error reading partition %s\n", path);
+      fclose(file);
+      return FSCK_ERRORS_UNCORRECTED;
+   }
+
+   int problems = CheckFilesystem(&superBlock, &byteMaps, &inodeBlock, directory, ALL_REGIONS, repair);
+   if (repair)
+   {
+      // A fully checked and repaired image is a clean point: the next mount can skip validation
+      superBlock.fs_state = FS_STATE_CLEAN;
+      superBlock.dirty_regions = 0;
+      SaveAllChanges(directory, &inodeBlock, &byteMaps, &superBlock, data, file);
+   }
+   fclose(file);
+
+   if (problems == 0)
+   {
+      return FSCK_OK;
+   }
+   return repair ? FSCK_ERRORS_CORRECTED : FSCK_ERRORS_UNCORRECTED;
+}
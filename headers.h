@@ -3,11 +3,31 @@
 #define MAX_FILES 20
 #define MAX_DATA_BLOCKS 96
 #define FIRST_DATA_BLOCK 4
+#define RESERVED_INODES 3 // inodes 0 and 1 reserved, inode 2 is the root directory
 #define MAX_PARTITION_BLOCKS (MAX_DATA_BLOCKS + FIRST_DATA_BLOCK) // superblock + inode and block bytemaps + inodes + directory
 #define MAX_INODE_BLOCK_NUMS 7
 #define FILE_NAME_LENGTH 17
 #define NULL_INODE 0xFFFF
 #define NULL_BLOCK 0xFFFF
+#define MAX_FILE_SIZE (MAX_INODE_BLOCK_NUMS * BLOCK_SIZE)
+#define MAX_BLOCK_REFS 255 // block_bytemap entries are reference counts (0 = free)
+
+/* Optional features, stored in the superblock's feature_flags */
+#define FEATURE_DEDUP 0x01    // content-addressed block deduplication on write
+#define FEATURE_COMPRESS 0x02 // compress new files on create/copy
+#define FEATURE_CHECKSUMS 0x04 // CRC32C per block, verified on read and at mount
+#define FEATURE_DISCARD 0x08   // release freed blocks to the host (hole punching)
+
+/* Mount state recorded in the superblock (0 = written by a version that did not record it) */
+#define FS_STATE_CLEAN 1 // last session ended with a clean unmount
+#define FS_STATE_DIRTY 2 // mounted, or the last session crashed
+#define DIRTY_REGION_BLOCKS 4 // blocks per bit of the dirty-region log; region 0 is the metadata
+#define ALL_REGIONS 0xFFFFFFFFu
+
+/* Inode codec ids. Older images hold 0xFFFF in this slot, so only an exact
+   INODE_CODEC_LZ means the file's blocks hold a compressed stream. */
+#define INODE_CODEC_RAW 0x0000
+#define INODE_CODEC_LZ 0x5A4C // "LZ"
 
 /* Superblock structure */
 typedef struct
@@ -18,22 +38,30 @@ typedef struct
   unsigned int free_inodes;                                     /* free inodes */
   unsigned int first_data_block;                                /* first data block */
   unsigned int block_size;                                      /* block size in bytes */
-  unsigned char padding[BLOCK_SIZE - 6 * sizeof(unsigned int)]; /* padding with 0's */
+  unsigned int feature_flags;                                   /* enabled optional features (FEATURE_*) */
+  unsigned int block_checksums[MAX_PARTITION_BLOCKS];           /* CRC32C per block (FEATURE_CHECKSUMS); entry 0 covers
+                                                                   this superblock computed with the entry itself zeroed */
+  unsigned int fs_state;                                        /* FS_STATE_CLEAN or FS_STATE_DIRTY */
+  unsigned int dirty_regions;                                   /* bit r: blocks [r * DIRTY_REGION_BLOCKS, +DIRTY_REGION_BLOCKS)
+                                                                   changed since the last clean point */
+  unsigned char padding[BLOCK_SIZE - (9 + MAX_PARTITION_BLOCKS) * sizeof(unsigned int)]; /* padding with 0's */
 } EXT_SIMPLE_SUPERBLOCK;
 
 /* Bytemaps, fit in one block */
 typedef struct
 {
-  unsigned char block_bytemap[MAX_PARTITION_BLOCKS];
+  unsigned char block_bytemap[MAX_PARTITION_BLOCKS]; /* references per block, 0 = free */
   unsigned char inode_bytemap[MAX_INODES]; /* inodes 0 and 1 reserved, inode 2 directory */
-  unsigned char padding[BLOCK_SIZE - (MAX_PARTITION_BLOCKS + MAX_INODES) * sizeof(char)];
+  unsigned int block_fingerprints[MAX_DATA_BLOCKS]; /* dedup index: content hash per data block, 0 = none */
+  unsigned char padding[BLOCK_SIZE - (MAX_PARTITION_BLOCKS + MAX_INODES) * sizeof(char) - MAX_DATA_BLOCKS * sizeof(unsigned int)];
 } EXT_BYTE_MAPS;
 
 /* Inode */
 typedef struct
 {
-  unsigned int file_size;
+  unsigned int file_size;                                 /* logical (uncompressed) size */
   unsigned short int block_numbers[MAX_INODE_BLOCK_NUMS];
+  unsigned short int codec;                               /* INODE_CODEC_* */
 } EXT_SIMPLE_INODE;
 
 /* List of inodes, fit in one block */
@@ -56,47 +84,264 @@ typedef struct
   unsigned char data[BLOCK_SIZE];
 } EXT_DATA;
 
+/* Runtime counters reported by the 'stats' command */
+typedef struct
+{
+  unsigned long long commands;         /* commands executed */
+  double commandSeconds;               /* time spent executing them */
+  unsigned long long checksumsUpdated; /* blocks whose CRC32C was computed for writeback */
+  double updateSeconds;
+  unsigned long long checksumsVerified; /* blocks verified on read or at mount */
+  unsigned long long checksumFailures;
+  double verifySeconds;
+  unsigned long long blocksDiscarded;  /* freed blocks released to the host */
+  unsigned long long zeroBlocksElided; /* all-zero blocks punched instead of written */
+  unsigned long long cacheHits;        /* data block accesses served from memory */
+  unsigned long long cacheMisses;      /* data blocks read from the image on access */
+  unsigned long long cacheEvictions;
+  unsigned long long cacheWritebacks;  /* modified blocks written back on eviction */
+  unsigned long long blocksPrefetched; /* read ahead of use after a lazy mount */
+  unsigned long long readaheadBlocks;  /* read ahead of sequential file reads */
+  unsigned long long readaheadUsed;
+  unsigned long long readaheadWasted;  /* evicted before being used */
+  unsigned long long bytesCopiedInKernel; /* import/export bytes moved by copy_file_range */
+  unsigned long long bytesCopiedBuffered; /* import/export bytes moved through a buffer */
+} FS_STATS;
+
+#define READAHEAD_STREAMS 4        // files whose sequential access is tracked at once
+#define DECOMPRESS_CACHE_ENTRIES 4
+
+/* The data blocks of the mounted image: which are resident, which need writing back */
+typedef struct
+{
+  FILE *file;    /* image the blocks are read from and written back to */
+  int budget;    /* maximum resident data blocks between commands (0 = no limit) */
+  int clockHand;
+  unsigned char state[MAX_PARTITION_BLOCKS];
+  unsigned short pins[MAX_PARTITION_BLOCKS]; /* holders of the block's memory: not evicted, not reused if freed */
+} BLOCK_CACHE;
+
+/* Sequential access state of one file being read */
+typedef struct
+{
+  const EXT_SIMPLE_INODE *inode;
+  int nextIndex; /* block_numbers index a sequential reader will ask for next */
+  int window;    /* blocks read per miss */
+} READAHEAD_STREAM;
+
+/* Recently decompressed file contents, keyed by the blocks holding the stream */
+typedef struct
+{
+  int valid;
+  unsigned int fileSize;
+  unsigned short blockNumbers[MAX_INODE_BLOCK_NUMS];
+  unsigned long lastUse;
+  unsigned char content[MAX_FILE_SIZE];
+} DECOMPRESS_CACHE_ENTRY;
+
+/* In-memory state kept for one mounted image besides its on-disk structures. The
+   core functions work on the runtime selected with SelectRuntime. */
+typedef struct
+{
+  int quiet;                                          /* drop all messages (library use) */
+  int terse;                                          /* drop confirmations of successful commands (batch mode) */
+  int commitInterval;                                 /* modifying commands per save: 0 = every one, -1 = save at unmount */
+  int uncommittedChanges;                             /* modifying commands since the last save */
+  FILE *commandInput;                                 /* where commands, and the payloads of 'put', are read from */
+  FS_STATS stats;
+  BLOCK_CACHE cache;
+  READAHEAD_STREAM readaheadStreams[READAHEAD_STREAMS];
+  int readaheadNextSlot;
+  int readaheadCap;                                   /* shrinks when read-ahead blocks go unused */
+  DECOMPRESS_CACHE_ENTRY decompressCache[DECOMPRESS_CACHE_ENTRIES];
+  unsigned long decompressCacheClock;
+  unsigned char discardPending[MAX_PARTITION_BLOCKS]; /* freed since the last save, not yet released */
+} FS_RUNTIME;
+
+extern FS_RUNTIME *fsRuntime;
+
+/* Supplies file content in pieces: fills up to capacity bytes and returns how many,
+   0 at the end of the content, or -1 if the content is incomplete */
+typedef long (*CONTENT_READER)(void *source, unsigned char *buffer, size_t capacity);
+
+#define FRAG_HISTOGRAM_BUCKETS 7 // bucket k counts free runs of [2^k, 2^(k+1)) blocks, up to 127
+
+/* Device-wide layout summary produced by the 'fragstats' command */
+typedef struct
+{
+  int freeBlocks;
+  int freeExtents;                                   /* maximal runs of free blocks */
+  int largestFreeRun;
+  int freeRunHistogram[FRAG_HISTOGRAM_BUCKETS];
+  int files;
+  int fileBlocks;
+  int fileExtents;                                   /* contiguous runs summed over all files */
+  int runCount;                                      /* occupancy map: alternating used/free runs */
+  int firstRunUsed;                                  /* 1 if runLengths[0] is a used run */
+  unsigned short runLengths[MAX_PARTITION_BLOCKS];
+} FRAG_STATS;
+
 // ---------------------------------------------------------------------------
 // FORWARD DECLARATIONS OF FUNCTIONS
 // ---------------------------------------------------------------------------
 
 // 1) Command Parsing and Processing
-int CheckCommand(char *commandStr, char *command, char *arg1, char *arg2);
-void ProcessCommand(const char *order,
-                    const char *arg1,
-                    const char *arg2,
-                    EXT_SIMPLE_SUPERBLOCK *superBlock,
-                    EXT_BYTE_MAPS *byteMaps,
-                    EXT_INODE_BLOCK *inodeBlock,
-                    EXT_DIRECTORY_ENTRY *directory,
-                    EXT_DATA *data,
-                    FILE *file);
+#define COMMAND_EXIT 1 // ProcessCommand result for 'exit'
+int CheckCommand(char *commandStr, char **command, char **arg1, char **arg2);
+int IsCommand(const char *verb);
+int ProcessCommand(const char *order,
+                   const char *arg1,
+                   const char *arg2,
+                   EXT_SIMPLE_SUPERBLOCK *superBlock,
+                   EXT_BYTE_MAPS *byteMaps,
+                   EXT_INODE_BLOCK *inodeBlock,
+                   EXT_DIRECTORY_ENTRY *directory,
+                   EXT_DATA *data,
+                   FILE *file);
 
-// 2) Save/Load Operations
+// 2) Save/Load Operations and Block Cache
 void SaveAllChanges(EXT_DIRECTORY_ENTRY *directory,
                     EXT_INODE_BLOCK *inodeBlock,
                     EXT_BYTE_MAPS *byteMaps,
                     EXT_SIMPLE_SUPERBLOCK *superBlock,
                     EXT_DATA *data,
                     FILE *file);
+void SaveAfterChange(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, EXT_BYTE_MAPS *byteMaps,
+                     EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, FILE *file);
 
+int LoadMetadata(FILE *file, EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps,
+                 EXT_INODE_BLOCK *inodeBlock, EXT_DIRECTORY_ENTRY *directory);
+int LoadFilesystem(FILE *file, EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps,
+                   EXT_INODE_BLOCK *inodeBlock, EXT_DIRECTORY_ENTRY *directory, EXT_DATA *data);
+int LoadFilesystemLazy(FILE *file, EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps,
+                       EXT_INODE_BLOCK *inodeBlock, EXT_DIRECTORY_ENTRY *directory);
+int MountFilesystem(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, EXT_BYTE_MAPS *byteMaps,
+                    EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, FILE *file);
+void UnmountFilesystem(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, EXT_BYTE_MAPS *byteMaps,
+                       EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, FILE *file);
+void MarkBlockDirty(EXT_SIMPLE_SUPERBLOCK *superBlock, int blockNum);
+int FormatFilesystem(FILE *file, int totalBlocks, int totalInodes);
 void SaveSuperBlock(EXT_SIMPLE_SUPERBLOCK *superBlock, FILE *file);
 void SaveByteMaps(EXT_BYTE_MAPS *byteMaps, FILE *file);
 void SaveInodesAndDirectory(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodeBlock, FILE *file);
-void SaveData(EXT_DATA *data, FILE *file);
+void SaveData(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data, FILE *file);
+int IsZeroBlock(const unsigned char *block);
+void QueueDiscard(EXT_SIMPLE_SUPERBLOCK *superBlock, int blockNum);
+int FlushDiscards(EXT_BYTE_MAPS *byteMaps, FILE *file);
+void ResetBlockCache(FILE *file, int resident);
+unsigned char *ReadDataBlock(EXT_DATA *data, int blockNum);
+unsigned char *WriteDataBlock(EXT_DATA *data, int blockNum);
+int IsBlockModified(int blockNum);
+void ClearBlockModified(int blockNum);
+void HoldBlockUntilSave(int blockNum);
+int IsBlockClean(int blockNum);
+void DropCachedBlock(int blockNum);
+unsigned char *PinDataBlock(EXT_DATA *data, int blockNum);
+void UnpinDataBlock(int blockNum);
+int IsBlockPinned(int blockNum);
+void SetBlockCacheBudget(int blocks);
+int TrimBlockCache(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data);
+int PrefetchBlocks(EXT_BYTE_MAPS *byteMaps, EXT_DATA *data, int maxBlocks);
+void ReadAheadFile(const EXT_SIMPLE_INODE *inode, int index, EXT_DATA *data);
+void PrintBlockCacheStats(void);
 
 // 3) Filesystem and Command-Related Functions
 int RenameFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, char *oldName, char *newName);
 int DeleteFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps, EXT_SIMPLE_SUPERBLOCK *superBlock, char *name);
 int CopyFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps, EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, char *sourceName, char *destName, FILE *file);
-int PrintFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_DATA *data, char *name);
+#define PRINT_TO_END ((size_t)-1) // PrintFile length: up to the end of the file
+int PrintFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, char *name,
+              long offset, size_t length);
 void ListDirectory(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes);
 void PrintSuperBlock(EXT_SIMPLE_SUPERBLOCK *superBlock);
 void PrintByteMaps(EXT_BYTE_MAPS *byteMaps);
 int FindFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, char *name);
 int CreateFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
                EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, char *fileName, char *content);
+int CreateFileFromBuffer(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                         EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+                         const char *fileName, const unsigned char *content, size_t size);
+int CreateFileFromStream(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                         EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+                         const char *fileName, CONTENT_READER read, void *source);
+int ImportFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+               EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+               const char *hostPath, const char *fileName, FILE *file);
+int ExportFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_SIMPLE_SUPERBLOCK *superBlock,
+               EXT_DATA *data, const char *fileName, const char *hostPath, FILE *file);
+int ImportTree(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+               EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+               const char *hostDir, FILE *file, int *imported);
+int ExportTar(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_SIMPLE_SUPERBLOCK *superBlock,
+              EXT_DATA *data, FILE *out, int *exported);
+int ImportTar(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+              EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, FILE *in, int *imported);
+int WriteFileRange(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                   EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+                   const char *fileName, size_t offset, const unsigned char *content, size_t size);
+int AppendFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+               EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data,
+               const char *fileName, const unsigned char *content, size_t size);
+int TruncateFile(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_BYTE_MAPS *byteMaps,
+                 EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, const char *fileName, size_t size);
+int SetOption(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data, const char *name, const char *value);
+
+// 4) Block Allocation and Deduplication
+int PartitionBlockCount(const EXT_SIMPLE_SUPERBLOCK *superBlock);
+int PartitionInodeCount(const EXT_SIMPLE_SUPERBLOCK *superBlock);
+unsigned int HashBlock(const unsigned char *block);
+int CountAllocatableBlocks(const EXT_SIMPLE_SUPERBLOCK *superBlock, const EXT_BYTE_MAPS *byteMaps);
+int AllocateDataBlocks(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, int count,
+                       unsigned short *blocks);
+int StoreDataBlock(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data, const unsigned char *block);
+void ReleaseDataBlock(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, int blockNum);
+void RebuildFingerprintIndex(EXT_BYTE_MAPS *byteMaps, EXT_DATA *data);
+int DeduplicateBlocks(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                      EXT_DATA *data, int maxMerges, unsigned int *bytesReclaimed);
+
+// 5) File Content and Compression
+int WriteFileContent(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_DATA *data,
+                     EXT_SIMPLE_INODE *inode, const unsigned char *content, int size);
+int ReadFileContent(EXT_SIMPLE_INODE *inode, EXT_DATA *data, unsigned char *buffer);
+int LzCompress(const unsigned char *src, int srcLen, unsigned char *dst, int dstCap);
+int LzDecompress(const unsigned char *src, int srcLen, unsigned char *dst, int dstLen);
+unsigned int EstimateEntropy(const unsigned char *buffer, int length);
+void InvalidateDecompressCache(int blockNum);
+
+// 6) Checksums and Statistics
+unsigned int Crc32c(const void *buffer, size_t length);
+unsigned int Crc32cSoftware(const void *buffer, size_t length);
+const char *Crc32cImplementation(void);
+void UpdateDataChecksum(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, int blockNum);
+void UpdateMetadataChecksums(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps,
+                             EXT_INODE_BLOCK *inodeBlock, EXT_DIRECTORY_ENTRY *directory);
+int VerifyDataChecksum(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_DATA *data, int blockNum);
+int VerifyChecksums(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodeBlock,
+                    EXT_DIRECTORY_ENTRY *directory, EXT_DATA *data, unsigned int regions);
+void PrintStats(void);
+double NowSeconds(void);
+
+// 7) Consistency Checking
+int CheckFilesystem(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps,
+                    EXT_INODE_BLOCK *inodeBlock, EXT_DIRECTORY_ENTRY *directory, unsigned int regions, int repair);
+
+// 8) Defragmentation, Resizing and Fragmentation Analysis
+int DefragmentFilesystem(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                         EXT_DIRECTORY_ENTRY *directory, EXT_DATA *data, int maxMoves);
+int ResizeFilesystem(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                     EXT_DIRECTORY_ENTRY *directory, EXT_DATA *data, int newBlocks, FILE *file);
+int CountFileExtents(EXT_SIMPLE_INODE *inode);
+void CollectFragStats(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                      EXT_DIRECTORY_ENTRY *directory, FRAG_STATS *stats);
+void PrintFragStats(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps, EXT_INODE_BLOCK *inodes,
+                    EXT_DIRECTORY_ENTRY *directory);
 
-// 4) Helper Functions  
+// 9) Helper Functions  
+void InitRuntime(FS_RUNTIME *runtime);
+void SelectRuntime(FS_RUNTIME *runtime);
+int FsPrintf(const char *format, ...);
+int FsErrorf(const char *format, ...);
+int FsStatusf(const char *format, ...);
+void FsPerror(const char *message);
 void DebugListAllDirectoryEntries(EXT_DIRECTORY_ENTRY *directory);
 void ClearScreen();
\ No newline at end of file
@@ -0,0 +1,645 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "headers.h"
+#include "libextsimple.h"
+
+/* A mounted image: everything main() keeps on its stack for the REPL, plus the runtime */
+struct ext_filesystem
+{
+   FILE *file;
+   FS_RUNTIME runtime;
+   EXT_SIMPLE_SUPERBLOCK superBlock;
+   EXT_BYTE_MAPS byteMaps;
+   EXT_INODE_BLOCK inodeBlock;
+   EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+   EXT_DATA data[MAX_DATA_BLOCKS];
+   int openViews; // fs_read_view results not released yet
+};
+
+/* A range of a file handed out by fs_read_view, with the blocks it keeps pinned */
+struct fs_view
+{
+   EXT_FILESYSTEM *fs;
+   int blockCount;
+   unsigned short blocks[MAX_INODE_BLOCK_NUMS];
+   unsigned char *content; // decoded copy of a compressed file, or NULL
+   struct iovec spans[MAX_INODE_BLOCK_NUMS];
+};
+
+// ---------------------------------------------------------------------------
+// HANDLE HELPERS
+// ---------------------------------------------------------------------------
+
+/* Points the core at this image's runtime for the duration of one call */
+static void Enter(EXT_FILESYSTEM *fs)
+{
+   SelectRuntime(&fs->runtime);
+}
+
+/* Ends a call the way the REPL ends a command: the cache goes back within its budget */
+static int Leave(EXT_FILESYSTEM *fs, int result)
+{
+   TrimBlockCache(&fs->superBlock, &fs->byteMaps, fs->data);
+   SelectRuntime(NULL);
+   return result;
+}
+
+/* Writes the image back after a change, as the REPL does after every modifying command */
+static int Commit(EXT_FILESYSTEM *fs)
+{
+   SaveAllChanges(fs->directory, &fs->inodeBlock, &fs->byteMaps, &fs->superBlock, fs->data, fs->file);
+   if (ferror(fs->file))
+   {
+      clearerr(fs->file);
+      return FS_EIO;
+   }
+   return FS_OK;
+}
+
+/* A name a file can have: non-empty, fits a directory entry, and not the root entry "." */
+static int IsValidName(const char *name)
+{
+   return name != NULL && name[0] != '\0' && strlen(name) < FILE_NAME_LENGTH && strcmp(name, ".") != 0;
+}
+
+/* Directory index of an existing file, or FS_EINVAL / FS_ENOENT */
+static int LookupFile(EXT_FILESYSTEM *fs, const char *name)
+{
+   if (!IsValidName(name))
+   {
+      return FS_EINVAL;
+   }
+   int fileIndex = FindFile(fs->directory, &fs->inodeBlock, (char *)name);
+   return fileIndex == -1 ? FS_ENOENT : fileIndex;
+}
+
+/* FS_OK if a new file may take this name, or FS_EINVAL / FS_EEXIST */
+static int CheckNewName(EXT_FILESYSTEM *fs, const char *name)
+{
+   if (!IsValidName(name))
+   {
+      return FS_EINVAL;
+   }
+   return FindFile(fs->directory, &fs->inodeBlock, (char *)name) == -1 ? FS_OK : FS_EEXIST;
+}
+
+// ---------------------------------------------------------------------------
+// MOUNTING
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Opens and mounts the image at path. Like the REPL, the mount validates what
+ *        an unclean shutdown may have left behind and marks the image in use.
+ * @param flags FS_MOUNT_LAZY to read the data blocks on demand.
+ * @param fs Receives the handle, or NULL on failure.
+ * @return FS_OK, FS_EINVAL, FS_ENOMEM, or FS_EIO if the image cannot be opened or read.
+ */
+int fs_mount(const char *path, int flags, EXT_FILESYSTEM **fs)
+{
+   if (fs == NULL)
+   {
+      return FS_EINVAL;
+   }
+   *fs = NULL;
+   if (path == NULL)
+   {
+      return FS_EINVAL;
+   }
+
+   EXT_FILESYSTEM *handle = malloc(sizeof(EXT_FILESYSTEM));
+   if (handle == NULL)
+   {
+      return FS_ENOMEM;
+   }
+   handle->file = fopen(path, "r+b");
+   if (handle->file == NULL)
+   {
+      free(handle);
+      return FS_EIO;
+   }
+   InitRuntime(&handle->runtime);
+   handle->runtime.quiet = 1;
+   handle->openViews = 0;
+
+   Enter(handle);
+   int loaded = (flags & FS_MOUNT_LAZY)
+                    ? LoadFilesystemLazy(handle->file, &handle->superBlock, &handle->byteMaps,
+                                         &handle->inodeBlock, handle->directory)
+                    : LoadFilesystem(handle->file, &handle->superBlock, &handle->byteMaps,
+                                     &handle->inodeBlock, handle->directory, handle->data);
+   if (loaded != 0)
+   {
+      SelectRuntime(NULL);
+      fclose(handle->file);
+      free(handle);
+      return FS_EIO;
+   }
+   MountFilesystem(handle->directory, &handle->inodeBlock, &handle->byteMaps, &handle->superBlock,
+                   handle->data, handle->file);
+   if (ferror(handle->file))
+   {
+      SelectRuntime(NULL);
+      fclose(handle->file);
+      free(handle);
+      return FS_EIO;
+   }
+
+   *fs = handle;
+   return Leave(handle, FS_OK);
+}
+
+/**
+ * @brief Saves everything, records a clean unmount and frees the handle, which is
+ *        freed even if writing fails. Every read view must have been released.
+ * @return FS_OK, FS_EBUSY (nothing done), or FS_EIO if the image could not be
+ *         written or closed.
+ */
+int fs_unmount(EXT_FILESYSTEM *fs)
+{
+   if (fs == NULL)
+   {
+      return FS_EINVAL;
+   }
+   if (fs->openViews > 0)
+   {
+      return FS_EBUSY;
+   }
+   Enter(fs);
+   UnmountFilesystem(fs->directory, &fs->inodeBlock, &fs->byteMaps, &fs->superBlock, fs->data, fs->file);
+   int result = ferror(fs->file) ? FS_EIO : FS_OK;
+   SelectRuntime(NULL);
+   if (fclose(fs->file) != 0)
+   {
+      result = FS_EIO;
+   }
+   free(fs);
+   return result;
+}
+
+/**
+ * @brief Writes all in-memory changes back to the image.
+ * @return FS_OK or FS_EIO.
+ */
+int fs_sync(EXT_FILESYSTEM *fs)
+{
+   if (fs == NULL)
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   return Leave(fs, Commit(fs));
+}
+
+// ---------------------------------------------------------------------------
+// FILE OPERATIONS
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Creates a file holding size bytes of content (any bytes, zeros included).
+ * @return FS_OK, FS_EINVAL, FS_EEXIST, FS_EFBIG, FS_ENOSPC or FS_EIO.
+ */
+int fs_create(EXT_FILESYSTEM *fs, const char *name, const void *content, size_t size)
+{
+   if (fs == NULL || (content == NULL && size > 0))
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int result = CheckNewName(fs, name);
+   if (result != FS_OK)
+   {
+      return Leave(fs, result);
+   }
+   if (size > MAX_FILE_SIZE)
+   {
+      return Leave(fs, FS_EFBIG);
+   }
+   if (CreateFileFromBuffer(fs->directory, &fs->inodeBlock, &fs->byteMaps, &fs->superBlock, fs->data,
+                            name, content, size) != 0)
+   {
+      return Leave(fs, FS_ENOSPC);
+   }
+   return Leave(fs, Commit(fs));
+}
+
+/**
+ * @brief Reads a whole file into buffer. Blocks are verified against their checksums
+ *        when those are enabled, and compressed files are decompressed.
+ * @param capacity Size of buffer; a smaller value than the file size fails with
+ *        FS_ERANGE, so a NULL buffer of capacity 0 just asks for the size.
+ * @param size Receives the file size (also on FS_ERANGE). May be NULL.
+ * @return FS_OK, FS_EINVAL, FS_ENOENT, FS_ERANGE or FS_ECORRUPT.
+ */
+int fs_read(EXT_FILESYSTEM *fs, const char *name, void *buffer, size_t capacity, size_t *size)
+{
+   if (fs == NULL || (buffer == NULL && capacity > 0))
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, name);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+
+   EXT_SIMPLE_INODE *inode = &fs->inodeBlock.inodes[fs->directory[fileIndex].inode];
+   if (size != NULL)
+   {
+      *size = inode->file_size;
+   }
+   if (inode->file_size > capacity)
+   {
+      return Leave(fs, FS_ERANGE);
+   }
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      if (inode->block_numbers[i] != NULL_BLOCK &&
+          VerifyDataChecksum(&fs->superBlock, fs->data, inode->block_numbers[i]) != 0)
+      {
+         return Leave(fs, FS_ECORRUPT);
+      }
+   }
+   if (inode->file_size > 0 && ReadFileContent(inode, fs->data, buffer) != (int)inode->file_size)
+   {
+      return Leave(fs, FS_ECORRUPT);
+   }
+   return Leave(fs, FS_OK);
+}
+
+/**
+ * @brief Reports a file's size without reading it.
+ * @return FS_OK, FS_EINVAL or FS_ENOENT.
+ */
+int fs_stat(EXT_FILESYSTEM *fs, const char *name, size_t *size)
+{
+   if (fs == NULL || size == NULL)
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, name);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+   *size = fs->inodeBlock.inodes[fs->directory[fileIndex].inode].file_size;
+   return Leave(fs, FS_OK);
+}
+
+/**
+ * @brief Deletes a file.
+ * @return FS_OK, FS_EINVAL, FS_ENOENT or FS_EIO.
+ */
+int fs_remove(EXT_FILESYSTEM *fs, const char *name)
+{
+   if (fs == NULL)
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, name);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+   DeleteFile(fs->directory, &fs->inodeBlock, &fs->byteMaps, &fs->superBlock, (char *)name);
+   return Leave(fs, Commit(fs));
+}
+
+/**
+ * @brief Renames a file; newName must not be taken.
+ * @return FS_OK, FS_EINVAL, FS_ENOENT, FS_EEXIST or FS_EIO.
+ */
+int fs_rename(EXT_FILESYSTEM *fs, const char *oldName, const char *newName)
+{
+   if (fs == NULL)
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, oldName);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+   int result = CheckNewName(fs, newName);
+   if (result != FS_OK)
+   {
+      return Leave(fs, result);
+   }
+   RenameFile(fs->directory, &fs->inodeBlock, (char *)oldName, (char *)newName);
+   return Leave(fs, Commit(fs));
+}
+
+/**
+ * @brief Copies a file to a new name (sharing its blocks when dedup is enabled).
+ * @return FS_OK, FS_EINVAL, FS_ENOENT, FS_EEXIST, FS_ENOSPC or FS_EIO.
+ */
+int fs_copy(EXT_FILESYSTEM *fs, const char *sourceName, const char *destName)
+{
+   if (fs == NULL)
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, sourceName);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+   int result = CheckNewName(fs, destName);
+   if (result != FS_OK)
+   {
+      return Leave(fs, result);
+   }
+   if (CopyFile(fs->directory, &fs->inodeBlock, &fs->byteMaps, &fs->superBlock, fs->data,
+                (char *)sourceName, (char *)destName, fs->file) != 0)
+   {
+      return Leave(fs, FS_ENOSPC);
+   }
+   return Leave(fs, Commit(fs));
+}
+
+/**
+ * @brief Writes size bytes of content into a file at offset, growing it if needed;
+ *        a gap past the old end reads as zeros. Only the touched blocks change, and
+ *        blocks shared with other files or held by read views are copied first.
+ * @return FS_OK, FS_EINVAL, FS_ENOENT, FS_EFBIG, FS_ENOSPC or FS_EIO.
+ */
+int fs_write(EXT_FILESYSTEM *fs, const char *name, size_t offset, const void *content, size_t size)
+{
+   if (fs == NULL || (content == NULL && size > 0))
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, name);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+   if (offset > MAX_FILE_SIZE || size > MAX_FILE_SIZE - offset)
+   {
+      return Leave(fs, FS_EFBIG);
+   }
+   if (WriteFileRange(fs->directory, &fs->inodeBlock, &fs->byteMaps, &fs->superBlock, fs->data,
+                      name, offset, content, size) != 0)
+   {
+      return Leave(fs, FS_ENOSPC);
+   }
+   return Leave(fs, Commit(fs));
+}
+
+/**
+ * @brief Writes size bytes of content at the end of a file.
+ * @return FS_OK, FS_EINVAL, FS_ENOENT, FS_EFBIG, FS_ENOSPC or FS_EIO.
+ */
+int fs_append(EXT_FILESYSTEM *fs, const char *name, const void *content, size_t size)
+{
+   if (fs == NULL || (content == NULL && size > 0))
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, name);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+   size_t end = fs->inodeBlock.inodes[fs->directory[fileIndex].inode].file_size;
+   if (size > MAX_FILE_SIZE - end)
+   {
+      return Leave(fs, FS_EFBIG);
+   }
+   if (AppendFile(fs->directory, &fs->inodeBlock, &fs->byteMaps, &fs->superBlock, fs->data,
+                  name, content, size) != 0)
+   {
+      return Leave(fs, FS_ENOSPC);
+   }
+   return Leave(fs, Commit(fs));
+}
+
+/**
+ * @brief Sets a file's size: shrinking frees the blocks past the new end, growing
+ *        adds zeros.
+ * @return FS_OK, FS_EINVAL, FS_ENOENT, FS_EFBIG, FS_ENOSPC or FS_EIO.
+ */
+int fs_truncate(EXT_FILESYSTEM *fs, const char *name, size_t size)
+{
+   if (fs == NULL)
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, name);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+   if (size > MAX_FILE_SIZE)
+   {
+      return Leave(fs, FS_EFBIG);
+   }
+   if (TruncateFile(fs->directory, &fs->inodeBlock, &fs->byteMaps, &fs->superBlock, fs->data, name, size) != 0)
+   {
+      return Leave(fs, FS_ENOSPC);
+   }
+   return Leave(fs, Commit(fs));
+}
+
+/**
+ * @brief Calls visit for each file in directory order, stopping early if it returns
+ *        non-zero.
+ * @return FS_OK, or FS_EINVAL.
+ */
+int fs_list(EXT_FILESYSTEM *fs, int (*visit)(const char *name, size_t size, void *context), void *context)
+{
+   if (fs == NULL || visit == NULL)
+   {
+      return FS_EINVAL;
+   }
+   for (int i = 0; i < MAX_FILES; i++)
+   {
+      EXT_DIRECTORY_ENTRY *entry = &fs->directory[i];
+      if (entry->inode == NULL_INODE || strcmp(entry->file_name, ".") == 0)
+      {
+         continue;
+      }
+      if (visit(entry->file_name, fs->inodeBlock.inodes[entry->inode].file_size, context) != 0)
+      {
+         break;
+      }
+   }
+   return FS_OK;
+}
+
+// ---------------------------------------------------------------------------
+// READ VIEWS
+// ---------------------------------------------------------------------------
+
+/**
+ * @brief Maps length bytes of a file from offset without copying them: spans receives
+ *        pointers into the data blocks, adjacent blocks merged into one span, ready
+ *        for writev or a hash update. The range is clamped to the file, so SIZE_MAX
+ *        reads to the end; a range past the end gives no spans.
+ *
+ * The blocks are pinned until fs_release_view: they are not evicted, and if the file
+ * is removed meanwhile they are not reused, so the bytes do not change under the
+ * caller. Blocks are verified against their checksums first. A compressed file is
+ * decoded into memory owned by the view, and the span points there.
+ *
+ * @param view Receives the view to release, or NULL on failure.
+ * @param spans Receives the spans, owned by the view.
+ * @param count Receives the number of spans.
+ * @return FS_OK, FS_EINVAL, FS_ENOENT, FS_ECORRUPT or FS_ENOMEM.
+ */
+int fs_read_view(EXT_FILESYSTEM *fs, const char *name, size_t offset, size_t length,
+                 FS_VIEW **view, const struct iovec **spans, int *count)
+{
+   if (view == NULL)
+   {
+      return FS_EINVAL;
+   }
+   *view = NULL;
+   if (fs == NULL || spans == NULL || count == NULL)
+   {
+      return FS_EINVAL;
+   }
+   Enter(fs);
+   int fileIndex = LookupFile(fs, name);
+   if (fileIndex < 0)
+   {
+      return Leave(fs, fileIndex);
+   }
+   EXT_SIMPLE_INODE *inode = &fs->inodeBlock.inodes[fs->directory[fileIndex].inode];
+   size_t size = inode->file_size;
+   size_t start = offset < size ? offset : size;
+   size_t end = length < size - start ? start + length : size;
+   int firstIndex = start / BLOCK_SIZE;
+   int lastIndex = end > start ? (int)((end - 1) / BLOCK_SIZE) : firstIndex - 1;
+
+   for (int i = 0; i < MAX_INODE_BLOCK_NUMS; i++)
+   {
+      // The whole stream is needed to decode any part of a compressed file
+      int blockNum = inode->block_numbers[i];
+      int needed = inode->codec == INODE_CODEC_LZ ? blockNum != NULL_BLOCK && end > start
+                                                  : i >= firstIndex && i <= lastIndex;
+      if (needed && (blockNum < FIRST_DATA_BLOCK || blockNum >= MAX_PARTITION_BLOCKS ||
+                     VerifyDataChecksum(&fs->superBlock, fs->data, blockNum) != 0))
+      {
+         return Leave(fs, FS_ECORRUPT);
+      }
+   }
+   if (lastIndex >= MAX_INODE_BLOCK_NUMS)
+   {
+      return Leave(fs, FS_ECORRUPT);
+   }
+
+   FS_VIEW *result = calloc(1, sizeof(FS_VIEW));
+   if (result == NULL)
+   {
+      return Leave(fs, FS_ENOMEM);
+   }
+   result->fs = fs;
+   int spanCount = 0;
+   if (inode->codec == INODE_CODEC_LZ && end > start)
+   {
+      result->content = malloc(MAX_FILE_SIZE);
+      if (result->content == NULL || ReadFileContent(inode, fs->data, result->content) != (int)size)
+      {
+         int error = result->content == NULL ? FS_ENOMEM : FS_ECORRUPT;
+         free(result->content);
+         free(result);
+         return Leave(fs, error);
+      }
+      result->spans[spanCount].iov_base = result->content + start;
+      result->spans[spanCount++].iov_len = end - start;
+   }
+   else
+   {
+      for (int i = firstIndex; i <= lastIndex; i++)
+      {
+         int blockNum = inode->block_numbers[i];
+         ReadAheadFile(inode, i, fs->data);
+         unsigned char *block = PinDataBlock(fs->data, blockNum);
+         result->blocks[result->blockCount++] = blockNum;
+
+         size_t from = i == firstIndex ? start % BLOCK_SIZE : 0;
+         size_t to = i == lastIndex ? end - (size_t)i * BLOCK_SIZE : BLOCK_SIZE;
+         struct iovec *last = spanCount > 0 ? &result->spans[spanCount - 1] : NULL;
+         if (last != NULL && (unsigned char *)last->iov_base + last->iov_len == block + from)
+         {
+            last->iov_len += to - from;
+         }
+         else
+         {
+            result->spans[spanCount].iov_base = block + from;
+            result->spans[spanCount++].iov_len = to - from;
+         }
+      }
+   }
+
+   fs->openViews++;
+   *view = result;
+   *spans = result->spans;
+   *count = spanCount;
+   return Leave(fs, FS_OK);
+}
+
+/**
+ * @brief Unpins the blocks of a view and frees it; its spans are no longer valid.
+ * @return FS_OK, or FS_EINVAL for a NULL view.
+ */
+int fs_release_view(FS_VIEW *view)
+{
+   if (view == NULL)
+   {
+      return FS_EINVAL;
+   }
+   EXT_FILESYSTEM *fs = view->fs;
+   Enter(fs);
+   for (int i = 0; i < view->blockCount; i++)
+   {
+      UnpinDataBlock(view->blocks[i]);
+   }
+   fs->openViews--;
+   free(view->content);
+   free(view);
+   return Leave(fs, FS_OK);
+}
+
+/**
+ * @brief Describes an FS_* code.
+ */
+const char *fs_strerror(int error)
+{
+   switch (error)
+   {
+   case FS_OK:
+      return "Success";
+   case FS_EINVAL:
+      return "Invalid argument";
+   case FS_ENOENT:
+      return "No such file";
+   case FS_EEXIST:
+      return "File exists";
+   case FS_ENOSPC:
+      return "No space left in the partition";
+   case FS_EFBIG:
+      return "File too large";
+   case FS_ERANGE:
+      return "Buffer too small";
+   case FS_EIO:
+      return "Input/output error";
+   case FS_ECORRUPT:
+      return "Corrupt data";
+   case FS_ENOMEM:
+      return "Out of memory";
+   case FS_EBUSY:
+      return "Read views still open";
+   default:
+      return "Unknown error";
+   }
+}
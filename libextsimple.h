@@ -0,0 +1,57 @@
+#ifndef LIBEXTSIMPLE_H
+#define LIBEXTSIMPLE_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * libextsimple: the filesystem core as an embeddable library.
+ *
+ * Each mounted image is an opaque handle holding its own metadata, data blocks,
+ * block cache and counters, so several images can be mounted in one process.
+ * The functions print nothing and report failures as FS_E* codes. Calls on any
+ * handles must not run concurrently; use one thread or a lock around them.
+ */
+
+typedef struct ext_filesystem EXT_FILESYSTEM;
+typedef struct fs_view FS_VIEW;
+
+/* Error codes; every function returns FS_OK or one of the negative values */
+#define FS_OK 0
+#define FS_EINVAL -1   // invalid argument or file name
+#define FS_ENOENT -2   // no such file
+#define FS_EEXIST -3   // a file with that name already exists
+#define FS_ENOSPC -4   // no free data blocks, inodes or directory entries
+#define FS_EFBIG -5    // content larger than the maximum file size
+#define FS_ERANGE -6   // buffer too small for the file
+#define FS_EIO -7      // the image could not be opened, read or written
+#define FS_ECORRUPT -8 // checksum mismatch or undecodable content
+#define FS_ENOMEM -9
+#define FS_EBUSY -10   // read views are still open
+
+/* fs_mount flags */
+#define FS_MOUNT_LAZY 0x01 // read only the metadata at mount, data blocks on first access
+
+int fs_mount(const char *path, int flags, EXT_FILESYSTEM **fs);
+int fs_unmount(EXT_FILESYSTEM *fs);
+int fs_sync(EXT_FILESYSTEM *fs);
+
+int fs_create(EXT_FILESYSTEM *fs, const char *name, const void *content, size_t size);
+int fs_read(EXT_FILESYSTEM *fs, const char *name, void *buffer, size_t capacity, size_t *size);
+int fs_stat(EXT_FILESYSTEM *fs, const char *name, size_t *size);
+int fs_remove(EXT_FILESYSTEM *fs, const char *name);
+int fs_rename(EXT_FILESYSTEM *fs, const char *oldName, const char *newName);
+int fs_copy(EXT_FILESYSTEM *fs, const char *sourceName, const char *destName);
+int fs_write(EXT_FILESYSTEM *fs, const char *name, size_t offset, const void *content, size_t size);
+int fs_append(EXT_FILESYSTEM *fs, const char *name, const void *content, size_t size);
+int fs_truncate(EXT_FILESYSTEM *fs, const char *name, size_t size);
+int fs_list(EXT_FILESYSTEM *fs, int (*visit)(const char *name, size_t size, void *context), void *context);
+
+/* Zero-copy reads: spans point into the image's data blocks, pinned until the release */
+int fs_read_view(EXT_FILESYSTEM *fs, const char *name, size_t offset, size_t length,
+                 FS_VIEW **view, const struct iovec **spans, int *count);
+int fs_release_view(FS_VIEW *view);
+
+const char *fs_strerror(int error);
+
+#endif // LIBEXTSIMPLE_H
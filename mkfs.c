@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers.h"
+
+/**
+ * @brief Formats a partition image.
+ *
+ * Usage: mkfs [-b blocks] [-i inodes] image
+ *   -b  total blocks, including the 4 metadata blocks (default and maximum: 100)
+ *   -i  total inodes, including the 3 reserved ones (default and maximum: 24)
+ *
+ * An existing image is overwritten. Only the metadata blocks are written; the
+ * data blocks are left as a hole in the file.
+ */
+int main(int argc, char *argv[])
+{
+   const char *path = NULL;
+   int totalBlocks = MAX_PARTITION_BLOCKS;
+   int totalInodes = MAX_INODES;
+
+   for (int i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+      {
+         totalBlocks = atoi(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+      {
+         totalInodes = atoi(argv[++i]);
+      }
+      else if (argv[i][0] != '-' && path == NULL)
+      {
+         path = argv[i];
+      }
+      else
+      {
+         path = NULL;
+         break;
+      }
+   }
+   if (path == NULL)
+   {
+      fprintf(stderr, "Usage: %s [-b blocks] [-i inodes] image\n", argv[0]);
+      return 1;
+   }
+   if (totalBlocks <= FIRST_DATA_BLOCK || totalBlocks > MAX_PARTITION_BLOCKS)
+   {
+      fprintf(stderr, "Blocks must be between %d and %d.\n", FIRST_DATA_BLOCK + 1, MAX_PARTITION_BLOCKS);
+      return 1;
+   }
+   if (totalInodes <= RESERVED_INODES || totalInodes > MAX_INODES)
+   {
+      fprintf(stderr, "Inodes must be between %d and %d.\n", RESERVED_INODES + 1, MAX_INODES);
+      return 1;
+   }
+
+   FILE *file = fopen(path, "w+b");
+   if (file == NULL)
+   {
+      perror(path);
+      return 1;
+   }
+   int result = FormatFilesystem(file, totalBlocks, totalInodes);
+   if (fclose(file) != 0 || result != 0)
+   {
+      fprintf(stderr, "Error formatting partition %s\n", path);
+      return 1;
+   }
+
+   printf("Formatted %s: %d blocks of %d bytes, %d inodes, %d data blocks free.\n",
+          path, totalBlocks, BLOCK_SIZE, totalInodes, totalBlocks - FIRST_DATA_BLOCK);
+   return 0;
+}
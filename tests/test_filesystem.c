@@ -1,6 +1,10 @@
 #include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "unity.h"
 #include "headers.h"
+#include "libextsimple.h"
 
 void setUp(void)
 {
@@ -12,11 +16,42 @@ void tearDown(void)
     // This function is run after each test; can be used it for cleanup (freeing memory, etc.)
 }
 
+/* Builds an empty in-memory filesystem: blocks 0-3 and inodes 0-2 reserved, "." in entry 0 */
+static void InitEmptyFilesystem(EXT_SIMPLE_SUPERBLOCK *superBlock, EXT_BYTE_MAPS *byteMaps,
+                                EXT_INODE_BLOCK *inodes, EXT_DIRECTORY_ENTRY *directory, EXT_DATA *data)
+{
+    memset(superBlock, 0, sizeof(*superBlock));
+    memset(byteMaps, 0, sizeof(*byteMaps));
+    memset(inodes, 0, sizeof(*inodes));
+    memset(data, 0, sizeof(EXT_DATA) * MAX_DATA_BLOCKS);
+    superBlock->total_inodes = MAX_INODES;
+    superBlock->total_blocks = MAX_PARTITION_BLOCKS;
+    superBlock->free_blocks = MAX_DATA_BLOCKS;
+    superBlock->free_inodes = MAX_INODES - 3;
+    superBlock->first_data_block = FIRST_DATA_BLOCK;
+    superBlock->block_size = BLOCK_SIZE;
+    for (int i = 0; i < FIRST_DATA_BLOCK; i++)
+        byteMaps->block_bytemap[i] = 1;
+    for (int i = 0; i < 3; i++)
+        byteMaps->inode_bytemap[i] = 1;
+    for (int i = 0; i < MAX_INODES; i++)
+        for (int j = 0; j < MAX_INODE_BLOCK_NUMS; j++)
+            inodes->inodes[i].block_numbers[j] = NULL_BLOCK;
+    for (int i = 0; i < MAX_FILES; i++)
+    {
+        directory[i].inode = NULL_INODE;
+        memset(directory[i].file_name, 0, FILE_NAME_LENGTH);
+    }
+    strcpy(directory[0].file_name, ".");
+    directory[0].inode = 2;
+    ResetBlockCache(NULL, 1);
+}
+
 void test_CheckCommand_ValidInput(void)
 {
     char commandStr[] = "dir";
-    char command[100], arg1[100], arg2[100];
-    int result = CheckCommand(commandStr, command, arg1, arg2);
+    char *command, *arg1, *arg2;
+    int result = CheckCommand(commandStr, &command, &arg1, &arg2);
     TEST_ASSERT_EQUAL_INT(0, result);
     TEST_ASSERT_EQUAL_STRING("dir", command);
     TEST_ASSERT_EQUAL_STRING("", arg1);
@@ -26,14 +61,42 @@ void test_CheckCommand_ValidInput(void)
 void test_CheckCommand_WithArguments(void)
 {
     char commandStr[] = "copy file1 file2";
-    char command[100], arg1[100], arg2[100];
-    int result = CheckCommand(commandStr, command, arg1, arg2);
+    char *command, *arg1, *arg2;
+    int result = CheckCommand(commandStr, &command, &arg1, &arg2);
     TEST_ASSERT_EQUAL_INT(0, result);
     TEST_ASSERT_EQUAL_STRING("copy", command);
     TEST_ASSERT_EQUAL_STRING("file1", arg1);
     TEST_ASSERT_EQUAL_STRING("file2", arg2);
 }
 
+void test_CheckCommand_ParsesInPlace(void)
+{
+    char commandStr[] = "  create  notes.txt two  words\n";
+    char *command, *arg1, *arg2;
+    TEST_ASSERT_EQUAL_INT(0, CheckCommand(commandStr, &command, &arg1, &arg2));
+    TEST_ASSERT_EQUAL_STRING("create", command);
+    TEST_ASSERT_EQUAL_STRING("notes.txt", arg1);
+    TEST_ASSERT_EQUAL_STRING("two  words", arg2);
+    // The tokens point into the line itself
+    TEST_ASSERT_TRUE(command >= commandStr && arg2 < commandStr + sizeof(commandStr));
+
+    char blank[] = "   \n";
+    TEST_ASSERT_EQUAL_INT(-1, CheckCommand(blank, &command, &arg1, &arg2));
+}
+
+void test_IsCommand_EveryVerbHasItsOwnSlot(void)
+{
+    const char *verbs[] = {"dir", "info", "bytemaps", "rename", "print", "remove", "copy", "create", "set", "dedupe",
+                           "defrag", "resize", "fragstats", "cache", "stats", "fsck", "debug", "help", "clear", "exit",
+                           "put", "import", "export", "import-tree",
+                           "export-tar", "import-tar", "write", "append", "truncate"};
+    for (size_t i = 0; i < sizeof(verbs) / sizeof(verbs[0]); i++)
+        TEST_ASSERT_TRUE_MESSAGE(IsCommand(verbs[i]), verbs[i]);
+    TEST_ASSERT_FALSE(IsCommand("dirr"));
+    TEST_ASSERT_FALSE(IsCommand("x"));
+    TEST_ASSERT_FALSE(IsCommand(""));
+}
+
 void test_FindFile_FileExists(void)
 {
     EXT_DIRECTORY_ENTRY directory[MAX_FILES];
@@ -108,13 +171,1356 @@ void test_SaveSuperBlock(void)
     remove("temp_partition.bin");
 }
 
+void test_CreateFile_DedupSharesIdenticalBlocks(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "dedup", "on"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a.cfg", "same payload"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b.cfg", "same payload"));
+
+    EXT_SIMPLE_INODE *a = &inodes.inodes[directory[FindFile(directory, &inodes, "a.cfg")].inode];
+    EXT_SIMPLE_INODE *b = &inodes.inodes[directory[FindFile(directory, &inodes, "b.cfg")].inode];
+    TEST_ASSERT_EQUAL_UINT16(a->block_numbers[0], b->block_numbers[0]);
+    TEST_ASSERT_EQUAL_UINT8(2, byteMaps.block_bytemap[a->block_numbers[0]]);
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 1, superBlock.free_blocks);
+
+    // Deleting one file keeps the shared block alive; deleting the second frees it
+    unsigned short shared = a->block_numbers[0];
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "a.cfg"));
+    TEST_ASSERT_EQUAL_UINT8(1, byteMaps.block_bytemap[shared]);
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 1, superBlock.free_blocks);
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "b.cfg"));
+    TEST_ASSERT_EQUAL_UINT8(0, byteMaps.block_bytemap[shared]);
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS, superBlock.free_blocks);
+}
+
+void test_CopyFile_DedupReusesSourceBlocks(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "src", "config payload"));
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "dedup", "on"));
+    TEST_ASSERT_EQUAL_INT(0, CopyFile(directory, &inodes, &byteMaps, &superBlock, data, "src", "dst", tempFile));
+
+    EXT_SIMPLE_INODE *src = &inodes.inodes[directory[FindFile(directory, &inodes, "src")].inode];
+    EXT_SIMPLE_INODE *dst = &inodes.inodes[directory[FindFile(directory, &inodes, "dst")].inode];
+    TEST_ASSERT_EQUAL_UINT16(src->block_numbers[0], dst->block_numbers[0]);
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 1, superBlock.free_blocks);
+
+    fclose(tempFile);
+}
+
+void test_DeduplicateBlocks_MergesExistingDuplicates(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+
+    // Written with dedup off, so each file gets its own copy
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "tenant config"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "other content"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "c", "tenant config"));
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 3, superBlock.free_blocks);
+
+    unsigned int reclaimed = 0;
+    TEST_ASSERT_EQUAL_INT(1, DeduplicateBlocks(&superBlock, &byteMaps, &inodes, data, 0, &reclaimed));
+    TEST_ASSERT_EQUAL_UINT(BLOCK_SIZE, reclaimed);
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 2, superBlock.free_blocks);
+
+    EXT_SIMPLE_INODE *a = &inodes.inodes[directory[FindFile(directory, &inodes, "a")].inode];
+    EXT_SIMPLE_INODE *c = &inodes.inodes[directory[FindFile(directory, &inodes, "c")].inode];
+    TEST_ASSERT_EQUAL_UINT16(a->block_numbers[0], c->block_numbers[0]);
+    TEST_ASSERT_EQUAL_UINT8(2, byteMaps.block_bytemap[a->block_numbers[0]]);
+
+    // A second pass finds nothing left to merge
+    TEST_ASSERT_EQUAL_INT(0, DeduplicateBlocks(&superBlock, &byteMaps, &inodes, data, 0, &reclaimed));
+}
+
+void test_DeduplicateBlocks_FreedBlocksDropCachedContent(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char x[2000], y[2000], buffer[MAX_FILE_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "checksums", "on"));
+    for (int i = 0; i < 2000; i++)
+    {
+        x[i] = 'A' + i % 7;
+        y[i] = 'H' + i % 7;
+    }
+
+    // The copy's compressed stream is decoded once, so it sits in the decompress cache
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "compress", "on"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFileFromBuffer(directory, &inodes, &byteMaps, &superBlock, data, "x", x, sizeof(x)));
+    TEST_ASSERT_EQUAL_INT(0, CopyFile(directory, &inodes, &byteMaps, &superBlock, data, "x", "x2", tempFile));
+    EXT_SIMPLE_INODE *x2 = &inodes.inodes[directory[FindFile(directory, &inodes, "x2")].inode];
+    unsigned short merged = x2->block_numbers[0];
+    TEST_ASSERT_EQUAL_INT(sizeof(x), ReadFileContent(x2, data, buffer));
+
+    // Merging frees the copy's block like a release: no checksum, no cached content
+    unsigned int reclaimed = 0;
+    TEST_ASSERT_EQUAL_INT(1, DeduplicateBlocks(&superBlock, &byteMaps, &inodes, data, 0, &reclaimed));
+    TEST_ASSERT_EQUAL_UINT8(0, byteMaps.block_bytemap[merged]);
+    TEST_ASSERT_EQUAL_UINT32(0, superBlock.block_checksums[merged]);
+
+    // A new compressed file of the same size that reuses the block reads its own bytes
+    TEST_ASSERT_EQUAL_INT(0, CreateFileFromBuffer(directory, &inodes, &byteMaps, &superBlock, data, "y", y, sizeof(y)));
+    EXT_SIMPLE_INODE *yInode = &inodes.inodes[directory[FindFile(directory, &inodes, "y")].inode];
+    TEST_ASSERT_EQUAL_UINT16(merged, yInode->block_numbers[0]);
+    TEST_ASSERT_EQUAL_INT(sizeof(y), ReadFileContent(yInode, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY(y, buffer, sizeof(y));
+
+    fclose(tempFile);
+}
+
+void test_LzCompress_RoundTrip(void)
+{
+    unsigned char text[2000];
+    unsigned char packed[MAX_FILE_SIZE];
+    unsigned char unpacked[2000];
+    for (int i = 0; i < (int)sizeof(text); i++)
+        text[i] = "key=value; "[i % 11];
+
+    int packedLength = LzCompress(text, sizeof(text), packed, sizeof(packed));
+    TEST_ASSERT_TRUE(packedLength > 0);
+    TEST_ASSERT_TRUE(packedLength < 100);
+    TEST_ASSERT_EQUAL_INT(sizeof(text), LzDecompress(packed, packedLength, unpacked, sizeof(unpacked)));
+    TEST_ASSERT_EQUAL_MEMORY(text, unpacked, sizeof(text));
+
+    // Truncated streams are rejected instead of overrunning
+    TEST_ASSERT_EQUAL_INT(-1, LzDecompress(packed, packedLength / 2, unpacked, sizeof(unpacked)));
+}
+
+void test_CopyFile_CompressesWhenEnabled(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+
+    // A 3-block text file written raw, then copied with compression on
+    unsigned char text[3 * BLOCK_SIZE];
+    for (int i = 0; i < (int)sizeof(text); i++)
+        text[i] = "lorem ipsum dolor "[i % 18];
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "src", ""));
+    EXT_SIMPLE_INODE *src = &inodes.inodes[directory[FindFile(directory, &inodes, "src")].inode];
+    src->file_size = sizeof(text);
+    TEST_ASSERT_EQUAL_INT(0, WriteFileContent(&superBlock, &byteMaps, data, src, text, sizeof(text)));
+    TEST_ASSERT_EQUAL_UINT16(INODE_CODEC_RAW, src->codec);
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 3, superBlock.free_blocks);
+
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "compress", "on"));
+    TEST_ASSERT_EQUAL_INT(0, CopyFile(directory, &inodes, &byteMaps, &superBlock, data, "src", "dst", tempFile));
+
+    // A source that cannot be read back fails the copy without taking an inode
+    unsigned int freeInodes = superBlock.free_inodes;
+    src->file_size = sizeof(text) + 1;
+    TEST_ASSERT_EQUAL_INT(-1, CopyFile(directory, &inodes, &byteMaps, &superBlock, data, "src", "bad", tempFile));
+    TEST_ASSERT_EQUAL_INT(-1, FindFile(directory, &inodes, "bad"));
+    TEST_ASSERT_EQUAL_UINT(freeInodes, superBlock.free_inodes);
+    src->file_size = sizeof(text);
+    fclose(tempFile);
+
+    EXT_SIMPLE_INODE *dst = &inodes.inodes[directory[FindFile(directory, &inodes, "dst")].inode];
+    TEST_ASSERT_EQUAL_UINT16(INODE_CODEC_LZ, dst->codec);
+    TEST_ASSERT_EQUAL_UINT16(NULL_BLOCK, dst->block_numbers[1]);
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 4, superBlock.free_blocks);
+
+    // Read twice: decoded, then served from the decompression cache
+    unsigned char content[MAX_FILE_SIZE];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        TEST_ASSERT_EQUAL_INT(sizeof(text), ReadFileContent(dst, data, content));
+        TEST_ASSERT_EQUAL_MEMORY(text, content, sizeof(text));
+    }
+}
+
+void test_EstimateEntropy_SeparatesTextFromNoise(void)
+{
+    unsigned char buffer[4096];
+    unsigned int seed = 12345;
+    for (int i = 0; i < (int)sizeof(buffer); i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        buffer[i] = (unsigned char)(seed >> 16);
+    }
+    TEST_ASSERT_TRUE(EstimateEntropy(buffer, sizeof(buffer)) > 7 * 256);
+
+    memset(buffer, 'a', sizeof(buffer));
+    TEST_ASSERT_EQUAL_UINT(0, EstimateEntropy(buffer, sizeof(buffer)));
+}
+
+void test_Crc32c_KnownVectorAndFallback(void)
+{
+    TEST_ASSERT_EQUAL_HEX32(0xE3069283, Crc32c("123456789", 9));
+    TEST_ASSERT_EQUAL_HEX32(0xE3069283, Crc32cSoftware("123456789", 9));
+
+    // Hardware and slicing-by-8 paths agree, including the byte-wise tails
+    unsigned char buffer[BLOCK_SIZE + 7];
+    for (int i = 0; i < (int)sizeof(buffer); i++)
+        buffer[i] = (unsigned char)(i * 31 + 7);
+    for (int length = 0; length <= (int)sizeof(buffer); length += 13)
+        TEST_ASSERT_EQUAL_HEX32(Crc32cSoftware(buffer, length), Crc32c(buffer, length));
+}
+
+void test_VerifyChecksums_DetectsCorruptedBlock(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "checksums", "on"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "f", "payload"));
+    UpdateMetadataChecksums(&superBlock, &byteMaps, &inodes, directory);
+    TEST_ASSERT_EQUAL_INT(0, VerifyChecksums(&superBlock, &byteMaps, &inodes, directory, data, ALL_REGIONS));
+    TEST_ASSERT_EQUAL_INT(0, PrintFile(directory, &inodes, &superBlock, data, "f", 0, PRINT_TO_END));
+
+    // Flip one byte of the file's block
+    int blockNum = inodes.inodes[directory[FindFile(directory, &inodes, "f")].inode].block_numbers[0];
+    data[blockNum - FIRST_DATA_BLOCK].data[3] ^= 0x20;
+    TEST_ASSERT_EQUAL_INT(-1, VerifyDataChecksum(&superBlock, data, blockNum));
+    TEST_ASSERT_EQUAL_INT(1, VerifyChecksums(&superBlock, &byteMaps, &inodes, directory, data, ALL_REGIONS));
+    TEST_ASSERT_EQUAL_INT(-1, PrintFile(directory, &inodes, &superBlock, data, "f", 0, PRINT_TO_END));
+}
+
+void test_CheckFilesystem_DetectsAndRepairsLeaks(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "first"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "second"));
+    TEST_ASSERT_EQUAL_INT(0, CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 0));
+
+    // Drop b's directory entry: its inode and block leak, as when CreateFile finds no slot
+    int b = FindFile(directory, &inodes, "b");
+    directory[b].inode = NULL_INODE;
+    // Make 'a' claim its own block twice without bumping the count
+    EXT_SIMPLE_INODE *a = &inodes.inodes[directory[FindFile(directory, &inodes, "a")].inode];
+    a->block_numbers[1] = a->block_numbers[0];
+    a->file_size = BLOCK_SIZE + 1;
+
+    TEST_ASSERT_TRUE(CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 0) >= 3);
+    TEST_ASSERT_TRUE(CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 1) >= 3);
+    TEST_ASSERT_EQUAL_INT(0, CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 0));
+    TEST_ASSERT_EQUAL_UINT(MAX_INODES - 4, superBlock.free_inodes);
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 1, superBlock.free_blocks);
+
+    // A size past the blocks present is cut back to them
+    a->file_size = 3 * BLOCK_SIZE;
+    TEST_ASSERT_EQUAL_INT(1, CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 1));
+    TEST_ASSERT_EQUAL_UINT(2 * BLOCK_SIZE, a->file_size);
+    TEST_ASSERT_EQUAL_INT(0, CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 0));
+
+    // Blocks past the size are released, the rest moved to the front
+    char longText[3 * BLOCK_SIZE];
+    memset(longText, 'c', sizeof(longText) - 1);
+    longText[sizeof(longText) - 1] = '\0';
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "c", longText));
+    EXT_SIMPLE_INODE *c = &inodes.inodes[directory[FindFile(directory, &inodes, "c")].inode];
+    int second = c->block_numbers[1];
+    c->block_numbers[0] = NULL_BLOCK;
+    c->file_size = 1;
+    TEST_ASSERT_TRUE(CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 1) >= 2);
+    TEST_ASSERT_EQUAL_INT(second, c->block_numbers[0]);
+    TEST_ASSERT_EQUAL_INT(NULL_BLOCK, c->block_numbers[1]);
+    TEST_ASSERT_EQUAL_INT(0, CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 0));
+    TEST_ASSERT_EQUAL_UINT(MAX_DATA_BLOCKS - 2, superBlock.free_blocks);
+}
+
+void test_MountFilesystem_ChecksOnlyAfterUncleanShutdown(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+
+    // No recorded state: full check
+    SaveAllChanges(directory, &inodes, &byteMaps, &superBlock, data, tempFile);
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+    TEST_ASSERT_EQUAL_INT(2, MountFilesystem(directory, &inodes, &byteMaps, &superBlock, data, tempFile));
+
+    // A new block is logged in its region
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "x"));
+    int block = inodes.inodes[directory[FindFile(directory, &inodes, "a")].inode].block_numbers[0];
+    TEST_ASSERT_TRUE(superBlock.dirty_regions & (1u << (block / DIRTY_REGION_BLOCKS)));
+
+    // Clean unmount: the next mount skips validation
+    UnmountFilesystem(directory, &inodes, &byteMaps, &superBlock, data, tempFile);
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+    TEST_ASSERT_EQUAL_UINT(FS_STATE_CLEAN, superBlock.fs_state);
+    TEST_ASSERT_EQUAL_INT(0, MountFilesystem(directory, &inodes, &byteMaps, &superBlock, data, tempFile));
+
+    // Crash while mounted: the mount marked the image dirty, so the next one is incremental
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+    TEST_ASSERT_EQUAL_UINT(FS_STATE_DIRTY, superBlock.fs_state);
+    TEST_ASSERT_EQUAL_INT(1, MountFilesystem(directory, &inodes, &byteMaps, &superBlock, data, tempFile));
+    TEST_ASSERT_EQUAL_INT(1, FindFile(directory, &inodes, "a") >= 0);
+    fclose(tempFile);
+}
+
+void test_DefragmentFilesystem_MakesFilesContiguous(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    char content[BLOCK_SIZE + 11];
+    unsigned char buffer[MAX_FILE_SIZE];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+
+    // a takes block 4, b block 5; after removing a, c gets blocks 4 and 6
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "gone"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "stays"));
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "a"));
+    memset(content, 'c', BLOCK_SIZE);
+    strcpy(content + BLOCK_SIZE, "tail");
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "c", content));
+    EXT_SIMPLE_INODE *c = &inodes.inodes[directory[FindFile(directory, &inodes, "c")].inode];
+    EXT_SIMPLE_INODE *b = &inodes.inodes[directory[FindFile(directory, &inodes, "b")].inode];
+    TEST_ASSERT_EQUAL_UINT(6, c->block_numbers[1]);
+
+    // A budget of one move stops early; the next pass finishes the job
+    TEST_ASSERT_EQUAL_INT(1, DefragmentFilesystem(&superBlock, &byteMaps, &inodes, directory, data, 1));
+    TEST_ASSERT_EQUAL_INT(0, DefragmentFilesystem(&superBlock, &byteMaps, &inodes, directory, data, 0));
+
+    // Entry order is c (reused slot) then b
+    TEST_ASSERT_EQUAL_UINT(4, c->block_numbers[0]);
+    TEST_ASSERT_EQUAL_UINT(5, c->block_numbers[1]);
+    TEST_ASSERT_EQUAL_UINT(6, b->block_numbers[0]);
+    TEST_ASSERT_EQUAL_INT((int)strlen(content), ReadFileContent(c, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY(content, buffer, strlen(content));
+    TEST_ASSERT_EQUAL_INT(5, ReadFileContent(b, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("stays", buffer, 5);
+    TEST_ASSERT_EQUAL_INT(0, CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 0));
+}
+
+/* Reads the file's content from a freshly loaded copy of the image */
+static void AssertFileOnImage(FILE *image, const char *name, const char *expected)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char buffer[MAX_FILE_SIZE];
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(image, &superBlock, &byteMaps, &inodes, directory, data));
+    int fileIndex = FindFile(directory, &inodes, (char *)name);
+    TEST_ASSERT_NOT_EQUAL(-1, fileIndex);
+    TEST_ASSERT_EQUAL_INT((int)strlen(expected), ReadFileContent(&inodes.inodes[directory[fileIndex].inode], data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY(expected, buffer, strlen(expected));
+}
+
+void test_DefragmentFilesystem_NeverEvictsMovesAheadOfTheInodes(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    char content[BLOCK_SIZE + 11];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 20, MAX_INODES));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+
+    // c ends up in blocks 4 and 6 around b, as in the defrag test above
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "gone"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "stays"));
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "a"));
+    memset(content, 'c', BLOCK_SIZE);
+    strcpy(content + BLOCK_SIZE, "tail");
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "c", content));
+    SaveAllChanges(directory, &inodes, &byteMaps, &superBlock, data, tempFile);
+
+    // Swapped blocks stay in the cache until their inodes are saved
+    TEST_ASSERT_EQUAL_INT(1, DefragmentFilesystem(&superBlock, &byteMaps, &inodes, directory, data, 1));
+    SetBlockCacheBudget(1);
+    TrimBlockCache(&superBlock, &byteMaps, data);
+    AssertFileOnImage(tempFile, "b", "stays");
+    AssertFileOnImage(tempFile, "c", content);
+
+    // In batch mode the defrag command saves right away, before anything is evicted
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+    fsRuntime->terse = 1;
+    fsRuntime->commitInterval = -1;
+    TEST_ASSERT_EQUAL_INT(0, ProcessCommand("defrag", "", "", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    TEST_ASSERT_EQUAL_INT(0, fsRuntime->uncommittedChanges);
+    TrimBlockCache(&superBlock, &byteMaps, data);
+    AssertFileOnImage(tempFile, "b", "stays");
+    AssertFileOnImage(tempFile, "c", content);
+
+    fsRuntime->terse = 0;
+    fsRuntime->commitInterval = 0;
+    SetBlockCacheBudget(0);
+    fclose(tempFile);
+}
+
+void test_CollectFragStats_ReportsRunsAndExtents(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    FRAG_STATS stats;
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+
+    // Blocks 4, 5, 6 used; freeing 5 leaves a one-block hole
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "1"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "2"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "c", "3"));
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "b"));
+    // Give 'a' a second block past the hole: 4, 7
+    EXT_SIMPLE_INODE *a = &inodes.inodes[directory[FindFile(directory, &inodes, "a")].inode];
+    a->block_numbers[1] = 7;
+    byteMaps.block_bytemap[7] = 1;
+
+    CollectFragStats(&superBlock, &byteMaps, &inodes, directory, &stats);
+    TEST_ASSERT_EQUAL_INT(MAX_PARTITION_BLOCKS - 7, stats.freeBlocks);
+    TEST_ASSERT_EQUAL_INT(2, stats.freeExtents);
+    TEST_ASSERT_EQUAL_INT(MAX_PARTITION_BLOCKS - 8, stats.largestFreeRun);
+    TEST_ASSERT_EQUAL_INT(1, stats.freeRunHistogram[0]);
+    TEST_ASSERT_EQUAL_INT(1, stats.freeRunHistogram[6]);
+    TEST_ASSERT_EQUAL_INT(2, CountFileExtents(a));
+    TEST_ASSERT_EQUAL_INT(2, stats.files);
+    TEST_ASSERT_EQUAL_INT(3, stats.fileExtents);
+
+    // U5 F1 U2 F92
+    TEST_ASSERT_EQUAL_INT(4, stats.runCount);
+    TEST_ASSERT_EQUAL_INT(1, stats.firstRunUsed);
+    TEST_ASSERT_EQUAL_UINT(5, stats.runLengths[0]);
+    TEST_ASSERT_EQUAL_UINT(1, stats.runLengths[1]);
+    TEST_ASSERT_EQUAL_UINT(2, stats.runLengths[2]);
+    TEST_ASSERT_EQUAL_UINT(MAX_PARTITION_BLOCKS - 8, stats.runLengths[3]);
+}
+
+void test_FormatFilesystem_WritesMountableEmptyImage(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+
+    TEST_ASSERT_EQUAL_INT(-1, FormatFilesystem(tempFile, MAX_PARTITION_BLOCKS + 1, MAX_INODES));
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 8, 5));
+    fseek(tempFile, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(8 * BLOCK_SIZE, ftell(tempFile));
+
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+    TEST_ASSERT_EQUAL_UINT(8, superBlock.total_blocks);
+    TEST_ASSERT_EQUAL_UINT(4, superBlock.free_blocks);
+    TEST_ASSERT_EQUAL_UINT(2, superBlock.free_inodes);
+    TEST_ASSERT_EQUAL_INT(0, FindFile(directory, &inodes, "."));
+    TEST_ASSERT_EQUAL_INT(0, CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 0));
+
+    // The geometry bounds allocation: two inodes, four data blocks
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "1"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "2"));
+    TEST_ASSERT_EQUAL_INT(-1, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "c", "3"));
+    SaveAllChanges(directory, &inodes, &byteMaps, &superBlock, data, tempFile);
+    fseek(tempFile, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(8 * BLOCK_SIZE, ftell(tempFile));
+    fclose(tempFile);
+}
+
+void test_ResizeFilesystem_GrowsAndShrinksOnline(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char buffer[MAX_FILE_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 6, MAX_INODES));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+
+    TEST_ASSERT_EQUAL_INT(0, ResizeFilesystem(&superBlock, &byteMaps, &inodes, directory, data, 10, tempFile));
+    TEST_ASSERT_EQUAL_UINT(10, superBlock.total_blocks);
+    TEST_ASSERT_EQUAL_UINT(6, superBlock.free_blocks);
+    fseek(tempFile, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(10 * BLOCK_SIZE, ftell(tempFile));
+
+    // Fill blocks 4-8, then free 4-6 so 'keep' (in block 8) lies in the tail of a 7-block partition
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "1"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "2"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "c", "3"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "d", "4"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "keep", "tail"));
+    TEST_ASSERT_EQUAL_INT(-1, ResizeFilesystem(&superBlock, &byteMaps, &inodes, directory, data, 7, tempFile));
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "a"));
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "b"));
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "c"));
+
+    TEST_ASSERT_EQUAL_INT(0, ResizeFilesystem(&superBlock, &byteMaps, &inodes, directory, data, 7, tempFile));
+    EXT_SIMPLE_INODE *keep = &inodes.inodes[directory[FindFile(directory, &inodes, "keep")].inode];
+    TEST_ASSERT_TRUE(keep->block_numbers[0] < 7);
+    TEST_ASSERT_EQUAL_INT(4, ReadFileContent(keep, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("tail", buffer, 4);
+    TEST_ASSERT_EQUAL_UINT(1, superBlock.free_blocks);
+    TEST_ASSERT_EQUAL_INT(0, CheckFilesystem(&superBlock, &byteMaps, &inodes, directory, ALL_REGIONS, 0));
+    fseek(tempFile, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(7 * BLOCK_SIZE, ftell(tempFile));
+
+    // The moved block and its inode reached the image before the file was cut
+    AssertFileOnImage(tempFile, "keep", "tail");
+    fclose(tempFile);
+}
+
+void test_FlushDiscards_PunchesFreedBlocks(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    char content[BLOCK_SIZE + 2];
+    unsigned char block[BLOCK_SIZE];
+    unsigned char zeros[BLOCK_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 20, MAX_INODES));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+
+    memset(content, 'x', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "big", content));
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "discard", "on"));
+    FlushDiscards(&byteMaps, tempFile); // the blocks free before 'set discard on'
+    SaveAllChanges(directory, &inodes, &byteMaps, &superBlock, data, tempFile);
+
+    // Deleting queues both blocks; they go in one call, and read back as zeros
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "big"));
+    SaveData(&superBlock, &byteMaps, data, tempFile);
+#ifdef __linux__
+    TEST_ASSERT_EQUAL_INT(2, FlushDiscards(&byteMaps, tempFile));
+    memset(zeros, 0, sizeof(zeros));
+    fseek(tempFile, FIRST_DATA_BLOCK * BLOCK_SIZE, SEEK_SET);
+    TEST_ASSERT_EQUAL_INT(1, (int)fread(block, BLOCK_SIZE, 1, tempFile));
+    TEST_ASSERT_EQUAL_MEMORY(zeros, block, BLOCK_SIZE);
+#endif
+    TEST_ASSERT_EQUAL_INT(0, FlushDiscards(&byteMaps, tempFile));
+    fseek(tempFile, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(20 * BLOCK_SIZE, ftell(tempFile));
+    fclose(tempFile);
+}
+
+void test_SaveData_StoresZeroBlocksAsHoles(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char block[BLOCK_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 8, MAX_INODES));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+
+    memset(block, 0, sizeof(block));
+    TEST_ASSERT_TRUE(IsZeroBlock(block));
+    block[BLOCK_SIZE - 1] = 1;
+    TEST_ASSERT_FALSE(IsZeroBlock(block));
+
+    // Block 4 was written with data, then becomes all zeros: it must read back as zeros
+    byteMaps.block_bytemap[4] = 1;
+    byteMaps.block_bytemap[5] = 1;
+    memset(WriteDataBlock(data, 4), 0xAB, BLOCK_SIZE);
+    memset(WriteDataBlock(data, 5), 0xCD, BLOCK_SIZE);
+    SaveData(&superBlock, &byteMaps, data, tempFile);
+    memset(WriteDataBlock(data, 4), 0, BLOCK_SIZE);
+    unsigned long long elided = fsRuntime->stats.zeroBlocksElided;
+    SaveData(&superBlock, &byteMaps, data, tempFile);
+
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+    TEST_ASSERT_TRUE(IsZeroBlock(data[0].data));
+    TEST_ASSERT_EQUAL_UINT8(0xCD, data[1].data[BLOCK_SIZE - 1]);
+#ifdef __linux__
+    TEST_ASSERT_EQUAL_UINT64(elided + 1, fsRuntime->stats.zeroBlocksElided);
+#endif
+    fclose(tempFile);
+}
+
+void test_BlockCache_EvictsToBudgetAndFaultsBackIn(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char buffer[MAX_FILE_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 20, MAX_INODES));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "alpha"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "bravo"));
+    TEST_ASSERT_TRUE(IsBlockModified(4));
+
+    // The clock sweep clears the referenced bits of 4 and 5, evicts the free blocks,
+    // then evicts 4, writing back its unsaved contents
+    SetBlockCacheBudget(1);
+    unsigned long long writebacks = fsRuntime->stats.cacheWritebacks;
+    TEST_ASSERT_EQUAL_INT(1, TrimBlockCache(&superBlock, &byteMaps, data));
+    TEST_ASSERT_EQUAL_UINT64(writebacks + 1, fsRuntime->stats.cacheWritebacks);
+
+    // 'a' is faulted back in from the image, 'b' is still resident
+    memset(data[0].data, 0, BLOCK_SIZE);
+    unsigned long long misses = fsRuntime->stats.cacheMisses;
+    EXT_SIMPLE_INODE *a = &inodes.inodes[directory[FindFile(directory, &inodes, "a")].inode];
+    EXT_SIMPLE_INODE *b = &inodes.inodes[directory[FindFile(directory, &inodes, "b")].inode];
+    TEST_ASSERT_EQUAL_INT(5, ReadFileContent(a, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("alpha", buffer, 5);
+    TEST_ASSERT_EQUAL_INT(5, ReadFileContent(b, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("bravo", buffer, 5);
+    TEST_ASSERT_EQUAL_UINT64(misses + 1, fsRuntime->stats.cacheMisses);
+
+    // Freed or stray modified blocks are dropped without a write-back
+    unsigned short freed = b->block_numbers[0];
+    TEST_ASSERT_EQUAL_INT(0, DeleteFile(directory, &inodes, &byteMaps, &superBlock, "b"));
+    TEST_ASSERT_FALSE(IsBlockModified(freed));
+    memset(WriteDataBlock(data, 15), 'Z', BLOCK_SIZE);
+    writebacks = fsRuntime->stats.cacheWritebacks;
+    TEST_ASSERT_EQUAL_INT(1, TrimBlockCache(&superBlock, &byteMaps, data));
+    TEST_ASSERT_EQUAL_UINT64(writebacks, fsRuntime->stats.cacheWritebacks);
+    TEST_ASSERT_EQUAL_INT(0, fseek(tempFile, 15L * BLOCK_SIZE, SEEK_SET));
+    TEST_ASSERT_EQUAL_size_t(1, fread(buffer, BLOCK_SIZE, 1, tempFile));
+    TEST_ASSERT_TRUE(buffer[0] != 'Z');
+
+    SetBlockCacheBudget(0);
+    fclose(tempFile);
+}
+
+void test_LoadFilesystemLazy_FaultsDataInOnDemand(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char buffer[MAX_FILE_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 20, MAX_INODES));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "a", "alpha"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "b", "bravo"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "c", "charlie"));
+    SaveAllChanges(directory, &inodes, &byteMaps, &superBlock, data, tempFile);
+
+    // Nothing but metadata is read: the data array keeps whatever it held
+    memset(data, 0xEE, sizeof(data));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystemLazy(tempFile, &superBlock, &byteMaps, &inodes, directory));
+    TEST_ASSERT_EQUAL_UINT8(0xEE, data[0].data[0]);
+
+    unsigned long long misses = fsRuntime->stats.cacheMisses;
+    EXT_SIMPLE_INODE *b = &inodes.inodes[directory[FindFile(directory, &inodes, "b")].inode];
+    TEST_ASSERT_EQUAL_INT(5, ReadFileContent(b, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("bravo", buffer, 5);
+    TEST_ASSERT_EQUAL_UINT64(misses + 1, fsRuntime->stats.cacheMisses);
+
+    // Prefetch reads the other two allocated blocks, then has nothing left to do
+    TEST_ASSERT_EQUAL_INT(2, PrefetchBlocks(&byteMaps, data, 16));
+    TEST_ASSERT_EQUAL_INT(0, PrefetchBlocks(&byteMaps, data, 16));
+    EXT_SIMPLE_INODE *c = &inodes.inodes[directory[FindFile(directory, &inodes, "c")].inode];
+    TEST_ASSERT_EQUAL_INT(7, ReadFileContent(c, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("charlie", buffer, 7);
+    TEST_ASSERT_EQUAL_UINT64(misses + 1, fsRuntime->stats.cacheMisses);
+    fclose(tempFile);
+}
+
+void test_ReadAheadFile_CoalescesSequentialReads(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    char content[3 * BLOCK_SIZE + 1];
+    unsigned char buffer[MAX_FILE_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 20, MAX_INODES));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+    for (int i = 0; i < 3 * BLOCK_SIZE; i++)
+        content[i] = (char)('a' + (i / BLOCK_SIZE));
+    content[3 * BLOCK_SIZE] = '\0';
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "seq", content));
+    SaveAllChanges(directory, &inodes, &byteMaps, &superBlock, data, tempFile);
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystemLazy(tempFile, &superBlock, &byteMaps, &inodes, directory));
+
+    // One miss brings in all three contiguous blocks; the other two are read-ahead hits
+    unsigned long long misses = fsRuntime->stats.cacheMisses;
+    unsigned long long ahead = fsRuntime->stats.readaheadBlocks;
+    unsigned long long used = fsRuntime->stats.readaheadUsed;
+    EXT_SIMPLE_INODE *seq = &inodes.inodes[directory[FindFile(directory, &inodes, "seq")].inode];
+    TEST_ASSERT_EQUAL_INT(3 * BLOCK_SIZE, ReadFileContent(seq, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY(content, buffer, 3 * BLOCK_SIZE);
+    TEST_ASSERT_EQUAL_UINT64(misses + 1, fsRuntime->stats.cacheMisses);
+    TEST_ASSERT_EQUAL_UINT64(ahead + 2, fsRuntime->stats.readaheadBlocks);
+    TEST_ASSERT_EQUAL_UINT64(used + 2, fsRuntime->stats.readaheadUsed);
+    fclose(tempFile);
+}
+
+/* Formats a small image at path for the library tests */
+static void FormatImageFile(const char *path)
+{
+    FILE *file = fopen(path, "w+b");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(file, 20, 8));
+    fclose(file);
+}
+
+void test_Library_MountsIndependentImages(void)
+{
+    EXT_FILESYSTEM *first;
+    EXT_FILESYSTEM *second;
+    unsigned char content[600];
+    unsigned char buffer[MAX_FILE_SIZE];
+    size_t size;
+
+    FormatImageFile("lib_first.bin");
+    FormatImageFile("lib_second.bin");
+    TEST_ASSERT_EQUAL_INT(FS_EIO, fs_mount("lib_missing.bin", 0, &first));
+    TEST_ASSERT_NULL(first);
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_mount("lib_first.bin", 0, &first));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_mount("lib_second.bin", FS_MOUNT_LAZY, &second));
+
+    // Binary content, zeros included, lands only in the image it was written to
+    for (int i = 0; i < (int)sizeof(content); i++)
+        content[i] = (unsigned char)(i % 7);
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_create(first, "blob", content, sizeof(content)));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_create(second, "note", "hi", 2));
+    TEST_ASSERT_EQUAL_INT(FS_ENOENT, fs_stat(second, "blob", &size));
+    TEST_ASSERT_EQUAL_INT(FS_ERANGE, fs_read(first, "blob", buffer, 10, &size));
+    TEST_ASSERT_EQUAL_UINT(sizeof(content), size);
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_read(first, "blob", buffer, sizeof(buffer), &size));
+    TEST_ASSERT_EQUAL_MEMORY(content, buffer, sizeof(content));
+
+    // Failures come back as codes
+    TEST_ASSERT_EQUAL_INT(FS_EEXIST, fs_create(first, "blob", "x", 1));
+    TEST_ASSERT_EQUAL_INT(FS_EINVAL, fs_create(first, "a-name-too-long-for-it", "x", 1));
+    TEST_ASSERT_EQUAL_INT(FS_EFBIG, fs_create(first, "big", buffer, MAX_FILE_SIZE + 1));
+    TEST_ASSERT_EQUAL_INT(FS_EINVAL, fs_remove(first, "."));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_copy(first, "blob", "blob2"));
+    TEST_ASSERT_EQUAL_INT(FS_EEXIST, fs_rename(first, "blob2", "blob"));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_rename(first, "blob2", "copy"));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_remove(first, "blob"));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_unmount(first));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_unmount(second));
+
+    // Changes persist across a remount
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_mount("lib_first.bin", 0, &first));
+    TEST_ASSERT_EQUAL_INT(FS_ENOENT, fs_stat(first, "blob", &size));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_read(first, "copy", buffer, sizeof(buffer), &size));
+    TEST_ASSERT_EQUAL_MEMORY(content, buffer, sizeof(content));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_unmount(first));
+    remove("lib_first.bin");
+    remove("lib_second.bin");
+}
+
+void test_Library_ReadViewsPinTheirBlocks(void)
+{
+    EXT_FILESYSTEM *fs;
+    FS_VIEW *view;
+    const struct iovec *spans;
+    int count;
+    unsigned char content[1200];
+    unsigned char other[1200];
+
+    FormatImageFile("lib_view.bin");
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_mount("lib_view.bin", 0, &fs));
+    for (int i = 0; i < (int)sizeof(content); i++)
+    {
+        content[i] = (unsigned char)(i * 3);
+        other[i] = (unsigned char)~content[i];
+    }
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_create(fs, "blob", content, sizeof(content)));
+
+    // A range across three blocks comes back as spans over the blocks themselves
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_read_view(fs, "blob", 100, 1000, &view, &spans, &count));
+    TEST_ASSERT_GREATER_OR_EQUAL(1, count);
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        TEST_ASSERT_EQUAL_MEMORY(content + 100 + total, spans[i].iov_base, spans[i].iov_len);
+        total += spans[i].iov_len;
+    }
+    TEST_ASSERT_EQUAL_UINT(1000, total);
+
+    // Removing the file and filling the partition does not reuse the pinned blocks
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_remove(fs, "blob"));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_create(fs, "other", other, sizeof(other)));
+    for (int i = 0, offset = 0; i < count; offset += spans[i].iov_len, i++)
+        TEST_ASSERT_EQUAL_MEMORY(content + 100 + offset, spans[i].iov_base, spans[i].iov_len);
+    TEST_ASSERT_EQUAL_INT(FS_EBUSY, fs_unmount(fs));
+
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_release_view(view));
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_read_view(fs, "other", sizeof(other) + 5, 10, &view, &spans, &count));
+    TEST_ASSERT_EQUAL_INT(0, count);
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_release_view(view));
+    TEST_ASSERT_EQUAL_INT(FS_ENOENT, fs_read_view(fs, "blob", 0, 10, &view, &spans, &count));
+    TEST_ASSERT_NULL(view);
+    TEST_ASSERT_EQUAL_INT(FS_OK, fs_unmount(fs));
+    remove("lib_view.bin");
+}
+
+void test_ProcessCommand_DefersSavesInBatchMode(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    fsRuntime->terse = 1;
+    fsRuntime->commitInterval = 2;
+
+    // The first change is only counted, the second one saves both
+    TEST_ASSERT_EQUAL_INT(0, ProcessCommand("create", "a", "one", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    fseek(tempFile, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT(0, ftell(tempFile));
+    TEST_ASSERT_EQUAL_INT(1, fsRuntime->uncommittedChanges);
+    TEST_ASSERT_EQUAL_INT(0, ProcessCommand("rename", "a", "b", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    TEST_ASSERT_EQUAL_INT(0, fsRuntime->uncommittedChanges);
+    fseek(tempFile, 0, SEEK_END);
+    TEST_ASSERT_TRUE(ftell(tempFile) >= FIRST_DATA_BLOCK * BLOCK_SIZE);
+
+    // Failures are reported to the caller and change nothing
+    TEST_ASSERT_EQUAL_INT(-1, ProcessCommand("remove", "a", "", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    TEST_ASSERT_EQUAL_INT(-1, ProcessCommand("bogus", "", "", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    TEST_ASSERT_EQUAL_INT(0, fsRuntime->uncommittedChanges);
+    TEST_ASSERT_EQUAL_INT(COMMAND_EXIT, ProcessCommand("exit", "", "", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+
+    fsRuntime->terse = 0;
+    fsRuntime->commitInterval = 0;
+    fclose(tempFile);
+}
+
+void test_ProcessCommand_PutStreamsContentFromInput(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char buffer[MAX_FILE_SIZE];
+    char line[32];
+    FILE *tempFile = tmpfile();
+    FILE *input = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_NOT_NULL(input);
+
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    for (int i = 0; i < 1500; i++)
+        fputc('a' + i % 26, input);
+    fputs("two\nlines\nEND\nnext\n", input);
+    rewind(input);
+    fsRuntime->commandInput = input;
+
+    // Length-prefixed: 1500 bytes over three blocks
+    TEST_ASSERT_EQUAL_INT(0, ProcessCommand("put", "big", "1500", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    int fileIndex = FindFile(directory, &inodes, "big");
+    TEST_ASSERT_NOT_EQUAL(-1, fileIndex);
+    EXT_SIMPLE_INODE *inode = &inodes.inodes[directory[fileIndex].inode];
+    TEST_ASSERT_EQUAL_UINT(1500, inode->file_size);
+    TEST_ASSERT_EQUAL_INT(NULL_BLOCK, inode->block_numbers[3]);
+    TEST_ASSERT_EQUAL_INT(1500, ReadFileContent(inode, data, buffer));
+    TEST_ASSERT_EQUAL_UINT8('a' + 1499 % 26, buffer[1499]);
+
+    // Heredoc: lines up to the terminator, which is consumed too
+    TEST_ASSERT_EQUAL_INT(0, ProcessCommand("put", "small", "<<END", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    fileIndex = FindFile(directory, &inodes, "small");
+    TEST_ASSERT_EQUAL_INT(10, ReadFileContent(&inodes.inodes[directory[fileIndex].inode], data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("two\nlines\n", buffer, 10);
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), input));
+    TEST_ASSERT_EQUAL_STRING("next\n", line);
+
+    // A payload that ends early leaves nothing behind
+    unsigned int freeBlocks = superBlock.free_blocks;
+    TEST_ASSERT_EQUAL_INT(-1, ProcessCommand("put", "cut", "100", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    TEST_ASSERT_EQUAL_INT(-1, FindFile(directory, &inodes, "cut"));
+    TEST_ASSERT_EQUAL_UINT(freeBlocks, superBlock.free_blocks);
+
+    fsRuntime->commandInput = NULL;
+    fclose(input);
+    fclose(tempFile);
+}
+
+void test_WriteFileRange_TouchesOnlyTheAffectedBlocks(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char content[3 * BLOCK_SIZE];
+    unsigned char buffer[MAX_FILE_SIZE];
+    FILE *tempFile = tmpfile();
+    FILE *input = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_NOT_NULL(input);
+
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "dedup", "on"));
+    memset(content, 'x', sizeof(content));
+    TEST_ASSERT_EQUAL_INT(0, CreateFileFromBuffer(directory, &inodes, &byteMaps, &superBlock, data, "log", content, 2 * BLOCK_SIZE + 10));
+    TEST_ASSERT_EQUAL_INT(0, CopyFile(directory, &inodes, &byteMaps, &superBlock, data, "log", "snap", tempFile));
+    EXT_SIMPLE_INODE *log = &inodes.inodes[directory[FindFile(directory, &inodes, "log")].inode];
+    EXT_SIMPLE_INODE *snap = &inodes.inodes[directory[FindFile(directory, &inodes, "snap")].inode];
+
+    // Blocks 0 and 1 hold the same bytes, so all three are shared (one of them twice)
+    unsigned short shared = log->block_numbers[0];
+    unsigned short tail = log->block_numbers[2];
+    TEST_ASSERT_EQUAL_UINT8(4, byteMaps.block_bytemap[shared]);
+
+    // Writing into a shared block copies just that block; the copy keeps the old bytes
+    TEST_ASSERT_EQUAL_INT(0, WriteFileRange(directory, &inodes, &byteMaps, &superBlock, data, "log", 5, (const unsigned char *)"AB", 2));
+    TEST_ASSERT_NOT_EQUAL(shared, log->block_numbers[0]);
+    TEST_ASSERT_EQUAL_UINT16(shared, log->block_numbers[1]);
+    TEST_ASSERT_EQUAL_UINT8(3, byteMaps.block_bytemap[shared]);
+    TEST_ASSERT_EQUAL_INT(2 * BLOCK_SIZE + 10, ReadFileContent(log, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("xxxxxAB", buffer, 7);
+    TEST_ASSERT_EQUAL_INT(2 * BLOCK_SIZE + 10, ReadFileContent(snap, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("xxxxxxx", buffer, 7);
+
+    // A block only this file uses changes in place
+    unsigned short own = log->block_numbers[0];
+    TEST_ASSERT_EQUAL_INT(0, WriteFileRange(directory, &inodes, &byteMaps, &superBlock, data, "log", 0, (const unsigned char *)"C", 1));
+    TEST_ASSERT_EQUAL_UINT16(own, log->block_numbers[0]);
+
+    // Appending a record through the command fills the shared tail block's copy and then a new block
+    for (int i = 0; i < 600; i++)
+        fputc('r', input);
+    rewind(input);
+    fsRuntime->commandInput = input;
+    TEST_ASSERT_EQUAL_INT(0, ProcessCommand("append", "log", "600", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    TEST_ASSERT_EQUAL_UINT(3 * BLOCK_SIZE + 98, log->file_size);
+    TEST_ASSERT_EQUAL_UINT16(tail, snap->block_numbers[2]);
+    TEST_ASSERT_NOT_EQUAL(tail, log->block_numbers[2]);
+    TEST_ASSERT_NOT_EQUAL(NULL_BLOCK, log->block_numbers[3]);
+    TEST_ASSERT_EQUAL_INT(3 * BLOCK_SIZE + 98, ReadFileContent(log, data, buffer));
+    TEST_ASSERT_EQUAL_UINT8('x', buffer[2 * BLOCK_SIZE + 9]);
+    TEST_ASSERT_EQUAL_UINT8('r', buffer[2 * BLOCK_SIZE + 10]);
+    TEST_ASSERT_EQUAL_UINT8('r', buffer[3 * BLOCK_SIZE + 97]);
+
+    // A write past the end leaves zeros in the gap; one past the size limit changes nothing
+    TEST_ASSERT_EQUAL_INT(0, WriteFileRange(directory, &inodes, &byteMaps, &superBlock, data, "log", 4 * BLOCK_SIZE + 2, (const unsigned char *)"Z", 1));
+    TEST_ASSERT_EQUAL_INT(4 * BLOCK_SIZE + 3, ReadFileContent(log, data, buffer));
+    TEST_ASSERT_EQUAL_UINT8(0, buffer[3 * BLOCK_SIZE + 98]);
+    TEST_ASSERT_EQUAL_UINT8('Z', buffer[4 * BLOCK_SIZE + 2]);
+    TEST_ASSERT_EQUAL_INT(-1, WriteFileRange(directory, &inodes, &byteMaps, &superBlock, data, "log", MAX_FILE_SIZE, (const unsigned char *)"Z", 1));
+    TEST_ASSERT_EQUAL_UINT(4 * BLOCK_SIZE + 3, log->file_size);
+
+    // Truncating returns the tail blocks to the bytemap and zeroes the cut end of the last one
+    unsigned short dropped = log->block_numbers[4];
+    unsigned int freeBlocks = superBlock.free_blocks;
+    TEST_ASSERT_EQUAL_INT(0, ProcessCommand("truncate", "log", "1000", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+    TEST_ASSERT_EQUAL_UINT(1000, log->file_size);
+    TEST_ASSERT_EQUAL_INT(NULL_BLOCK, log->block_numbers[2]);
+    TEST_ASSERT_EQUAL_UINT8(0, byteMaps.block_bytemap[dropped]);
+    TEST_ASSERT_EQUAL_UINT(freeBlocks + 3, superBlock.free_blocks);
+    TEST_ASSERT_EQUAL_INT(2 * BLOCK_SIZE + 10, ReadFileContent(snap, data, buffer));
+    TEST_ASSERT_EQUAL_INT(-1, ProcessCommand("truncate", "missing", "0", &superBlock, &byteMaps, &inodes, directory, data, tempFile));
+
+    // Growing a compressed file adds zeros after its content
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "compress", "on"));
+    memset(content, 'z', sizeof(content));
+    TEST_ASSERT_EQUAL_INT(0, CreateFileFromBuffer(directory, &inodes, &byteMaps, &superBlock, data, "packed", content, 2 * BLOCK_SIZE));
+    EXT_SIMPLE_INODE *packed = &inodes.inodes[directory[FindFile(directory, &inodes, "packed")].inode];
+    TEST_ASSERT_EQUAL_INT(INODE_CODEC_LZ, packed->codec);
+    TEST_ASSERT_EQUAL_INT(0, TruncateFile(directory, &inodes, &byteMaps, &superBlock, data, "packed", 2 * BLOCK_SIZE + 5));
+    TEST_ASSERT_EQUAL_INT(2 * BLOCK_SIZE + 5, ReadFileContent(packed, data, buffer));
+    TEST_ASSERT_EQUAL_UINT8('z', buffer[2 * BLOCK_SIZE - 1]);
+    TEST_ASSERT_EQUAL_UINT8(0, buffer[2 * BLOCK_SIZE + 4]);
+
+    // A corrupt block list is refused before any block is looked at
+    log->block_numbers[1] = NULL_BLOCK;
+    TEST_ASSERT_EQUAL_INT(-1, WriteFileRange(directory, &inodes, &byteMaps, &superBlock, data, "log", 0, (const unsigned char *)"C", 1));
+    TEST_ASSERT_EQUAL_INT(-1, TruncateFile(directory, &inodes, &byteMaps, &superBlock, data, "log", 10));
+    TEST_ASSERT_EQUAL_UINT(1000, log->file_size);
+
+    fsRuntime->commandInput = NULL;
+    fclose(input);
+    fclose(tempFile);
+}
+
+void test_ImportExport_CopiesHostFilesAroundTheCache(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char content[1300];
+    unsigned char buffer[MAX_FILE_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 30, 8));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+
+    for (int i = 0; i < (int)sizeof(content); i++)
+        content[i] = (unsigned char)(i * 7);
+    FILE *host = fopen("import_src.bin", "wb");
+    TEST_ASSERT_NOT_NULL(host);
+    fwrite(content, 1, sizeof(content), host);
+    fclose(host);
+
+    // Direct import: one contiguous run, written to the image, not to memory
+    unsigned long long copiedBefore = fsRuntime->stats.bytesCopiedInKernel + fsRuntime->stats.bytesCopiedBuffered;
+    TEST_ASSERT_EQUAL_INT(0, ImportFile(directory, &inodes, &byteMaps, &superBlock, data, "import_src.bin", "art", tempFile));
+    TEST_ASSERT_EQUAL_UINT64(copiedBefore + sizeof(content) + 0ULL,
+                             fsRuntime->stats.bytesCopiedInKernel + fsRuntime->stats.bytesCopiedBuffered);
+    EXT_SIMPLE_INODE *inode = &inodes.inodes[directory[FindFile(directory, &inodes, "art")].inode];
+    TEST_ASSERT_EQUAL_UINT(sizeof(content), inode->file_size);
+    TEST_ASSERT_EQUAL_INT(inode->block_numbers[0] + 2, inode->block_numbers[2]);
+    TEST_ASSERT_FALSE(IsBlockModified(inode->block_numbers[0]));
+    TEST_ASSERT_EQUAL_INT(sizeof(content), ReadFileContent(inode, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY(content, buffer, sizeof(content));
+    TEST_ASSERT_EQUAL_INT(-1, ImportFile(directory, &inodes, &byteMaps, &superBlock, data, "import_src.bin", "art", tempFile));
+
+    // Export of clean blocks from the image, and of a file only in memory
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "memo", "unsaved"));
+    TEST_ASSERT_EQUAL_INT(0, ExportFile(directory, &inodes, &superBlock, data, "art", "export_art.bin", tempFile));
+    TEST_ASSERT_EQUAL_INT(0, ExportFile(directory, &inodes, &superBlock, data, "memo", "export_memo.txt", tempFile));
+    host = fopen("export_art.bin", "rb");
+    TEST_ASSERT_NOT_NULL(host);
+    TEST_ASSERT_EQUAL_INT(sizeof(content), fread(buffer, 1, sizeof(buffer), host));
+    TEST_ASSERT_EQUAL_MEMORY(content, buffer, sizeof(content));
+    fclose(host);
+    host = fopen("export_memo.txt", "rb");
+    TEST_ASSERT_NOT_NULL(host);
+    TEST_ASSERT_EQUAL_INT(7, fread(buffer, 1, sizeof(buffer), host));
+    TEST_ASSERT_EQUAL_MEMORY("unsaved", buffer, 7);
+    fclose(host);
+
+    remove("import_src.bin");
+    remove("export_art.bin");
+    remove("export_memo.txt");
+    fclose(tempFile);
+    ResetBlockCache(NULL, 1);
+}
+
+void test_ImportTree_ImportsEveryFileUnderADirectory(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char buffer[MAX_FILE_SIZE];
+    FILE *tempFile = tmpfile();
+    TEST_ASSERT_NOT_NULL(tempFile);
+    TEST_ASSERT_EQUAL_INT(0, FormatFilesystem(tempFile, 30, 8));
+    TEST_ASSERT_EQUAL_INT(0, LoadFilesystem(tempFile, &superBlock, &byteMaps, &inodes, directory, data));
+
+    const char *paths[] = {"import_tree/one", "import_tree/sub/two", "import_tree/sub/three"};
+    const size_t sizes[] = {600, 5, 1100};
+    mkdir("import_tree", 0755);
+    mkdir("import_tree/sub", 0755);
+    for (int i = 0; i < 3; i++)
+    {
+        FILE *host = fopen(paths[i], "wb");
+        TEST_ASSERT_NOT_NULL(host);
+        for (size_t b = 0; b < sizes[i]; b++)
+            fputc('a' + i, host);
+        fclose(host);
+    }
+
+    int imported;
+    int freeInodes = superBlock.free_inodes;
+    TEST_ASSERT_EQUAL_INT(0, ImportTree(directory, &inodes, &byteMaps, &superBlock, data, "import_tree", tempFile, &imported));
+    TEST_ASSERT_EQUAL_INT(3, imported);
+    TEST_ASSERT_EQUAL_INT(freeInodes - 3, superBlock.free_inodes);
+    const char *names[] = {"one", "two", "three"};
+    for (int i = 0; i < 3; i++)
+    {
+        int index = FindFile(directory, &inodes, (char *)names[i]);
+        TEST_ASSERT_NOT_EQUAL(-1, index);
+        EXT_SIMPLE_INODE *inode = &inodes.inodes[directory[index].inode];
+        TEST_ASSERT_EQUAL_INT(sizes[i], ReadFileContent(inode, data, buffer));
+        TEST_ASSERT_EQUAL_UINT8('a' + i, buffer[0]);
+        TEST_ASSERT_EQUAL_UINT8('a' + i, buffer[sizes[i] - 1]);
+    }
+
+    // Names already taken: nothing is imported and nothing leaks
+    int freeBlocks = superBlock.free_blocks;
+    TEST_ASSERT_EQUAL_INT(-1, ImportTree(directory, &inodes, &byteMaps, &superBlock, data, "import_tree", tempFile, &imported));
+    TEST_ASSERT_EQUAL_INT(0, imported);
+    TEST_ASSERT_EQUAL_INT(freeBlocks, superBlock.free_blocks);
+    TEST_ASSERT_EQUAL_INT(-1, ImportTree(directory, &inodes, &byteMaps, &superBlock, data, "no_such_dir", tempFile, &imported));
+
+    for (int i = 0; i < 3; i++)
+        remove(paths[i]);
+    rmdir("import_tree/sub");
+    rmdir("import_tree");
+    fclose(tempFile);
+    ResetBlockCache(NULL, 1);
+}
+
+void test_Tar_RoundTripsEveryFileAndStopsAtTheEndMarker(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char buffer[MAX_FILE_SIZE];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "plain", "raw content"));
+    TEST_ASSERT_EQUAL_INT(0, SetOption(&superBlock, &byteMaps, data, "compress", "on"));
+    TEST_ASSERT_EQUAL_INT(0, CreateFile(directory, &inodes, &byteMaps, &superBlock, data, "packed",
+                                        "zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz"));
+
+    FILE *archive = tmpfile();
+    TEST_ASSERT_NOT_NULL(archive);
+    int count;
+    TEST_ASSERT_EQUAL_INT(0, ExportTar(directory, &inodes, &superBlock, data, archive, &count));
+    TEST_ASSERT_EQUAL_INT(2, count);
+    TEST_ASSERT_EQUAL_INT(6 * 512, ftell(archive)); // two headers, two data blocks, the end marker...
+    fputs("dir\n", archive); // ...then a command that must be left unread
+    rewind(archive);
+
+    unsigned char header[512];
+    TEST_ASSERT_EQUAL_INT(512, fread(header, 1, 512, archive));
+    TEST_ASSERT_EQUAL_STRING("plain", (char *)header);
+    TEST_ASSERT_EQUAL_MEMORY("ustar", header + 257, 6);
+    rewind(archive);
+
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    TEST_ASSERT_EQUAL_INT(0, ImportTar(directory, &inodes, &byteMaps, &superBlock, data, archive, &count));
+    TEST_ASSERT_EQUAL_INT(2, count);
+    char line[16];
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), archive));
+    TEST_ASSERT_EQUAL_STRING("dir\n", line);
+
+    EXT_SIMPLE_INODE *plain = &inodes.inodes[directory[FindFile(directory, &inodes, "plain")].inode];
+    TEST_ASSERT_EQUAL_INT(11, ReadFileContent(plain, data, buffer));
+    TEST_ASSERT_EQUAL_MEMORY("raw content", buffer, 11);
+    EXT_SIMPLE_INODE *packed = &inodes.inodes[directory[FindFile(directory, &inodes, "packed")].inode];
+    TEST_ASSERT_EQUAL_INT(48, ReadFileContent(packed, data, buffer));
+    TEST_ASSERT_EQUAL_UINT8('z', buffer[47]);
+
+    // Names already taken are reported, and the archive is still read to its end
+    rewind(archive);
+    TEST_ASSERT_EQUAL_INT(-1, ImportTar(directory, &inodes, &byteMaps, &superBlock, data, archive, &count));
+    TEST_ASSERT_EQUAL_INT(0, count);
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), archive));
+    TEST_ASSERT_EQUAL_STRING("dir\n", line);
+
+    // A GNU long link name ('K') does not cut short the name of the next file
+    rewind(archive);
+    TEST_ASSERT_EQUAL_INT(512, fread(header, 1, 512, archive));
+    header[156] = 'K';
+    unsigned int sum = 8 * ' ';
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? 0 : header[i];
+    snprintf((char *)header + 148, 8, "%06o", sum);
+    rewind(archive);
+    TEST_ASSERT_EQUAL_INT(512, fwrite(header, 1, 512, archive));
+    rewind(archive);
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    TEST_ASSERT_EQUAL_INT(0, ImportTar(directory, &inodes, &byteMaps, &superBlock, data, archive, &count));
+    TEST_ASSERT_EQUAL_INT(1, count);
+    TEST_ASSERT_EQUAL_INT(-1, FindFile(directory, &inodes, "plain"));
+    TEST_ASSERT_NOT_EQUAL(-1, FindFile(directory, &inodes, "packed"));
+
+    // A base-256 size past the file limit is skipped whole, payload and padding
+    FILE *big = tmpfile();
+    TEST_ASSERT_NOT_NULL(big);
+    memset(header, 0, sizeof(header));
+    strcpy((char *)header, "big");
+    header[156] = '0';
+    header[124] = 0x80;
+    header[134] = (MAX_FILE_SIZE + 1) >> 8;
+    header[135] = (MAX_FILE_SIZE + 1) & 0xff;
+    sum = 8 * ' ';
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? 0 : header[i];
+    snprintf((char *)header + 148, 8, "%06o", sum);
+    TEST_ASSERT_EQUAL_INT(512, fwrite(header, 1, 512, big));
+    for (int i = 0; i < (MAX_FILE_SIZE + 1 + 511) / 512 * 512; i++)
+        fputc('x', big);
+    rewind(archive);
+    int c;
+    while ((c = fgetc(archive)) != EOF)
+        fputc(c, big);
+    rewind(big);
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    TEST_ASSERT_EQUAL_INT(-1, ImportTar(directory, &inodes, &byteMaps, &superBlock, data, big, &count));
+    TEST_ASSERT_EQUAL_INT(1, count);
+    TEST_ASSERT_EQUAL_INT(-1, FindFile(directory, &inodes, "big"));
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), big));
+    TEST_ASSERT_EQUAL_STRING("dir\n", line);
+
+    // One that would wrap a long is rejected, not read as a negative length
+    rewind(big);
+    memset(header + 124, 0xff, 12);
+    sum = 8 * ' ';
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? 0 : header[i];
+    snprintf((char *)header + 148, 8, "%06o", sum);
+    TEST_ASSERT_EQUAL_INT(512, fwrite(header, 1, 512, big));
+    rewind(big);
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    TEST_ASSERT_EQUAL_INT(-1, ImportTar(directory, &inodes, &byteMaps, &superBlock, data, big, &count));
+    TEST_ASSERT_EQUAL_INT(0, count);
+    fclose(big);
+    fclose(archive);
+}
+
+/* Runs PrintFile with standard output sent to a temporary file, checks its result and returns what it wrote */
+static size_t CapturePrint(EXT_DIRECTORY_ENTRY *directory, EXT_INODE_BLOCK *inodes, EXT_SIMPLE_SUPERBLOCK *superBlock,
+                           EXT_DATA *data, char *name, long offset, size_t length, unsigned char *output, int expected)
+{
+    FILE *capture = tmpfile();
+    TEST_ASSERT_NOT_NULL(capture);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(capture), STDOUT_FILENO);
+    int result = PrintFile(directory, inodes, superBlock, data, name, offset, length);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    TEST_ASSERT_EQUAL_INT(expected, result);
+    rewind(capture);
+    size_t got = fread(output, 1, MAX_FILE_SIZE + 64, capture);
+    fclose(capture);
+    return got;
+}
+
+void test_PrintFile_WritesRangesBinarySafe(void)
+{
+    EXT_SIMPLE_SUPERBLOCK superBlock;
+    EXT_BYTE_MAPS byteMaps;
+    EXT_INODE_BLOCK inodes;
+    EXT_DIRECTORY_ENTRY directory[MAX_FILES];
+    EXT_DATA data[MAX_DATA_BLOCKS];
+    unsigned char content[3 * BLOCK_SIZE];
+    unsigned char output[MAX_FILE_SIZE + 64];
+    InitEmptyFilesystem(&superBlock, &byteMaps, &inodes, directory, data);
+    for (int i = 0; i < (int)sizeof(content); i++)
+        content[i] = (unsigned char)(i % 7 == 0 ? 0 : i); // NUL bytes throughout
+    TEST_ASSERT_EQUAL_INT(0, CreateFileFromBuffer(directory, &inodes, &byteMaps, &superBlock, data, "bin",
+                                                  content, sizeof(content)));
+    const char *header = "Content of file 'bin':\n";
+    size_t headerLength = strlen(header);
+
+    // Whole file: every byte, NULs included, then a newline
+    size_t got = CapturePrint(directory, &inodes, &superBlock, data, "bin", 0, PRINT_TO_END, output, 0);
+    TEST_ASSERT_EQUAL_INT(headerLength + sizeof(content) + 1, got);
+    TEST_ASSERT_EQUAL_MEMORY(header, output, headerLength);
+    TEST_ASSERT_EQUAL_MEMORY(content, output + headerLength, sizeof(content));
+
+    // A range across a block boundary, and the tail from a negative offset
+    got = CapturePrint(directory, &inodes, &superBlock, data, "bin", BLOCK_SIZE - 10, 30, output, 0);
+    TEST_ASSERT_EQUAL_INT(headerLength + 30 + 1, got);
+    TEST_ASSERT_EQUAL_MEMORY(content + BLOCK_SIZE - 10, output + headerLength, 30);
+    got = CapturePrint(directory, &inodes, &superBlock, data, "bin", -5, PRINT_TO_END, output, 0);
+    TEST_ASSERT_EQUAL_INT(headerLength + 5 + 1, got);
+    TEST_ASSERT_EQUAL_MEMORY(content + sizeof(content) - 5, output + headerLength, 5);
+
+    // Past the end there is nothing to print
+    got = CapturePrint(directory, &inodes, &superBlock, data, "bin", sizeof(content) + 1, 10, output, 0);
+    TEST_ASSERT_EQUAL_INT(headerLength + 1, got);
+
+    // The most negative offset clamps to the start instead of overflowing
+    got = CapturePrint(directory, &inodes, &superBlock, data, "bin", LONG_MIN, 3, output, 0);
+    TEST_ASSERT_EQUAL_INT(headerLength + 3 + 1, got);
+    TEST_ASSERT_EQUAL_MEMORY(content, output + headerLength, 3);
+
+    // A corrupt size is refused, and the error stays off the content stream
+    inodes.inodes[directory[FindFile(directory, &inodes, "bin")].inode].file_size = 65535;
+    TEST_ASSERT_EQUAL_INT(0, CapturePrint(directory, &inodes, &superBlock, data, "bin", 0, PRINT_TO_END, output, -1));
+}
+
 int main(void)
 {
     UNITY_BEGIN();
     RUN_TEST(test_CheckCommand_ValidInput);
     RUN_TEST(test_CheckCommand_WithArguments);
+    RUN_TEST(test_CheckCommand_ParsesInPlace);
+    RUN_TEST(test_IsCommand_EveryVerbHasItsOwnSlot);
     RUN_TEST(test_FindFile_FileExists);
     RUN_TEST(test_FindFile_FileNotExists);
     RUN_TEST(test_SaveSuperBlock); // New test added here
+    RUN_TEST(test_CreateFile_DedupSharesIdenticalBlocks);
+    RUN_TEST(test_CopyFile_DedupReusesSourceBlocks);
+    RUN_TEST(test_DeduplicateBlocks_MergesExistingDuplicates);
+    RUN_TEST(test_DeduplicateBlocks_FreedBlocksDropCachedContent);
+    RUN_TEST(test_LzCompress_RoundTrip);
+    RUN_TEST(test_CopyFile_CompressesWhenEnabled);
+    RUN_TEST(test_EstimateEntropy_SeparatesTextFromNoise);
+    RUN_TEST(test_Crc32c_KnownVectorAndFallback);
+    RUN_TEST(test_VerifyChecksums_DetectsCorruptedBlock);
+    RUN_TEST(test_CheckFilesystem_DetectsAndRepairsLeaks);
+    RUN_TEST(test_MountFilesystem_ChecksOnlyAfterUncleanShutdown);
+    RUN_TEST(test_DefragmentFilesystem_MakesFilesContiguous);
+    RUN_TEST(test_DefragmentFilesystem_NeverEvictsMovesAheadOfTheInodes);
+    RUN_TEST(test_CollectFragStats_ReportsRunsAndExtents);
+    RUN_TEST(test_FormatFilesystem_WritesMountableEmptyImage);
+    RUN_TEST(test_ResizeFilesystem_GrowsAndShrinksOnline);
+    RUN_TEST(test_FlushDiscards_PunchesFreedBlocks);
+    RUN_TEST(test_SaveData_StoresZeroBlocksAsHoles);
+    RUN_TEST(test_BlockCache_EvictsToBudgetAndFaultsBackIn);
+    RUN_TEST(test_LoadFilesystemLazy_FaultsDataInOnDemand);
+    RUN_TEST(test_ReadAheadFile_CoalescesSequentialReads);
+    RUN_TEST(test_Library_MountsIndependentImages);
+    RUN_TEST(test_ProcessCommand_DefersSavesInBatchMode);
+    RUN_TEST(test_ProcessCommand_PutStreamsContentFromInput);
+    RUN_TEST(test_ImportExport_CopiesHostFilesAroundTheCache);
+    RUN_TEST(test_ImportTree_ImportsEveryFileUnderADirectory);
+    RUN_TEST(test_Tar_RoundTripsEveryFileAndStopsAtTheEndMarker);
+    RUN_TEST(test_PrintFile_WritesRangesBinarySafe);
+    RUN_TEST(test_Library_ReadViewsPinTheirBlocks);
+    RUN_TEST(test_WriteFileRange_TouchesOnlyTheAffectedBlocks);
     return UNITY_END();
 }